@@ -2,23 +2,50 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+#endif
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 #define INITIAL_WINDOW_WIDTH 1400
 #define INITIAL_WINDOW_HEIGHT 800
-#define SAMPLE_RATE 48000
-#define DISPLAY_DURATION 2.0
+#define DEFAULT_SAMPLE_RATE 48000
+#define DEFAULT_SECONDS 2.0
+#define MAX_CHANNELS 8
+#define MAX_FRAMES 256
+#define WAVETABLE_FRAMES 256
+#define WAVETABLE_FRAME_LENGTH 2048
 #define AMPLITUDE 0.35
 #define DEFAULT_FREQ 440.0
 
 #define WAVEFORM_TOP_MARGIN_RATIO 0.12
 #define WAVEFORM_HEIGHT_RATIO 0.55
-#define UNDO_LEVELS 32
+#define LANE_SCALE 0.45                     // lane heights from centre to a full-AMPLITUDE sample
+#define VIEW_MIN_SPP 0.125                  // deepest zoom: one sample per 8 pixels
+#define VIEW_ZOOM_STEP 1.25                 // per wheel notch
+#define HISTORY_BLOCK 64                    // edit tracking granularity, in samples
+#define HISTORY_CHUNK_BYTES (1 << 20)
+#define HISTORY_POOL_CHUNKS 4
+#define HISTORY_BUDGET_BYTES ((size_t)64 << 20)
 
 typedef enum { SINE, SQUARE, SAWTOOTH, TRIANGLE, CUSTOM } WaveType;
 typedef enum { 
@@ -34,19 +61,390 @@ DrawMode draw_mode = DRAW_FREE;
 double current_freq = DEFAULT_FREQ;
 int playing = 1;
 
-double phase_accumulator = 0.0;
 double phase_increment = 0.0;
+double device_ratio = 1.0;          // sample_rate / have.freq
+
+// Playback state. The phase is 32.32 fixed point and owned by the audio
+// thread; the UI only reads the playhead and requests resets.
+typedef enum { INTERP_LINEAR, INTERP_HERMITE, INTERP_SINC, INTERP_MODES } InterpMode;
+const char *interp_names[INTERP_MODES] = {"linear", "hermite", "sinc"};
+
+#define SINC_TAPS 8
+#define SINC_PHASE_BITS 10
+#define SINC_PHASES (1 << SINC_PHASE_BITS)
+
+float sinc_table[SINC_PHASES][SINC_TAPS];
+
+Uint64 playback_phase = 0;
+SDL_atomic_t playhead_position;     // sample index, for the cursor
+SDL_atomic_t playhead_reset;
+SDL_atomic_t interp_setting;        // InterpMode
+SDL_atomic_t block_cost_ns;         // last audio_callback render time
+
+// Audio-thread instrumentation. audio_callback only bumps atomics and
+// writes into preallocated arrays; the UI reads them for the overlay and
+// the timeline is written out on exit.
+#define LOAD_BINS 20                    // 5% of the buffer period each
+#define TIMELINE_SIZE 16384             // power of two; ~6 minutes at 1024 frames
+
+typedef struct {
+    Uint32 start_us;                    // since the first callback
+    Uint32 cost_ns;
+    Uint32 interval_us;                 // since the previous callback started
+    Uint32 period_us;
+} CallbackRecord;
+
+SDL_atomic_t load_histogram[LOAD_BINS + 1];     // last bin counts overruns
+SDL_atomic_t callback_count;
+SDL_atomic_t callback_late;             // took longer than the buffer period
+SDL_atomic_t callback_gaps;             // started over 1.5 periods after the last
+SDL_atomic_t callback_max_ns;
+CallbackRecord timeline[TIMELINE_SIZE];
+Uint64 callback_first = 0, callback_prev = 0;  // audio thread only
+const char *timeline_path = NULL;
+int show_audio_stats = 0;
+
+// Voices. A fixed pool renders notes from the published waveform on top of
+// the monitor playback; note events reach audio_callback through a
+// single-producer/single-consumer ring and are applied at their sample time.
+#define MAX_VOICES 64
+#define VOICE_CHUNK 1024
+#define NOTE_QUEUE_SIZE 256             // power of two
+#define VOICE_ATTACK_SECONDS 0.005
+#define VOICE_RELEASE_SECONDS 0.08
+
+typedef enum { NOTE_ON, NOTE_OFF } NoteEventType;
+
+typedef struct {
+    Uint32 time;        // audio frame, compared with wraparound
+    int type;
+    int note;
+    float velocity;
+    Uint64 step;        // 32.32 phase increment for NOTE_ON
+} NoteEvent;
+
+typedef struct {
+    int active;
+    int note;
+    int released;
+    Uint64 phase;
+    Uint64 step;
+    float velocity;
+    float env;          // current envelope level
+    float env_delta;    // per-sample change while ramping
+    int env_remaining;  // samples left in the current ramp
+    Uint32 started;
+} Voice;
+
+Voice voices[MAX_VOICES];
+NoteEvent note_queue[NOTE_QUEUE_SIZE];
+SDL_atomic_t note_queue_head;           // written by the producer
+SDL_atomic_t note_queue_tail;           // written by audio_callback
+SDL_atomic_t audio_clock;               // frames rendered so far
+Uint32 audio_frames = 0;                // audio thread's copy of audio_clock
+float voice_scratch[VOICE_CHUNK];
+float audio_planes[MAX_CHANNELS][VOICE_CHUNK];  // per-channel blocks before interleaving
+
+// out[i] += in[i] * (gain + i * delta), bound by select_kernels()
+typedef void (*MixKernel)(float *out, const float *in, int n, float gain, float delta);
+void mix_kernel_scalar(float *out, const float *in, int n, float gain, float delta);
+MixKernel mix_kernel = mix_kernel_scalar;
+
+// out[i * channels + c] = planes[c][i], bound by select_kernels()
+typedef void (*InterleaveKernel)(float *const *planes, int channels, int n, float *out);
+void interleave_kernel_scalar(float *const *planes, int channels, int n, float *out);
+InterleaveKernel interleave_kernel = interleave_kernel_scalar;
+
+// Runs an EQ cascade in place over x[0], x[step], ... from the TDF-II
+// states s, bound by select_kernels()
+typedef struct EqCascade EqCascade;
+typedef void (*EqKernel)(const EqCascade *eq, float *x, int n, int step, double *s);
+void eq_kernel_scalar(const EqCascade *eq, float *x, int n, int step, double *s);
+#ifdef HAVE_X86_SIMD
+void eq_kernel_sse2(const EqCascade *eq, float *x, int n, int step, double *s);
+void eq_kernel_avx2(const EqCascade *eq, float *x, int n, int step, double *s);
+#endif
+EqKernel eq_kernel = eq_kernel_scalar;
+
+// Channels are stored planar: channel c occupies channel_data[c *
+// buffer_samples ..] and every edit works on one plane at a time through
+// waveform_buffer. Dirty ranges, the peak pyramid and undo history all use
+// indices into channel_data; the planes are only interleaved on the way out.
+// A wavetable stacks frame_count single-cycle frames of channel_count
+// planes each, so channel c of frame f is plane f * channel_count + c.
+float *channel_data = NULL;
+float *waveform_buffer = NULL;      // the plane being edited
+int buffer_samples = 0;             // per channel (per frame in a wavetable)
+int channel_count = 1;
+int active_channel = 0;
+int linked_edit = 0;                // edits apply to every channel
+int edit_offset = 0;                // waveform_buffer - channel_data
+int frame_count = 1;                // 1 unless the session is a wavetable
+int active_frame = 0;               // the frame edits go to and the lanes show
+
+// The buffer's own rate. Playback converts to whatever rate the device
+// grants; changing it resamples the buffer and its history.
+const int supported_rates[] = {44100, 48000, 96000, 192000};
+#define SUPPORTED_RATES (int)(sizeof(supported_rates) / sizeof(supported_rates[0]))
+int sample_rate = DEFAULT_SAMPLE_RATE;
+double session_seconds = DEFAULT_SECONDS;   // length of a new session
+
+double buffer_duration(void) {
+    return buffer_samples / (double)sample_rate;
+}
+
+int total_samples(void) {
+    return buffer_samples * channel_count * frame_count;
+}
+
+// Channel c of frame f in channel_data.
+float *frame_plane(int f, int c) {
+    return channel_data + ((size_t)f * channel_count + c) * buffer_samples;
+}
+
+// Point waveform_buffer (and the dirty tracking) at channel c of the
+// active frame.
+void select_channel(int c) {
+    edit_offset = (active_frame * channel_count + c) * buffer_samples;
+    waveform_buffer = channel_data + edit_offset;
+}
+
+// The channels an edit touches: all of them when linked, else the active one.
+int edit_first_channel(void) {
+    return linked_edit ? 0 : active_channel;
+}
+
+int edit_last_channel(void) {
+    return linked_edit ? channel_count - 1 : active_channel;
+}
+
+// Published snapshots for the audio thread (triple buffer).
+// The editor owns one slot, audio_callback owns one, and the third is handed
+// between them through snapshot_shared. SNAPSHOT_FRESH marks a publish the
+// audio thread has not picked up yet. Each slot carries SNAPSHOT_GUARD
+// wrapped samples on both sides so interpolators can read past either end
+// without a modulo; plane p starts snapshot_stride floats after plane 0 and
+// every plane starts on a cache line.
+#define SNAPSHOT_SLOTS 3
+#define SNAPSHOT_INDEX_MASK 3
+#define SNAPSHOT_FRESH 4
+#define SNAPSHOT_GUARD 8
+
+typedef struct {
+    float *storage;
+    float *samples;     // first cache line past storage + SNAPSHOT_GUARD
+    int stale_start;    // range of channel_data this slot has not seen yet
+    int stale_end;
+} WaveSnapshot;
+
+WaveSnapshot snapshots[SNAPSHOT_SLOTS];
+SDL_atomic_t snapshot_shared;
+int snapshot_back = 0;      // editor side
+int snapshot_front = 1;     // audio thread side
+int snapshot_stride = 0;    // buffer_samples + 2 * SNAPSHOT_GUARD, rounded up to a cache line
+
+// Wavetable morph. The editor writes morph_setting; the rest belongs to the
+// audio thread, which blends the frames either side of a position into
+// morph_tables (two sets of channel planes laid out like a snapshot) and
+// crossfades from the last block's position to the new one across each
+// block, so the morph moves at audio rate. The blend at morph_position is
+// kept in morph_tables[morph_current] and only redone when the position
+// moves or a new snapshot comes in.
+SDL_atomic_t morph_setting;             // float bits, 0..1 across the frames
+float *morph_storage = NULL;
+float *morph_tables[2];
+float morph_position = 0.0f;            // in frames, where the last block ended
+const float *morph_current_tables[MAX_CHANNELS];
+int morph_current = 0;                  // morph_tables set behind morph_current_tables
+int morph_cached = 0;                   // morph_current_tables match the front snapshot
+float morph_fade[VOICE_CHUNK];
+float morph_scratch[VOICE_CHUNK];
+
+int dirty_start = -1;       // samples edited since the last publish
+int dirty_end = -1;
+
+// Min/max peak pyramid for drawing. Level k stores one min/max pair per
+// 2 << k samples; only ranges touched since the last draw are rebuilt.
+#define PEAK_MAX_LEVELS 32
+
+float *peak_min[PEAK_MAX_LEVELS];
+float *peak_max[PEAK_MAX_LEVELS];
+int peak_len[PEAK_MAX_LEVELS];
+int peak_levels = 0;
+int peaks_dirty_start = -1;
+int peaks_dirty_end = -1;
+
+SDL_Rect *column_spans = NULL;
+int column_spans_cap = 0;
+
+// The waveform is drawn into a cached layer; edits only redraw the pixel
+// columns that cover the samples they touched.
+SDL_Texture *waveform_layer = NULL;
+int layer_width = 0, layer_height = 0;
+int layer_dirty_start = -1;
+int layer_dirty_end = -1;
+int layer_full_redraw = 1;
+
+// Worker threads push this event to wake the UI loop out of its wait.
+Uint32 wake_event = (Uint32)-1;
+
+// Spectrum analyzer. The UI thread hands a copy of the input to a worker,
+// which windows it, runs a real FFT and leaves dB magnitudes in one of two
+// result slots; spectrum_ready names the slot the panel should draw.
+typedef enum { SPECTRUM_OFF, SPECTRUM_BUFFER, SPECTRUM_CYCLE, SPECTRUM_MODES } SpectrumMode;
+
+#define SPECTRUM_MAX_SIZE (1 << 16)
+#define SPECTRUM_CYCLE_SIZE 1024
+#define SPECTRUM_FLOOR_DB -100.0f
+
+typedef struct {
+    int n;                  // real transform size, a power of two
+    float *tw_re, *tw_im;   // e^(-2 pi i k / n) for k < n/2
+    int *bitrev;            // permutation for the n/2-point complex pass
+    float *re, *im;         // n/2 + 1 entries of scratch / output
+} FFTPlan;
+
+int spectrum_mode = SPECTRUM_OFF;
+int spectrum_dirty = 1;
+SDL_Rect spectrum_rect;
+SDL_Thread *analyzer_thread = NULL;
+SDL_sem *analyzer_wake = NULL;
+SDL_atomic_t analyzer_busy;
+SDL_atomic_t analyzer_quit;
+SDL_atomic_t spectrum_ready;        // result slot to draw, -1 before the first
+float *analyzer_input = NULL;       // SPECTRUM_MAX_SIZE samples
+int analyzer_input_len = 0;
+int analyzer_input_mode = SPECTRUM_OFF;
+float *spectrum_db[2];              // SPECTRUM_MAX_SIZE/2 + 1 bins each
+int spectrum_bins[2];
+int spectrum_result_mode[2];
+
+// Harmonic editor. One cycle is described by per-harmonic amplitudes
+// (relative to AMPLITUDE) and cosine phases, resynthesized with an inverse
+// real FFT and tiled through the buffer.
+#define HARMONIC_COUNT 512
+#define BANDLIMIT_ADDITIVE 64       // below this many partials under Nyquist, classic waves sum them
+#define HARMONIC_FFT_SIZE 4096
+
+int harmonic_mode = 0;
+int harmonic_drag = 0;
+int harmonic_last = -1;         // harmonic painted by the previous motion event
+float harmonic_amp[HARMONIC_COUNT + 1];
+float harmonic_phase[HARMONIC_COUNT + 1];
+FFTPlan harmonic_plan;
+float harmonic_cycle[HARMONIC_FFT_SIZE + 3];    // one cycle plus wrap guards
+
+// Undo/Redo: each edit stores only the sample spans it changed, with their
+// before/after values, in chunks of a pooled arena. Depth is bounded by
+// HISTORY_BUDGET_BYTES rather than a fixed level count. Span offsets index
+// channel_data, so one edit can cover several channels.
+typedef struct HistoryChunk {
+    struct HistoryChunk *next;      // free pool link
+    size_t size;
+    size_t used;
+    int live;                       // edits still referencing this chunk
+} HistoryChunk;
+
+typedef struct {
+    int offset;
+    int length;                     // followed by before[length], after[length]
+} HistorySpan;
+
+typedef struct {
+    HistoryChunk *chunk;
+    HistorySpan *spans;
+    int span_count;
+    size_t bytes;
+} HistoryEdit;
+
+HistoryEdit *history_edits = NULL;
+int history_count = 0;              // edits recorded
+int history_pos = 0;                // edits currently applied
+int history_cap = 0;
+size_t history_bytes = 0;
+
+HistoryChunk *history_chunk = NULL; // chunk new edits are carved from
+HistoryChunk *history_pool = NULL;
+int history_pool_count = 0;
+
+float *history_shadow = NULL;       // channel_data as of the last commit
+void *shadow_map = NULL;            // second mapping of a loaded session backing history_shadow
+size_t shadow_map_bytes = 0;
+Uint8 *history_touched = NULL;      // one flag per HISTORY_BLOCK samples
+int touched_first = -1;
+int touched_last = -1;
+
+int *history_runs = NULL;           // scratch (offset, length) pairs for commits
+int history_runs_cap = 0;
+
+// Session files. The samples start on a page boundary and each edit's
+// spans are stored exactly as history_alloc() lays them out, so a loaded
+// session maps the file privately and uses both in place; pages are read
+// on first touch and edits stay copy-on-write.
+#define SESSION_MAGIC "AGSESSN\0"
+#define SESSION_VERSION 1
+#define SESSION_ALIGN 4096
+#define AUTOSAVE_INTERVAL_MS 60000
 
-float *waveform_buffer = NULL;
-int buffer_samples = 0;
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 header_bytes;
+    Uint64 file_bytes;
+    Uint64 samples_offset;          // SESSION_ALIGN aligned, planar channels
+    Uint64 history_offset;          // 8 aligned, SessionEdit blobs follow
+    Uint32 sample_rate;
+    Uint32 samples;                 // per channel
+    Uint32 history_count;
+    Uint32 history_pos;
+    double frequency;
+    double phase_increment;
+    float brush_intensity;
+    float smear_width;
+    Sint32 draw_mode;
+    Sint32 wave_type;
+    Uint32 channels;                // 0 in files from before multichannel, meaning 1
+    Uint32 frames;                  // 0 in files from before wavetables, meaning 1
+    Uint32 reserved[6];
+    Uint32 checksum;                // FNV-1a of header and edit table, this field zeroed
+} SessionHeader;
+
+typedef struct {
+    Uint64 offset;                  // from the start of the file
+    Uint64 bytes;
+    Uint32 span_count;
+    Uint32 reserved;
+} SessionEdit;
 
-// Undo/Redo
-float *undo_stack[UNDO_LEVELS];
-int undo_index = 0;
-int undo_count = 0;
+void *session_map = NULL;           // mapping that backs waveform_buffer, if any
+size_t session_map_bytes = 0;
+const char *session_path = "session.agsn";
+Uint32 waveform_generation = 0;     // bumped on every publish
+Uint32 saved_generation = 0;
 
 TTF_Font *font = NULL;
 
+// Rendered text textures keyed by (string, colour). Entries that have not been
+// drawn for TEXT_CACHE_MAX_AGE frames are released, so a label that changes
+// ("Saved 003.wav", the undo counter) only costs one rasterization per change.
+// Strings too long for a key are still drawn, rasterized afresh each time.
+#define TEXT_CACHE_SIZE 64
+#define TEXT_CACHE_KEY_LEN 96
+#define TEXT_CACHE_MAX_AGE 120
+
+typedef struct {
+    Uint32 hash;
+    char text[TEXT_CACHE_KEY_LEN];
+    SDL_Color color;
+    SDL_Texture *texture;
+    int w, h;
+    Uint32 last_used;
+} CachedText;
+
+CachedText text_cache[TEXT_CACHE_SIZE];
+CachedText text_uncached;      // the last string too long to cache
+Uint32 text_cache_frame = 1;
+
 typedef struct {
     SDL_Rect rect;
     char label[32];
@@ -58,9 +456,40 @@ Button control_buttons[2];
 Button export_button;
 Button intensity_bar;
 Button smear_width_bar;
+Button morph_bar;        // shown in wavetable mode
 Button undo_button;      // NEW
 Button redo_button;      // NEW
 
+// WAV export. Renders run on a worker thread through render_block and
+// stream to disk in EXPORT_BLOCK-frame pieces. A wavetable is written as
+// it is instead: every frame back to back in one file.
+#define EXPORT_BLOCK 4096
+#define EXPORT_WRITE_BUFFER (1 << 20)
+
+typedef enum { EXPORT_FLOAT32, EXPORT_PCM16, EXPORT_PCM24, EXPORT_FORMATS } ExportFormat;
+const char *export_format_names[EXPORT_FORMATS] = {"float", "pcm16", "pcm24"};
+
+typedef struct {
+    FILE *file;
+    float *storage;         // guard-padded private copy of the waveform
+    float *wave;            // plane p at wave + p * (length + 2 * SNAPSHOT_GUARD)
+    int length;
+    int channels;
+    int frames;             // above 1, write these wavetable frames rather than render
+    double seconds;         // output duration
+    double rate_ratio;      // playback step, 1.0 plays the buffer as drawn
+    int format;
+    int interp;
+    int sample_rate;
+} ExportJob;
+
+int export_format = EXPORT_FLOAT32;
+double export_seconds = 0.0;            // 0 renders one pass over the buffer
+SDL_Thread *export_worker = NULL;
+SDL_atomic_t export_progress;           // permille, written by the worker
+SDL_atomic_t export_result;             // 0 running, 1 saved, -1 failed
+int export_number = 0;
+
 float brush_intensity = 0.7f;
 float smear_width = 0.5f;
 
@@ -72,6 +501,23 @@ int smear_start_idx = -1;
 int smear_current_idx = -1;
 float smear_max_distance = 0.0f;
 
+// Stroke engine. Motion events only queue points; once per frame the queued
+// polyline is applied, so the work follows how far the mouse travelled
+// rather than how many events the driver delivered.
+#define STROKE_MAX_POINTS 256
+#define STROKE_SPACING_PX 8             // stamp spacing for area tools
+
+typedef struct {
+    int idx;
+    float norm_y;
+} StrokePoint;
+
+StrokePoint stroke_points[STROKE_MAX_POINTS];
+int stroke_count = 0;
+StrokePoint stroke_last;                // end of the part already applied
+int stroke_active = 0;                  // stroke_last is valid
+double stroke_travel = 0.0;             // samples since the last stamp
+
 SDL_AudioDeviceID audio_device = 0;
 SDL_AudioSpec have;
 
@@ -82,453 +528,4922 @@ int fullscreen = 0;
 int current_window_width = INITIAL_WINDOW_WIDTH;
 int current_window_height = INITIAL_WINDOW_HEIGHT;
 
+// The visible part of the buffer: the sample at the left edge of the window
+// and how many samples each pixel column covers. Mouse positions, brush
+// reach and waveform columns all go through these.
+double view_offset = 0.0;
+double view_spp = 1.0;
+
 void save_undo_state(void);
 void undo(void);
 void redo(void);
+void history_reset(void);
 
-void generate_classic_waveform() {
-    double total_cycles = current_freq * DISPLAY_DURATION;
-    int num_cycles = (int)round(total_cycles);
-    double actual_freq = num_cycles / DISPLAY_DURATION;
-    current_freq = actual_freq;
+// Samples per pixel with the whole buffer in view.
+double view_full_spp(void) {
+    return buffer_samples / (double)current_window_width;
+}
+
+// Keep the zoom between VIEW_MIN_SPP and the whole buffer and the visible
+// range inside the buffer.
+void clamp_view(void) {
+    if (view_spp < VIEW_MIN_SPP) view_spp = VIEW_MIN_SPP;
+    if (view_spp > view_full_spp()) view_spp = view_full_spp();
+    double max_offset = buffer_samples - current_window_width * view_spp;
+    if (view_offset > max_offset) view_offset = max_offset;
+    if (view_offset < 0.0) view_offset = 0.0;
+    layer_full_redraw = 1;
+}
+
+void reset_view(void) {
+    view_offset = 0.0;
+    view_spp = view_full_spp();
+    clamp_view();
+}
+
+// Show samples [first, last] across the window.
+void set_view_range(int first, int last) {
+    view_offset = first;
+    view_spp = (last - first + 1) / (double)current_window_width;
+    clamp_view();
+}
+
+// Scale samples per pixel by factor, keeping the sample under column x put.
+void zoom_view(double factor, int x) {
+    double anchor = view_offset + x * view_spp;
+    view_spp *= factor;
+    clamp_view();
+    view_offset = anchor - x * view_spp;
+    clamp_view();
+}
+
+void pan_view(double pixels) {
+    view_offset += pixels * view_spp;
+    clamp_view();
+}
+
+// Follow a change of window width; a view that showed the whole buffer
+// still does.
+void resize_view(int old_width) {
+    if (view_spp * old_width >= buffer_samples) reset_view();
+    else clamp_view();
+}
 
-    double samples_per_cycle = (double)buffer_samples / num_cycles;
+// Buffer index under window column x.
+int view_sample(double x) {
+    int idx = (int)floor(view_offset + x * view_spp);
+    return idx < 0 ? 0 : (idx > buffer_samples - 1 ? buffer_samples - 1 : idx);
+}
+
+// Window column of buffer index idx; may fall outside the window.
+double view_x(double idx) {
+    return (idx - view_offset) / view_spp;
+}
+
+// A tool reach of the given on-screen width, in samples.
+int view_radius(int pixels) {
+    int r = (int)(view_spp * pixels);
+    return r > 1 ? r : 1;
+}
+
+// First 64-byte boundary at or after p.
+float *align_cache_line(float *p) {
+    return (float *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+}
+
+// Wrap SNAPSHOT_GUARD samples around both ends of a padded table.
+void fill_guards(float *samples, int length) {
+    for (int k = 1; k <= SNAPSHOT_GUARD; k++) {
+        samples[-k] = samples[((-k % length) + length) % length];
+        samples[length - 1 + k] = samples[(k - 1) % length];
+    }
+}
+
+int snapshot_stride_for(int samples) {
+    return (samples + 2 * SNAPSHOT_GUARD + 15) & ~15;
+}
 
-    for (int i = 0; i < buffer_samples; i++) {
-        double pos = i / samples_per_cycle;
-        double phase = fmod(pos, 1.0);
-        double sample;
-        switch (current_type) {
-            case SINE:     sample = sin(2.0 * M_PI * phase); break;
-            case SQUARE:   sample = (phase < 0.5) ? 1.0 : -1.0; break;
-            case SAWTOOTH: sample = 2.0 * phase - 1.0; break;
-            case TRIANGLE: sample = (phase < 0.5) ? (4.0 * phase - 1.0) : (3.0 - 4.0 * phase); break;
-            default: sample = 0.0;
+void free_snapshot_slots(WaveSnapshot *slots, float **morph) {
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+        free(slots[i].storage);
+        slots[i].storage = NULL;
+        slots[i].samples = NULL;
+    }
+    free(*morph);
+    *morph = NULL;
+}
+
+// Allocate snapshot slots, and morph tables for a wavetable, for planes of
+// `samples` floats. The slots start zeroed and wholly stale so publishes
+// fill them, except that given data, the slot the audio thread starts on
+// already holds a copy of it. Only the arguments are written, so this can
+// run while the audio thread still plays the old slots.
+int alloc_snapshot_slots(WaveSnapshot *slots, float **morph, const float *data, int samples, int channels, int frames) {
+    int stride = snapshot_stride_for(samples);
+    int planes = channels * frames;
+    memset(slots, 0, SNAPSHOT_SLOTS * sizeof(WaveSnapshot));
+    *morph = NULL;
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+        WaveSnapshot *s = &slots[i];
+        s->storage = calloc((size_t)stride * planes + 16, sizeof(float));
+        if (!s->storage) goto fail;
+        s->samples = align_cache_line(s->storage + SNAPSHOT_GUARD);
+        s->stale_start = 0;
+        s->stale_end = planes * samples - 1;
+    }
+    if (data) {
+        WaveSnapshot *front = &slots[1];
+        for (int p = 0; p < planes; p++) {
+            float *plane = front->samples + (size_t)p * stride;
+            memcpy(plane, data + (size_t)p * samples, samples * sizeof(float));
+            fill_guards(plane, samples);
         }
-        waveform_buffer[i] = (float)(sample * AMPLITUDE);
+        front->stale_start = front->stale_end = -1;
     }
-    undo_count = 0;
-    undo_index = 0;
+    if (frames > 1) {
+        *morph = calloc((size_t)2 * channels * stride + 16, sizeof(float));
+        if (!*morph) goto fail;
+    }
+    return 0;
+
+fail:
+    free_snapshot_slots(slots, morph);
+    return -1;
 }
 
-void audio_callback(void *userdata, Uint8 *stream, int len) {
-    float *out = (float *)stream;
-    int num_samples = len / sizeof(float);
+// Hand slots from alloc_snapshot_slots() for the current buffer_samples to
+// the audio thread, which starts on slot 1.
+void use_snapshot_slots(void) {
+    snapshot_stride = snapshot_stride_for(buffer_samples);
+    if (morph_storage) {
+        morph_tables[0] = align_cache_line(morph_storage + SNAPSHOT_GUARD);
+        morph_tables[1] = morph_tables[0] + (size_t)channel_count * snapshot_stride;
+    }
+    snapshot_back = 0;
+    snapshot_front = 1;
+    morph_cached = 0;
+    SDL_AtomicSet(&snapshot_shared, 2);
+}
 
-    if (!playing || !waveform_buffer) {
-        memset(stream, 0, len);
-        return;
+void init_snapshots(void) {
+    alloc_snapshot_slots(snapshots, &morph_storage, NULL, buffer_samples, channel_count, frame_count);
+    use_snapshot_slots();
+}
+
+void free_snapshots(void) {
+    free_snapshot_slots(snapshots, &morph_storage);
+}
+
+void set_morph(float value) {
+    int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    SDL_AtomicSet(&morph_setting, bits);
+}
+
+float get_morph(void) {
+    int bits = SDL_AtomicGet(&morph_setting);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Invalidate published snapshots and peaks without recording an edit.
+// Takes channel_data indices.
+void invalidate_range(int start, int end) {
+    if (start < 0) start = 0;
+    if (end > total_samples() - 1) end = total_samples() - 1;
+    if (start > end) return;
+    if (dirty_start < 0 || start < dirty_start) dirty_start = start;
+    if (end > dirty_end) dirty_end = end;
+    if (peaks_dirty_start < 0 || start < peaks_dirty_start) peaks_dirty_start = start;
+    if (end > peaks_dirty_end) peaks_dirty_end = end;
+    if (layer_dirty_start < 0 || start < layer_dirty_start) layer_dirty_start = start;
+    if (end > layer_dirty_end) layer_dirty_end = end;
+}
+
+// Note an edit to [start, end] of the selected channel; the next
+// save_undo_state() records it.
+void mark_dirty(int start, int end) {
+    if (start < 0) start = 0;
+    if (end > buffer_samples - 1) end = buffer_samples - 1;
+    if (start > end) return;
+    start += edit_offset;
+    end += edit_offset;
+    invalidate_range(start, end);
+    if (!history_touched) return;
+    int b0 = start / HISTORY_BLOCK, b1 = end / HISTORY_BLOCK;
+    memset(history_touched + b0, 1, b1 - b0 + 1);
+    if (touched_first < 0 || b0 < touched_first) touched_first = b0;
+    if (b1 > touched_last) touched_last = b1;
+}
+
+// Hand the edited samples to the audio thread. Only the back slot is written;
+// the swap itself is a single atomic exchange, so audio_callback never waits.
+void publish_waveform(void) {
+    if (dirty_start < 0 || !snapshots[0].samples) return;
+
+    for (int i = 0; i < SNAPSHOT_SLOTS; i++) {
+        WaveSnapshot *s = &snapshots[i];
+        if (s->stale_start < 0 || dirty_start < s->stale_start) s->stale_start = dirty_start;
+        if (dirty_end > s->stale_end) s->stale_end = dirty_end;
     }
+    dirty_start = dirty_end = -1;
 
-    for (int i = 0; i < num_samples; i++) {
-        int idx = (int)phase_accumulator;
-        double frac = phase_accumulator - idx;
-        idx %= buffer_samples;
-        if (idx < 0) idx += buffer_samples;
+    WaveSnapshot *back = &snapshots[snapshot_back];
+    for (int c = back->stale_start / buffer_samples; c <= back->stale_end / buffer_samples; c++) {
+        int base = c * buffer_samples;
+        int first = back->stale_start > base ? back->stale_start - base : 0;
+        int last = back->stale_end < base + buffer_samples - 1 ? back->stale_end - base : buffer_samples - 1;
+        float *plane = back->samples + (size_t)c * snapshot_stride;
+        memcpy(plane + first, channel_data + base + first, (last - first + 1) * sizeof(float));
+        fill_guards(plane, buffer_samples);
+    }
+    back->stale_start = back->stale_end = -1;
+    spectrum_dirty = 1;
+    waveform_generation++;
 
-        float a = waveform_buffer[idx];
-        float b = waveform_buffer[(idx + 1) % buffer_samples];
-        out[i] = a + (b - a) * (float)frac;
+    int prev = SDL_AtomicSet(&snapshot_shared, snapshot_back | SNAPSHOT_FRESH);
+    snapshot_back = prev & SNAPSHOT_INDEX_MASK;
+}
 
-        phase_accumulator += phase_increment;
-        if (phase_accumulator >= buffer_samples)
-            phase_accumulator -= buffer_samples;
+// Allocate an unfilled pyramid over `total` samples; returns its level
+// count, or -1 when out of memory.
+int alloc_peak_levels(float **mins, float **maxs, int *lens, int total) {
+    int levels = 0;
+    int len = (total + 1) / 2;
+    while (levels < PEAK_MAX_LEVELS) {
+        mins[levels] = malloc(len * sizeof(float));
+        maxs[levels] = malloc(len * sizeof(float));
+        lens[levels] = len;
+        levels++;
+        if (!mins[levels - 1] || !maxs[levels - 1]) {
+            for (int k = 0; k < levels; k++) {
+                free(mins[k]);
+                free(maxs[k]);
+            }
+            return -1;
+        }
+        if (len == 1) break;
+        len = (len + 1) / 2;
     }
+    return levels;
 }
 
-void reopen_audio_device(void) {
-    if (audio_device != 0) {
-        SDL_CloseAudioDevice(audio_device);
-        audio_device = 0;
+// Rebuild the pyramid entries that cover data[first, last].
+void build_peak_levels(float *const *mins, float *const *maxs, const int *lens, int levels,
+                       const float *data, int total, int first, int last) {
+    first >>= 1;
+    last >>= 1;
+    for (int j = first; j <= last; j++) {
+        float a = data[2 * j];
+        float b = (2 * j + 1 < total) ? data[2 * j + 1] : a;
+        mins[0][j] = a < b ? a : b;
+        maxs[0][j] = a > b ? a : b;
     }
 
-    SDL_AudioSpec want;
-    SDL_zero(want);
-    want.freq = SAMPLE_RATE;
-    want.format = AUDIO_F32;
-    want.channels = 1;
-    want.samples = 1024;
-    want.callback = audio_callback;
+    for (int k = 1; k < levels; k++) {
+        first >>= 1;
+        last >>= 1;
+        for (int j = first; j <= last; j++) {
+            int c = 2 * j;
+            float mn = mins[k - 1][c], mx = maxs[k - 1][c];
+            if (c + 1 < lens[k - 1]) {
+                if (mins[k - 1][c + 1] < mn) mn = mins[k - 1][c + 1];
+                if (maxs[k - 1][c + 1] > mx) mx = maxs[k - 1][c + 1];
+            }
+            mins[k][j] = mn;
+            maxs[k][j] = mx;
+        }
+    }
+}
 
-    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
-    if (audio_device == 0) {
-        fprintf(stderr, "Failed to open audio: %s\n", SDL_GetError());
-    } else {
-        SDL_PauseAudioDevice(audio_device, playing ? 0 : 1);
+void init_peaks(void) {
+    peak_levels = alloc_peak_levels(peak_min, peak_max, peak_len, total_samples());
+    if (peak_levels < 0) peak_levels = 0;
+    peaks_dirty_start = 0;
+    peaks_dirty_end = total_samples() - 1;
+}
+
+void free_peaks(void) {
+    for (int k = 0; k < peak_levels; k++) {
+        free(peak_min[k]);
+        free(peak_max[k]);
     }
+    peak_levels = 0;
+    free(column_spans);
+    column_spans = NULL;
+    column_spans_cap = 0;
 }
 
-Button make_button(int x, int y, int w, int h, const char *label) {
-    Button b;
-    b.rect = (SDL_Rect){x, y, w, h};
-    strncpy(b.label, label, 31);
-    b.label[31] = '\0';
-    return b;
+// Rebuild the pyramid entries that cover samples edited since the last call.
+void update_peaks(void) {
+    if (peaks_dirty_start < 0 || peak_levels == 0) return;
+    build_peak_levels(peak_min, peak_max, peak_len, peak_levels, channel_data, total_samples(),
+                      peaks_dirty_start, peaks_dirty_end);
+    peaks_dirty_start = peaks_dirty_end = -1;
 }
 
-void init_buttons() {
-    SDL_GetWindowSize(window, &current_window_width, &current_window_height);
+// Min/max of channel_data [first, last], taking the coarsest aligned
+// pyramid entry that fits at each step.
+void peak_range(int first, int last, float *out_min, float *out_max) {
+    float mn = channel_data[first], mx = mn;
+    int i = first;
+    while (i <= last) {
+        int level = -1;
+        while (level + 1 < peak_levels) {
+            int span = 2 << (level + 1);
+            if ((i & (span - 1)) || i + span - 1 > last) break;
+            level++;
+        }
+        if (level < 0) {
+            float v = channel_data[i];
+            if (v < mn) mn = v;
+            if (v > mx) mx = v;
+            i++;
+        } else {
+            int j = i >> (level + 1);
+            if (peak_min[level][j] < mn) mn = peak_min[level][j];
+            if (peak_max[level][j] > mx) mx = peak_max[level][j];
+            i += 2 << level;
+        }
+    }
+    *out_min = mn;
+    *out_max = mx;
+}
 
-    const int margin = 30;
-    const int btn_w = 105;
-    const int btn_h = 18;
-    const int spacing_h = 15;
-    const int spacing_v = 2;
+// Vertical extent of channel c's lane; the waveform area is split evenly.
+void channel_lane(int c, int *top, int *height) {
+    int area_top = (int)(current_window_height * WAVEFORM_TOP_MARGIN_RATIO);
+    int area_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
+    *top = area_top + area_height * c / channel_count;
+    *height = area_top + area_height * (c + 1) / channel_count - *top;
+}
 
-    int waveform_top = (int)(current_window_height * WAVEFORM_TOP_MARGIN_RATIO);
-    int waveform_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
+// The channel whose lane contains window row y.
+int channel_at(int y) {
+    int area_top = (int)(current_window_height * WAVEFORM_TOP_MARGIN_RATIO);
+    int area_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
+    int c = area_height > 0 ? (int)((long long)(y - area_top) * channel_count / area_height) : 0;
+    return c < 0 ? 0 : (c >= channel_count ? channel_count - 1 : c);
+}
 
-    int bottom_row_y = current_window_height - margin - btn_h;
+// One vertical min/max span per pixel column in [x_first, x_last] of
+// channel c over the visible range, submitted in a single call.
+void draw_waveform(SDL_Renderer *renderer, int width, int channel, int y_center, double scale_y, int x_first, int x_last) {
+    if (width <= 0 || x_first > x_last) return;
+    update_peaks();
+    if (width > column_spans_cap) {
+        column_spans = realloc(column_spans, width * sizeof(SDL_Rect));
+        column_spans_cap = width;
+    }
 
-    int row_y[4];
-    row_y[3] = bottom_row_y;
-    row_y[2] = row_y[3] - btn_h - spacing_v;
-    row_y[1] = row_y[2] - btn_h - spacing_v;
-    row_y[0] = row_y[1] - btn_h - spacing_v;
+    int base = (int)(frame_plane(active_frame, channel) - channel_data);
+    for (int x = x_first; x <= x_last; x++) {
+        double left = view_offset + x * view_spp;
+        if (left >= buffer_samples) {
+            x_last = x - 1;
+            break;
+        }
+        int first = (int)left;
+        int last = (int)(left + view_spp);      // overlap by one for continuity
+        if (last > buffer_samples - 1) last = buffer_samples - 1;
+        float mn, mx;
+        peak_range(base + first, base + last, &mn, &mx);
+        int y_top = y_center - (int)(mx / AMPLITUDE * scale_y);
+        int y_bottom = y_center - (int)(mn / AMPLITUDE * scale_y);
+        column_spans[x - x_first] = (SDL_Rect){x, y_top, 1, y_bottom - y_top + 1};
+    }
+    if (x_last >= x_first) SDL_RenderFillRects(renderer, column_spans, x_last - x_first + 1);
+}
 
-    int left_x = margin;
+// Every channel in its own lane; the ones edits go to are drawn brightest.
+void draw_channels(SDL_Renderer *renderer, int width, int x_first, int x_last) {
+    for (int c = 0; c < channel_count; c++) {
+        int top, height;
+        channel_lane(c, &top, &height);
+        int editing = c >= edit_first_channel() && c <= edit_last_channel();
+        SDL_SetRenderDrawColor(renderer, 0, editing ? 255 : 130, editing ? 200 : 105, 255);
+        draw_waveform(renderer, width, c, top + height / 2, height * LANE_SCALE, x_first, x_last);
+    }
+}
 
-    wave_buttons[0] = make_button(left_x + 0*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Sine");
-    wave_buttons[1] = make_button(left_x + 1*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Square");
-    wave_buttons[2] = make_button(left_x + 2*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Sawtooth");
-    wave_buttons[3] = make_button(left_x + 3*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Triangle");
+// Bring the waveform layer up to date. Returns 0 if render targets are not
+// available, in which case the caller draws the waveform directly.
+int update_waveform_layer(SDL_Renderer *renderer, int width, int height) {
+    if (!SDL_RenderTargetSupported(renderer)) return 0;
+    if (!waveform_layer || layer_width != width || layer_height != height) {
+        if (waveform_layer) SDL_DestroyTexture(waveform_layer);
+        waveform_layer = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, width, height);
+        if (!waveform_layer) return 0;
+        SDL_SetTextureBlendMode(waveform_layer, SDL_BLENDMODE_BLEND);
+        layer_width = width;
+        layer_height = height;
+        layer_full_redraw = 1;
+    }
+    if (!layer_full_redraw && layer_dirty_start < 0) return 1;
 
-    const char* row1_labels[5] = {"Free Draw", "Line", "Sine Seg", "Smooth", "Add Free"};
-    for (int i = 0; i < 5; i++) tool_buttons[i] = make_button(left_x + i*(btn_w+spacing_h), row_y[1], btn_w, btn_h, row1_labels[i]);
+    int x_first = 0, x_last = width - 1;
+    if (!layer_full_redraw) {
+        // Columns overlap their right neighbour by a sample, so widen by one.
+        // A range crossing into another channel covers the whole width; one
+        // outside the frame on show or the view changes nothing.
+        int shown_first = active_frame * channel_count * buffer_samples;
+        int shown_last = shown_first + channel_count * buffer_samples - 1;
+        int first = layer_dirty_start % buffer_samples, last = layer_dirty_end % buffer_samples;
+        if (layer_dirty_start / buffer_samples != layer_dirty_end / buffer_samples) {
+            first = 0;
+            last = buffer_samples - 1;
+        }
+        double left = floor(view_x(first)) - 1, right = floor(view_x(last + 1)) + 1;
+        if (layer_dirty_end < shown_first || layer_dirty_start > shown_last || right < 0 || left > width - 1) {
+            layer_dirty_start = layer_dirty_end = -1;
+            return 1;
+        }
+        x_first = left < 0 ? 0 : (int)left;
+        x_last = right > width - 1 ? width - 1 : (int)right;
+    }
+    SDL_SetRenderTarget(renderer, waveform_layer);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderFillRect(renderer, &(SDL_Rect){x_first, 0, x_last - x_first + 1, height});
+    draw_channels(renderer, width, x_first, x_last);
+    SDL_SetRenderTarget(renderer, NULL);
 
-    const char* row2_labels[5] = {"Add Smooth", "Multiply", "Amplify", "Add Sine", "Add Square"};
-    for (int i = 0; i < 5; i++) tool_buttons[5+i] = make_button(left_x + i*(btn_w+spacing_h), row_y[2], btn_w, btn_h, row2_labels[i]);
+    layer_dirty_start = layer_dirty_end = -1;
+    layer_full_redraw = 0;
+    return 1;
+}
 
-    const char* row3_labels[8] = {"Add Saw", "Add Tri", "Blend", "Smear", "Soften", "Add Treb", "Add Mid", "Sub Bass"};
-    for (int i = 0; i < 8; i++) tool_buttons[10+i] = make_button(left_x + i*(btn_w+spacing_h), row_y[3], btn_w, btn_h, row3_labels[i]);
+void free_waveform_layer(void) {
+    if (waveform_layer) SDL_DestroyTexture(waveform_layer);
+    waveform_layer = NULL;
+    layer_full_redraw = 1;
+}
 
-    int right_margin = margin + 20;
-    int control_w = 240;
-    int control_h = 60;
-    int bar_w = 250;
-    int bar_h = 20;
+void wake_main_loop(void) {
+    if (wake_event == (Uint32)-1) return;
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = wake_event;
+    SDL_PushEvent(&event);
+}
 
-    int right_x = current_window_width - right_margin - control_w;
+void fft_init(FFTPlan *p, int n) {
+    int m = n / 2;
+    p->n = n;
+    p->tw_re = malloc(m * sizeof(float));
+    p->tw_im = malloc(m * sizeof(float));
+    p->bitrev = malloc(m * sizeof(int));
+    p->re = malloc((m + 1) * sizeof(float));
+    p->im = malloc((m + 1) * sizeof(float));
+    for (int k = 0; k < m; k++) {
+        p->tw_re[k] = (float)cos(2.0 * M_PI * k / n);
+        p->tw_im[k] = (float)-sin(2.0 * M_PI * k / n);
+    }
+    int bits = 0;
+    while ((1 << bits) < m) bits++;
+    for (int k = 0; k < m; k++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) if (k & (1 << b)) r |= 1 << (bits - 1 - b);
+        p->bitrev[k] = r;
+    }
+}
 
-    export_button = make_button(right_x, waveform_top + 20, control_w, control_h, "Export WAV");
-    control_buttons[0] = make_button(right_x, current_window_height - margin - control_h - 80, control_w, control_h, "Play / Pause");
-    control_buttons[1] = make_button(right_x, current_window_height - margin - control_h, control_w + 50, 50, "Freq: 440.0 Hz");
+void fft_free(FFTPlan *p) {
+    free(p->tw_re);
+    free(p->tw_im);
+    free(p->bitrev);
+    free(p->re);
+    free(p->im);
+    memset(p, 0, sizeof(*p));
+}
 
-    // NEW: Undo and Redo buttons (below Play/Pause)
-    undo_button = make_button(right_x, control_buttons[0].rect.y + control_h + 10, 115, 40, "Undo");
-    redo_button = make_button(right_x + 125, control_buttons[0].rect.y + control_h + 10, 115, 40, "Redo");
+// In-place forward radix-2 FFT of n/2 complex points in p->re/p->im.
+// Twiddles for the half-size pass are every other entry of the n table.
+void fft_complex(FFTPlan *p) {
+    int m = p->n / 2;
+    float *re = p->re, *im = p->im;
+    for (int k = 0; k < m; k++) {
+        int r = p->bitrev[k];
+        if (r > k) {
+            float t = re[k]; re[k] = re[r]; re[r] = t;
+            t = im[k]; im[k] = im[r]; im[r] = t;
+        }
+    }
+    for (int len = 2; len <= m; len <<= 1) {
+        int half = len / 2;
+        int stride = p->n / len;
+        for (int base = 0; base < m; base += len) {
+            for (int j = 0; j < half; j++) {
+                float wr = p->tw_re[j * stride], wi = p->tw_im[j * stride];
+                int a = base + j, b = a + half;
+                float xr = re[b] * wr - im[b] * wi;
+                float xi = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - xr; im[b] = im[a] - xi;
+                re[a] += xr; im[a] += xi;
+            }
+        }
+    }
+}
 
-    intensity_bar = make_button(current_window_width - right_margin - bar_w, export_button.rect.y + control_h + 30, bar_w, bar_h, "Intensity");
-    smear_width_bar = make_button(current_window_width - right_margin - bar_w, intensity_bar.rect.y + bar_h + 20, bar_w, bar_h, "Smear Width");
+// Real forward FFT of n samples. Bins 0..n/2 are left in p->re/p->im.
+// The input is packed as n/2 complex points and split afterwards.
+void rfft(FFTPlan *p, const float *in) {
+    int m = p->n / 2;
+    for (int k = 0; k < m; k++) {
+        p->re[k] = in[2 * k];
+        p->im[k] = in[2 * k + 1];
+    }
+    fft_complex(p);
+
+    float z0r = p->re[0], z0i = p->im[0];
+    for (int k = 1; k <= m / 2; k++) {
+        int j = m - k;
+        float ar = p->re[k], ai = p->im[k], br = p->re[j], bi = p->im[j];
+        // even/odd halves for bins k and m-k
+        float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+        float or_ = 0.5f * (ai + bi), oi = -0.5f * (ar - br);
+        float wr = p->tw_re[k], wi = p->tw_im[k];
+        float tr = or_ * wr - oi * wi, ti = or_ * wi + oi * wr;
+        p->re[k] = er + tr;
+        p->im[k] = ei + ti;
+        // bin m-k: conjugate-symmetric partner, twiddle W^(m-k) = -conj(W^k)
+        float tr2 = oi * wi - or_ * wr, ti2 = or_ * wi + oi * wr;
+        p->re[j] = er + tr2;
+        p->im[j] = -ei + ti2;
+    }
+    p->re[0] = z0r + z0i; p->im[0] = 0.0f;
+    p->re[m] = z0r - z0i; p->im[m] = 0.0f;
 }
 
-void export_wav() {
-    uint32_t sample_rate = SAMPLE_RATE;
-    static int export_count = 0;
-    char filename[64];
-    FILE *test;
+int analyzer_main(void *data) {
+    FFTPlan plans[2];
+    memset(plans, 0, sizeof(plans));
+    float *windowed = malloc(SPECTRUM_MAX_SIZE * sizeof(float));
 
-    do {
-        export_count++;
-        snprintf(filename, sizeof(filename), "waveform_%03d.wav", export_count);
-        test = fopen(filename, "rb");
-        if (test) fclose(test);
-    } while (test);
+    while (1) {
+        SDL_SemWait(analyzer_wake);
+        if (SDL_AtomicGet(&analyzer_quit)) break;
+
+        int n = analyzer_input_len;
+        FFTPlan *p = (plans[0].n == n) ? &plans[0] : (plans[1].n == n) ? &plans[1] : NULL;
+        if (!p) {
+            p = plans[1].n ? &plans[0] : &plans[1];
+            if (p->n) fft_free(p);
+            fft_init(p, n);
+        }
+
+        // The cycle is periodic, so it is analyzed unwindowed and every bin
+        // is a harmonic; the long view uses a Hann window.
+        float gain = 2.0f / n;
+        if (analyzer_input_mode == SPECTRUM_BUFFER) {
+            for (int i = 0; i < n; i++) windowed[i] = analyzer_input[i] * (float)(0.5 - 0.5 * cos(2.0 * M_PI * i / n));
+            gain *= 2.0f;
+        } else {
+            memcpy(windowed, analyzer_input, n * sizeof(float));
+        }
+        rfft(p, windowed);
+
+        int slot = SDL_AtomicGet(&spectrum_ready) == 0 ? 1 : 0;
+        int bins = n / 2 + 1;
+        for (int k = 0; k < bins; k++) {
+            float mag = sqrtf(p->re[k] * p->re[k] + p->im[k] * p->im[k]) * gain / (float)AMPLITUDE;
+            float db = 20.0f * log10f(mag + 1e-9f);
+            spectrum_db[slot][k] = db < SPECTRUM_FLOOR_DB ? SPECTRUM_FLOOR_DB : db;
+        }
+        spectrum_bins[slot] = bins;
+        spectrum_result_mode[slot] = analyzer_input_mode;
+        SDL_AtomicSet(&spectrum_ready, slot);
+        SDL_AtomicSet(&analyzer_busy, 0);
+        wake_main_loop();
+    }
+
+    fft_free(&plans[0]);
+    fft_free(&plans[1]);
+    free(windowed);
+    return 0;
+}
+
+void start_analyzer(void) {
+    if (analyzer_thread) return;
+    analyzer_input = malloc(SPECTRUM_MAX_SIZE * sizeof(float));
+    spectrum_db[0] = malloc((SPECTRUM_MAX_SIZE / 2 + 1) * sizeof(float));
+    spectrum_db[1] = malloc((SPECTRUM_MAX_SIZE / 2 + 1) * sizeof(float));
+    SDL_AtomicSet(&spectrum_ready, -1);
+    SDL_AtomicSet(&analyzer_busy, 0);
+    SDL_AtomicSet(&analyzer_quit, 0);
+    analyzer_wake = SDL_CreateSemaphore(0);
+    analyzer_thread = SDL_CreateThread(analyzer_main, "analyzer", NULL);
+}
+
+void stop_analyzer(void) {
+    if (!analyzer_thread) return;
+    SDL_AtomicSet(&analyzer_quit, 1);
+    SDL_SemPost(analyzer_wake);
+    SDL_WaitThread(analyzer_thread, NULL);
+    SDL_DestroySemaphore(analyzer_wake);
+    free(analyzer_input);
+    free(spectrum_db[0]);
+    free(spectrum_db[1]);
+    analyzer_thread = NULL;
+}
+
+// Queue a new analysis if the published waveform changed and the worker is
+// idle. Edits arriving mid-analysis are picked up by the next request.
+void request_spectrum(void) {
+    if (spectrum_mode == SPECTRUM_OFF || !spectrum_dirty) return;
+    start_analyzer();
+    if (!analyzer_thread || SDL_AtomicGet(&analyzer_busy)) return;
+
+    if (spectrum_mode == SPECTRUM_BUFFER) {
+        int n = SPECTRUM_MAX_SIZE;
+        while (n > buffer_samples) n >>= 1;
+        memcpy(analyzer_input, waveform_buffer, n * sizeof(float));
+        analyzer_input_len = n;
+    } else {
+        int cycles = (int)round(current_freq * buffer_duration());
+        double cycle_len = buffer_samples / (double)(cycles > 0 ? cycles : 1);
+        for (int i = 0; i < SPECTRUM_CYCLE_SIZE; i++) {
+            double pos = i * cycle_len / SPECTRUM_CYCLE_SIZE;
+            int idx = (int)pos;
+            float frac = (float)(pos - idx);
+            float a = waveform_buffer[idx % buffer_samples], b = waveform_buffer[(idx + 1) % buffer_samples];
+            analyzer_input[i] = a + (b - a) * frac;
+        }
+        analyzer_input_len = SPECTRUM_CYCLE_SIZE;
+    }
+    analyzer_input_mode = spectrum_mode;
+    spectrum_dirty = 0;
+    SDL_AtomicSet(&analyzer_busy, 1);
+    SDL_SemPost(analyzer_wake);
+}
+
+void draw_text(SDL_Renderer *renderer, const char *text, SDL_Color color, int x, int y);
+
+void draw_spectrum(SDL_Renderer *renderer) {
+    SDL_Rect r = spectrum_rect;
+    if (spectrum_mode == SPECTRUM_OFF || r.w <= 0 || r.h <= 0) return;
+    SDL_SetRenderDrawColor(renderer, 30, 30, 55, 255);
+    SDL_RenderFillRect(renderer, &r);
+    SDL_SetRenderDrawColor(renderer, 90, 90, 130, 255);
+    SDL_RenderDrawRect(renderer, &r);
+
+    int slot = analyzer_thread ? SDL_AtomicGet(&spectrum_ready) : -1;
+    if (slot >= 0 && spectrum_result_mode[slot] == spectrum_mode) {
+        const float *db = spectrum_db[slot];
+        int bins = spectrum_bins[slot];
+        if (r.w > column_spans_cap) {
+            column_spans = realloc(column_spans, r.w * sizeof(SDL_Rect));
+            column_spans_cap = r.w;
+        }
+        int count = 0;
+        if (spectrum_mode == SPECTRUM_BUFFER) {
+            // Log frequency axis from 20 Hz to Nyquist, peak bin per column.
+            double bin_hz = sample_rate / (2.0 * (bins - 1));
+            double ratio = (sample_rate / 2.0) / 20.0;
+            for (int x = 0; x < r.w; x++) {
+                int b0 = (int)(20.0 * pow(ratio, x / (double)r.w) / bin_hz);
+                int b1 = (int)(20.0 * pow(ratio, (x + 1) / (double)r.w) / bin_hz);
+                if (b0 >= bins) break;
+                if (b1 >= bins) b1 = bins - 1;
+                float peak = SPECTRUM_FLOOR_DB;
+                for (int b = b0; b <= b1; b++) if (db[b] > peak) peak = db[b];
+                int hgt = (int)((peak - SPECTRUM_FLOOR_DB) / -SPECTRUM_FLOOR_DB * (r.h - 2));
+                column_spans[count++] = (SDL_Rect){r.x + x, r.y + r.h - 1 - hgt, 1, hgt};
+            }
+        } else {
+            // One bar per harmonic.
+            int harmonics = bins - 1 < 128 ? bins - 1 : 128;
+            double bar_w = r.w / (double)harmonics;
+            for (int h = 1; h <= harmonics; h++) {
+                int hgt = (int)((db[h] - SPECTRUM_FLOOR_DB) / -SPECTRUM_FLOOR_DB * (r.h - 2));
+                int x0 = r.x + (int)((h - 1) * bar_w) + 1;
+                int w = (int)(bar_w) - 1;
+                column_spans[count++] = (SDL_Rect){x0, r.y + r.h - 1 - hgt, w > 1 ? w : 1, hgt};
+            }
+        }
+        SDL_SetRenderDrawColor(renderer, 255, 190, 80, 255);
+        SDL_RenderFillRects(renderer, column_spans, count);
+    }
+    draw_text(renderer, spectrum_mode == SPECTRUM_BUFFER ? "Spectrum: whole buffer, 20 Hz - Nyquist (A)" : "Spectrum: one cycle, harmonics 1-128 (A)",
+              (SDL_Color){255,220,160,255}, r.x + 6, r.y + 4);
+}
+
+// Inverse of rfft(): bins 0..n/2 in p->re/p->im become n real samples.
+void irfft(FFTPlan *p, float *out) {
+    int m = p->n / 2;
+    float xr0 = p->re[0], xrm = p->re[m];
+    for (int k = 1; k <= m / 2; k++) {
+        int j = m - k;
+        float ar = p->re[k], ai = p->im[k], br = p->re[j], bi = p->im[j];
+        float wr = p->tw_re[k], wi = p->tw_im[k];
+        // E = (X[k] + conj X[j]) / 2, O = (X[k] - conj X[j]) / 2 * conj(W^k)
+        float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+        float dr = 0.5f * (ar - br), di = 0.5f * (ai + bi);
+        float or_ = dr * wr + di * wi, oi = di * wr - dr * wi;
+        // partner bin: E' = conj E, O' = conj(O) scaled by -W^k / conj(W^k)
+        float pr = 0.5f * (br - ar), pi = 0.5f * (bi + ai);
+        float o2r = -(pr * wr - pi * wi), o2i = -(pr * wi + pi * wr);
+        // Z = E + iO, stored conjugated for the inverse pass
+        p->re[k] = er - oi;
+        p->im[k] = -(ei + or_);
+        p->re[j] = er - o2i;
+        p->im[j] = -(-ei + o2r);
+    }
+    p->re[0] = 0.5f * (xr0 + xrm);
+    p->im[0] = -0.5f * (xr0 - xrm);
+    fft_complex(p);
+    float scale = 1.0f / m;
+    for (int k = 0; k < m; k++) {
+        out[2 * k] = p->re[k] * scale;
+        out[2 * k + 1] = -p->im[k] * scale;
+    }
+}
+
+int buffer_cycles(void) {
+    int cycles = (int)round(current_freq * buffer_duration());
+    return cycles > 0 ? cycles : 1;
+}
+
+// Highest harmonic below Nyquist at the current pitch.
+int harmonic_limit(void) {
+    int limit = (int)((sample_rate / 2.0 - 1.0) / (buffer_cycles() / buffer_duration()));
+    return limit < HARMONIC_COUNT ? (limit > 1 ? limit : 1) : HARMONIC_COUNT;
+}
+
+// Seed the editor from one cycle of the current buffer.
+void harmonics_from_waveform(void) {
+    if (!harmonic_plan.n) fft_init(&harmonic_plan, HARMONIC_FFT_SIZE);
+    double cycle_len = buffer_samples / (double)buffer_cycles();
+    for (int i = 0; i < HARMONIC_FFT_SIZE; i++) {
+        double pos = i * cycle_len / HARMONIC_FFT_SIZE;
+        int idx = (int)pos;
+        float frac = (float)(pos - idx);
+        float a = waveform_buffer[idx % buffer_samples], b = waveform_buffer[(idx + 1) % buffer_samples];
+        harmonic_cycle[i] = a + (b - a) * frac;
+    }
+    rfft(&harmonic_plan, harmonic_cycle);
+    float gain = 2.0f / HARMONIC_FFT_SIZE / (float)AMPLITUDE;
+    for (int h = 0; h <= HARMONIC_COUNT; h++) {
+        float amp = sqrtf(harmonic_plan.re[h] * harmonic_plan.re[h] + harmonic_plan.im[h] * harmonic_plan.im[h]) * gain;
+        harmonic_amp[h] = (h == 0 || amp < 1e-4f) ? 0.0f : fminf(amp, 1.0f);
+        harmonic_phase[h] = atan2f(harmonic_plan.im[h], harmonic_plan.re[h]);
+    }
+}
+
+// Rebuild the buffer from the harmonic table: one inverse FFT for the
+// cycle, Hermite reads for one super-period (the shortest run holding a
+// whole number of cycles), then plain copies for the rest.
+void resynthesize_harmonics(void) {
+    if (!harmonic_plan.n) fft_init(&harmonic_plan, HARMONIC_FFT_SIZE);
+    int m = HARMONIC_FFT_SIZE / 2;
+    int limit = harmonic_limit();
+    float scale = HARMONIC_FFT_SIZE / 2.0f * (float)AMPLITUDE;
+    memset(harmonic_plan.re, 0, (m + 1) * sizeof(float));
+    memset(harmonic_plan.im, 0, (m + 1) * sizeof(float));
+    for (int h = 1; h <= limit; h++) {
+        harmonic_plan.re[h] = harmonic_amp[h] * scale * cosf(harmonic_phase[h]);
+        harmonic_plan.im[h] = harmonic_amp[h] * scale * sinf(harmonic_phase[h]);
+    }
+    irfft(&harmonic_plan, harmonic_cycle + 1);
+
+    // Only scale down if the painted spectrum would clip.
+    float peak = 0.0f;
+    for (int i = 1; i <= HARMONIC_FFT_SIZE; i++) peak = fmaxf(peak, fabsf(harmonic_cycle[i]));
+    if (peak > AMPLITUDE) {
+        float g = (float)AMPLITUDE / peak;
+        for (int i = 1; i <= HARMONIC_FFT_SIZE; i++) harmonic_cycle[i] *= g;
+    }
+    harmonic_cycle[0] = harmonic_cycle[HARMONIC_FFT_SIZE];
+    harmonic_cycle[HARMONIC_FFT_SIZE + 1] = harmonic_cycle[1];
+    harmonic_cycle[HARMONIC_FFT_SIZE + 2] = harmonic_cycle[2];
+
+    int cycles = buffer_cycles();
+    int a = buffer_samples, b = cycles;
+    while (b) { int t = a % b; a = b; b = t; }
+    int period = buffer_samples / a;
+    Uint64 cycles_per_period = cycles / a;
+    for (int i = 0; i < period; i++) {
+        double pos = (double)((i * cycles_per_period) % period) * HARMONIC_FFT_SIZE / period;
+        int idx = (int)pos;
+        float t = (float)(pos - idx);
+        const float *y = harmonic_cycle + idx;     // y[1] is sample idx
+        float c1 = 0.5f * (y[2] - y[0]);
+        float c2 = y[0] - 2.5f * y[1] + 2.0f * y[2] - 0.5f * y[3];
+        float c3 = 0.5f * (y[3] - y[0]) + 1.5f * (y[1] - y[2]);
+        waveform_buffer[i] = ((c3 * t + c2) * t + c1) * t + y[1];
+    }
+    for (int i = period; i < buffer_samples; i += period) {
+        int len = buffer_samples - i < period ? buffer_samples - i : period;
+        memcpy(waveform_buffer + i, waveform_buffer, len * sizeof(float));
+    }
+    current_type = CUSTOM;
+    mark_dirty(0, buffer_samples - 1);
+    for (int c = edit_first_channel(); c <= edit_last_channel(); c++) {
+        if (c == active_channel) continue;
+        select_channel(c);
+        memcpy(waveform_buffer, frame_plane(active_frame, active_channel), buffer_samples * sizeof(float));
+        mark_dirty(0, buffer_samples - 1);
+    }
+    select_channel(active_channel);
+    publish_waveform();
+}
+
+// Paint the harmonic under (x, y) in the editor panel, filling in any
+// harmonics skipped since the previous motion event. Shift edits phase.
+void paint_harmonics(int x, int y, int edit_phase) {
+    SDL_Rect r = spectrum_rect;
+    int count = harmonic_limit();
+    int h = 1 + (int)((x - r.x) / (double)r.w * count);
+    if (h < 1) h = 1;
+    if (h > count) h = count;
+    float v = (float)(r.y + r.h - 1 - y) / (r.h - 2);
+    v = fmaxf(0.0f, fminf(1.0f, v));
+    int from = harmonic_last < 0 ? h : harmonic_last;
+    int lo = from < h ? from : h, hi = from < h ? h : from;
+    for (int k = lo; k <= hi; k++) {
+        if (edit_phase) harmonic_phase[k] = (float)((v * 2.0f - 1.0f) * M_PI);
+        else harmonic_amp[k] = v;
+    }
+    harmonic_last = h;
+    resynthesize_harmonics();
+}
+
+void draw_harmonics(SDL_Renderer *renderer) {
+    SDL_Rect r = spectrum_rect;
+    if (r.w <= 0 || r.h <= 0) return;
+    SDL_SetRenderDrawColor(renderer, 30, 40, 45, 255);
+    SDL_RenderFillRect(renderer, &r);
+    SDL_SetRenderDrawColor(renderer, 90, 130, 130, 255);
+    SDL_RenderDrawRect(renderer, &r);
+
+    int count = harmonic_limit();
+    if (count > column_spans_cap) {
+        column_spans = realloc(column_spans, count * sizeof(SDL_Rect));
+        column_spans_cap = count;
+    }
+    double bar_w = r.w / (double)count;
+    for (int h = 1; h <= count; h++) {
+        int hgt = (int)(harmonic_amp[h] * (r.h - 2));
+        int x0 = r.x + (int)((h - 1) * bar_w);
+        int w = (int)bar_w - (bar_w > 3 ? 1 : 0);
+        column_spans[h - 1] = (SDL_Rect){x0, r.y + r.h - 1 - hgt, w > 1 ? w : 1, hgt};
+    }
+    SDL_SetRenderDrawColor(renderer, 120, 230, 200, 255);
+    SDL_RenderFillRects(renderer, column_spans, count);
+
+    char title[96];
+    snprintf(title, sizeof(title), "Harmonics 1-%d: drag to paint, Shift+drag for phase (H)", count);
+    draw_text(renderer, title, (SDL_Color){180,255,230,255}, r.x + 6, r.y + 4);
+}
+
+// Two-sample polynomial correction for a unit step at phase 0 (PolyBLEP).
+// t is the phase in cycles and dt the phase advance per sample.
+double poly_blep(double t, double dt) {
+    if (t < dt) { double x = 1.0 - t / dt; return -0.5 * x * x; }
+    if (t > 1.0 - dt) { double x = (t - 1.0) / dt + 1.0; return 0.5 * x * x; }
+    return 0.0;
+}
+
+// Its integral: the correction for a unit change of slope per sample
+// (PolyBLAMP).
+double poly_blamp(double t, double dt) {
+    if (t < dt) { double x = 1.0 - t / dt; return x * x * x / 6.0; }
+    if (t > 1.0 - dt) { double x = (t - 1.0) / dt + 1.0; return x * x * x / 6.0; }
+    return 0.0;
+}
+
+// A classic wave at phase t, in -1..1. With few partials under Nyquist
+// they are summed outright (sin and cos of h*x by recurrence); otherwise
+// the corners get PolyBLEP/PolyBLAMP corrections.
+double classic_value(int type, double t, double dt, int harmonics) {
+    if (type == SINE) return sin(2.0 * M_PI * t);
+    if (harmonics < BANDLIMIT_ADDITIVE) {
+        double c1 = cos(2.0 * M_PI * t), s1 = sin(2.0 * M_PI * t);
+        double s = s1, c = c1, s_prev = 0.0, c_prev = 1.0, sum = 0.0;
+        for (int h = 1; h <= harmonics; h++) {
+            switch (type) {
+                case SQUARE:   if (h & 1) sum += 4.0 / M_PI * s / h; break;
+                case SAWTOOTH: sum -= 2.0 / M_PI * s / h; break;
+                case TRIANGLE: if (h & 1) sum -= 8.0 / (M_PI * M_PI) * c / ((double)h * h); break;
+            }
+            double s_next = 2.0 * c1 * s - s_prev, c_next = 2.0 * c1 * c - c_prev;
+            s_prev = s; s = s_next;
+            c_prev = c; c = c_next;
+        }
+        return sum;
+    }
+    double half = t < 0.5 ? t + 0.5 : t - 0.5;
+    switch (type) {
+        case SQUARE:   return (t < 0.5 ? 1.0 : -1.0) + 2.0 * (poly_blep(t, dt) - poly_blep(half, dt));
+        case SAWTOOTH: return 2.0 * t - 1.0 - 2.0 * poly_blep(t, dt);
+        case TRIANGLE: return (t < 0.5 ? 4.0 * t - 1.0 : 3.0 - 4.0 * t) + 8.0 * dt * (poly_blamp(t, dt) - poly_blamp(half, dt));
+    }
+    return 0.0;
+}
+
+// Fill `samples` floats with `cycles` periods of a band-limited classic
+// wave. Only one super-period (the shortest run holding a whole number of
+// cycles) is evaluated; the rest is copies. Touches nothing but out, so the
+// offline renderer can call it from any thread.
+void fill_classic_waveform(float *out, int samples, int type, int cycles) {
+    int a = samples, b = cycles;
+    while (b) { int t = a % b; a = b; b = t; }
+    int period = samples / a;
+    Uint64 cycles_per_period = cycles / a;
+    double dt = (double)cycles / samples;
+    int harmonics = (int)ceil(0.5 / dt) - 1;        // strictly below Nyquist
+
+    for (int i = 0; i < period; i++) {
+        double t = (double)((i * cycles_per_period) % period) / period;
+        out[i] = (float)(classic_value(type, t, dt, harmonics) * AMPLITUDE);
+    }
+    for (int i = period; i < samples; i += period) {
+        int len = samples - i < period ? samples - i : period;
+        memcpy(out + i, out, len * sizeof(float));
+    }
+}
+
+void generate_classic_waveform() {
+    if (frame_count > 1) {
+        // A wavetable frame is always one cycle, whatever frequency was
+        // asked for, so the pitch of the other frames stays put. Only the
+        // frame on show changes, as an undoable edit.
+        current_freq = 1.0 / buffer_duration();
+        for (int c = 0; c < channel_count; c++) {
+            select_channel(c);
+            fill_classic_waveform(waveform_buffer, buffer_samples, current_type, 1);
+            mark_dirty(0, buffer_samples - 1);
+        }
+        select_channel(active_channel);
+        publish_waveform();
+        save_undo_state();
+        return;
+    }
+
+    double total_cycles = current_freq * buffer_duration();
+    int num_cycles = total_cycles >= 1.0 ? (int)round(total_cycles) : 1;
+    double actual_freq = num_cycles / buffer_duration();
+    current_freq = actual_freq;
+    fill_classic_waveform(channel_data, buffer_samples, current_type, num_cycles);
+    for (int c = 1; c < channel_count; c++)
+        memcpy(channel_data + (size_t)c * buffer_samples, channel_data, buffer_samples * sizeof(float));
+    history_reset();
+    invalidate_range(0, total_samples() - 1);
+    publish_waveform();
+}
+
+// Blackman-windowed sinc, one row of SINC_TAPS coefficients per fractional
+// phase. Tap k weighs table[idx - SINC_TAPS/2 + 1 + k].
+void init_sinc_table(void) {
+    for (int p = 0; p < SINC_PHASES; p++) {
+        double frac = p / (double)SINC_PHASES;
+        double sum = 0.0;
+        for (int k = 0; k < SINC_TAPS; k++) {
+            double x = (k - (SINC_TAPS / 2 - 1)) - frac;
+            double sinc = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            double t = (x + SINC_TAPS / 2) / SINC_TAPS;
+            double window = 0.42 - 0.5 * cos(2.0 * M_PI * t) + 0.08 * cos(4.0 * M_PI * t);
+            sinc_table[p][k] = (float)(sinc * window);
+            sum += sinc * window;
+        }
+        for (int k = 0; k < SINC_TAPS; k++) sinc_table[p][k] = (float)(sinc_table[p][k] / sum);
+    }
+}
+
+int valid_sample_rate(int rate) {
+    for (int i = 0; i < SUPPORTED_RATES; i++)
+        if (supported_rates[i] == rate) return 1;
+    return 0;
+}
+
+// Polyphase windowed-sinc resampler for converting the buffer between
+// rates. The ratio is reduced to up/down and each of the `up` fractional
+// phases gets its own row of taps, so an output sample is one dot product.
+// The input is treated as a loop, the way it plays.
+#define RESAMPLE_ZEROS 16               // sinc zero crossings per side at full bandwidth
+
+typedef struct {
+    int up, down;
+    int taps;                           // even; tap k weighs in[floor(x) - taps/2 + 1 + k]
+    int in_len, out_len;
+    float *table;                       // up rows of taps
+} Resampler;
+
+int init_resampler(Resampler *rs, int from_rate, int to_rate, int in_len) {
+    int a = from_rate, b = to_rate;
+    while (b) { int t = a % b; a = b; b = t; }
+    rs->up = to_rate / a;
+    rs->down = from_rate / a;
+    // Cut off a little below the lower of the two Nyquist frequencies. The
+    // same rate only copies, which two taps of an unscaled sinc already do.
+    double cutoff = 1.0;
+    int half = 1;
+    if (rs->up != rs->down) {
+        cutoff = 0.96 * (rs->up < rs->down ? (double)rs->up / rs->down : 1.0);
+        half = (int)ceil(RESAMPLE_ZEROS / cutoff);
+    }
+    rs->taps = 2 * half;
+    rs->in_len = in_len;
+    rs->out_len = (int)(((Sint64)in_len * rs->up + rs->down / 2) / rs->down);
+    if (rs->out_len < 1) rs->out_len = 1;
+    rs->table = malloc((size_t)rs->up * rs->taps * sizeof(float));
+    if (!rs->table) return -1;
+
+    for (int p = 0; p < rs->up; p++) {
+        float *row = rs->table + (size_t)p * rs->taps;
+        double frac = p / (double)rs->up;
+        double sum = 0.0;
+        for (int k = 0; k < rs->taps; k++) {
+            double x = (k - (half - 1)) - frac;
+            double arg = M_PI * cutoff * x;
+            double sinc = (arg == 0.0) ? 1.0 : sin(arg) / arg;
+            double t = (x + half) / rs->taps;
+            double window = 0.42 - 0.5 * cos(2.0 * M_PI * t) + 0.08 * cos(4.0 * M_PI * t);
+            row[k] = (float)(sinc * window);
+            sum += sinc * window;
+        }
+        for (int k = 0; k < rs->taps; k++) row[k] = (float)(row[k] / sum);
+    }
+    return 0;
+}
+
+void free_resampler(Resampler *rs) {
+    free(rs->table);
+    rs->table = NULL;
+}
+
+// Output samples first..last of the converted loop into out. Indices past
+// out_len repeat the loop.
+void resample_loop(const Resampler *rs, const float *in, float *out, int first, int last) {
+    int half = rs->taps / 2;
+    for (int j = first; j <= last; j++) {
+        Sint64 pos = (Sint64)(j % rs->out_len) * rs->down;
+        int base = (int)(pos / rs->up) - half + 1;
+        const float *row = rs->table + (size_t)(pos % rs->up) * rs->taps;
+        float acc = 0.0f;
+        if (base >= 0 && base + rs->taps <= rs->in_len) {
+            const float *x = in + base;
+            for (int k = 0; k < rs->taps; k++) acc += row[k] * x[k];
+        } else {
+            for (int k = 0; k < rs->taps; k++) {
+                int idx = (base + k) % rs->in_len;
+                acc += row[k] * in[idx < 0 ? idx + rs->in_len : idx];
+            }
+        }
+        *out++ = acc;
+    }
+}
+
+// Render n samples from a guard-padded table of `length` samples, advancing
+// the 32.32 phase by `step` per sample. The wrap is a compare-and-subtract,
+// so a step of a whole table or more is reduced first; it lands on the same
+// positions.
+void render_block(const float *table, int length, Uint64 *phase, Uint64 step, float *out, int n, int interp) {
+    const Uint64 end = (Uint64)length << 32;
+    const float frac_scale = 1.0f / 4294967296.0f;
+    Uint64 ph = *phase;
+    if (step >= end) step %= end;
+    if (ph >= end) ph %= end;
+
+    switch (interp) {
+        case INTERP_HERMITE:
+            for (int i = 0; i < n; i++) {
+                const float *x = table + (ph >> 32);
+                float t = (Uint32)ph * frac_scale;
+                float c1 = 0.5f * (x[1] - x[-1]);
+                float c2 = x[-1] - 2.5f * x[0] + 2.0f * x[1] - 0.5f * x[2];
+                float c3 = 0.5f * (x[2] - x[-1]) + 1.5f * (x[0] - x[1]);
+                out[i] = ((c3 * t + c2) * t + c1) * t + x[0];
+                ph += step;
+                if (ph >= end) ph -= end;
+            }
+            break;
+        case INTERP_SINC:
+            for (int i = 0; i < n; i++) {
+                const float *x = table + (ph >> 32) - (SINC_TAPS / 2 - 1);
+                const float *c = sinc_table[(Uint32)ph >> (32 - SINC_PHASE_BITS)];
+                float acc = 0.0f;
+                for (int k = 0; k < SINC_TAPS; k++) acc += x[k] * c[k];
+                out[i] = acc;
+                ph += step;
+                if (ph >= end) ph -= end;
+            }
+            break;
+        default:
+            for (int i = 0; i < n; i++) {
+                const float *x = table + (ph >> 32);
+                float t = (Uint32)ph * frac_scale;
+                out[i] = x[0] + (x[1] - x[0]) * t;
+                ph += step;
+                if (ph >= end) ph -= end;
+            }
+            break;
+    }
+    *phase = ph;
+}
+
+// render_block, crossfaded by fade[i] (0 keeps table, 1 is fade_table)
+// toward the same positions in fade_table when fade is set. n is at most
+// VOICE_CHUNK.
+void render_crossfade(const float *table, const float *fade_table, const float *fade, int length,
+                      Uint64 *phase, Uint64 step, float *out, int n, int interp) {
+    Uint64 start = *phase;
+    render_block(table, length, phase, step, out, n, interp);
+    if (!fade) return;
+    *phase = start;
+    render_block(fade_table, length, phase, step, morph_scratch, n, interp);
+    for (int i = 0; i < n; i++) out[i] += (morph_scratch[i] - out[i]) * fade[i];
+}
+
+Uint64 phase_step(double increment) {
+    return (Uint64)(increment * 4294967296.0 + 0.5);
+}
+
+// Producer side of the note queue (one thread only). Returns 0 if full.
+int post_note_event(const NoteEvent *ev) {
+    int head = SDL_AtomicGet(&note_queue_head);
+    int tail = SDL_AtomicGet(&note_queue_tail);
+    if (((head + 1) & (NOTE_QUEUE_SIZE - 1)) == tail) return 0;
+    note_queue[head] = *ev;
+    SDL_AtomicSet(&note_queue_head, (head + 1) & (NOTE_QUEUE_SIZE - 1));
+    return 1;
+}
+
+// Playback step for a MIDI note, relative to the pitch the buffer holds.
+Uint64 note_step(int note) {
+    double freq = 440.0 * pow(2.0, (note - 69) / 12.0);
+    return phase_step(phase_increment * device_ratio * freq / current_freq);
+}
+
+void start_voice_ramp(Voice *v, float target, double seconds, int rate) {
+    int len = (int)(seconds * rate);
+    if (len < 1) len = 1;
+    v->env_delta = (target - v->env) / len;
+    v->env_remaining = len;
+}
+
+void apply_note_event(const NoteEvent *ev, int rate) {
+    if (ev->type == NOTE_ON) {
+        Voice *v = NULL;
+        for (int i = 0; i < MAX_VOICES && !v; i++) if (!voices[i].active) v = &voices[i];
+        if (!v) {
+            // Steal the quietest voice, oldest first among equals.
+            v = &voices[0];
+            for (int i = 1; i < MAX_VOICES; i++) {
+                Voice *c = &voices[i];
+                if (c->env < v->env || (c->env == v->env && (Sint32)(c->started - v->started) < 0)) v = c;
+            }
+            v->env = 0.0f;
+        }
+        v->active = 1;
+        v->released = 0;
+        v->note = ev->note;
+        v->phase = 0;
+        v->step = ev->step;
+        v->velocity = ev->velocity;
+        v->started = ev->time;
+        start_voice_ramp(v, 1.0f, VOICE_ATTACK_SECONDS, rate);
+    } else {
+        for (int i = 0; i < MAX_VOICES; i++) {
+            Voice *v = &voices[i];
+            if (v->active && !v->released && v->note == ev->note) {
+                v->released = 1;
+                start_voice_ramp(v, 0.0f, VOICE_RELEASE_SECONDS, rate);
+            }
+        }
+    }
+}
+
+// Mix every active voice into out[c][0..n) from tables[c], crossfading
+// toward fade_tables[c] when fade is set. All channels of a voice start
+// from the same phase, so they stay sample-aligned.
+void render_voices(const float *const *tables, const float *const *fade_tables, const float *fade,
+                   float *const *out, int channels, int n, int interp) {
+    for (int i = 0; i < MAX_VOICES; i++) {
+        Voice *v = &voices[i];
+        if (!v->active) continue;
+
+        int ramp = v->env_remaining < n ? v->env_remaining : n;
+        float env = v->env;
+        if (ramp > 0) {
+            env += v->env_delta * ramp;
+            if (ramp == v->env_remaining) env = v->released ? 0.0f : 1.0f;
+        }
+        int finished = v->released && ramp == v->env_remaining;
+        Uint64 phase = v->phase;
+        for (int c = 0; c < channels; c++) {
+            phase = v->phase;
+            render_crossfade(tables[c], fade_tables[c], fade, buffer_samples, &phase, v->step, voice_scratch, n, interp);
+            if (ramp > 0) mix_kernel(out[c], voice_scratch, ramp, v->env * v->velocity, v->env_delta * v->velocity);
+            if (!finished && ramp < n) mix_kernel(out[c] + ramp, voice_scratch + ramp, n - ramp, env * v->velocity, 0.0f);
+        }
+        v->phase = phase;
+        v->env = env;
+        v->env_remaining -= ramp;
+        if (finished) v->active = 0;
+    }
+}
+
+// Mix all voices into the planes, splitting the block at each queued
+// event's sample time so note starts and stops are sample-accurate.
+void process_voices(const float *const *tables, const float *const *fade_tables, const float *fade,
+                    float *const *out, int channels, int n, int interp, int rate) {
+    int pos = 0;
+    while (pos < n) {
+        int end = n;
+        while (SDL_AtomicGet(&note_queue_tail) != SDL_AtomicGet(&note_queue_head)) {
+            int tail = SDL_AtomicGet(&note_queue_tail);
+            NoteEvent *ev = &note_queue[tail];
+            Sint32 offset = (Sint32)(ev->time - audio_frames);
+            if (offset > pos) {
+                if (offset < end) end = offset;
+                break;
+            }
+            apply_note_event(ev, rate);
+            SDL_AtomicSet(&note_queue_tail, (tail + 1) & (NOTE_QUEUE_SIZE - 1));
+        }
+        if (end - pos > VOICE_CHUNK) end = pos + VOICE_CHUNK;
+        float *planes[MAX_CHANNELS];
+        for (int c = 0; c < channels; c++) planes[c] = out[c] + pos;
+        render_voices(tables, fade_tables, fade ? fade + pos : NULL, planes, channels, end - pos, interp);
+        pos = end;
+    }
+}
+
+// Called at the end of every audio_callback. No locks, no allocation.
+void record_callback(Uint64 start, Uint64 cost, int frames) {
+    double freq = (double)SDL_GetPerformanceFrequency();
+    double cost_ns = cost * 1e9 / freq;
+    double period_ns = frames * 1e9 / (have.freq > 0 ? have.freq : sample_rate);
+    double interval_ns = callback_prev ? (start - callback_prev) * 1e9 / freq : period_ns;
+    if (!callback_first) callback_first = start;
+    callback_prev = start;
+
+    int bin = (int)(cost_ns / period_ns * LOAD_BINS);
+    SDL_AtomicAdd(&load_histogram[bin < LOAD_BINS ? bin : LOAD_BINS], 1);
+    if (cost_ns > period_ns) SDL_AtomicAdd(&callback_late, 1);
+    if (interval_ns > 1.5 * period_ns) SDL_AtomicAdd(&callback_gaps, 1);
+    int max_ns = SDL_AtomicGet(&callback_max_ns);
+    if (cost_ns > max_ns) SDL_AtomicSet(&callback_max_ns, (int)cost_ns);
+
+    int n = SDL_AtomicGet(&callback_count);
+    CallbackRecord *r = &timeline[n & (TIMELINE_SIZE - 1)];
+    r->start_us = (Uint32)((start - callback_first) * 1e6 / freq);
+    r->cost_ns = (Uint32)cost_ns;
+    r->interval_us = (Uint32)(interval_ns / 1000.0);
+    r->period_us = (Uint32)(period_ns / 1000.0);
+    SDL_AtomicAdd(&callback_count, 1);
+}
+
+// Insert chain on the playback path. The monitor goes through an ADSR
+// gated by play/pause; with the voices mixed in, the block then runs
+// through a state-variable filter, a soft clipper and a DC blocker. The UI
+// writes target values into atomics; the audio thread reads them once per
+// callback and glides its working copies toward them every FX_BLOCK samples.
+#define FX_BLOCK 32
+#define FX_GLIDE 0.2f                   // fraction of the way to the target per block
+#define FX_DC_HZ 10.0
+
+typedef enum {
+    FX_ENABLED, FX_FILTER_MODE, FX_CUTOFF, FX_RESONANCE, FX_DRIVE_DB,
+    FX_ATTACK, FX_DECAY, FX_SUSTAIN, FX_RELEASE, FX_PARAMS
+} FxParam;
+
+typedef enum { FILTER_OFF, FILTER_LOWPASS, FILTER_BANDPASS, FILTER_HIGHPASS, FILTER_MODES } FilterMode;
+const char *filter_mode_names[FILTER_MODES] = {"off", "lowpass", "bandpass", "highpass"};
+
+typedef enum { ADSR_IDLE, ADSR_ATTACK, ADSR_DECAY, ADSR_SUSTAIN, ADSR_RELEASE } AdsrStage;
+
+// Envelope presets for the N key: attack, decay, sustain, release.
+#define ENVELOPE_PRESETS 4
+const char *envelope_names[ENVELOPE_PRESETS] = {"organ", "pluck", "pad", "swell"};
+const float envelope_presets[ENVELOPE_PRESETS][4] = {
+    {0.005f, 0.05f, 1.0f, 0.05f},
+    {0.002f, 0.35f, 0.0f, 0.2f},
+    {0.6f, 0.8f, 0.7f, 1.5f},
+    {2.0f, 0.0f, 1.0f, 0.5f},
+};
+
+SDL_atomic_t fx_params[FX_PARAMS];      // float bits, see set_fx_param()
+int envelope_preset = 0;
+
+// Audio thread only.
+typedef struct {
+    float cutoff, resonance, drive;     // smoothed toward the targets
+    float coef_cutoff, coef_resonance;  // what g and k were computed for
+    int coef_rate;
+    float g, k;
+    float ic1[MAX_CHANNELS], ic2[MAX_CHANNELS];     // filter integrator states
+    float dc_x1[MAX_CHANNELS], dc_y1[MAX_CHANNELS];
+    int stage;                          // AdsrStage
+    float env;
+    float release_step;
+    float gain[FX_BLOCK];
+} FxState;
+
+FxState fx_state;
+
+void set_fx_param(int param, float value) {
+    int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    SDL_AtomicSet(&fx_params[param], bits);
+}
+
+float get_fx_param(int param) {
+    int bits = SDL_AtomicGet(&fx_params[param]);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void set_envelope_preset(int preset) {
+    envelope_preset = preset;
+    for (int i = 0; i < 4; i++) set_fx_param(FX_ATTACK + i, envelope_presets[preset][i]);
+}
+
+void init_fx_params(void) {
+    set_fx_param(FX_ENABLED, 0.0f);
+    set_fx_param(FX_FILTER_MODE, FILTER_LOWPASS);
+    set_fx_param(FX_CUTOFF, 2000.0f);
+    set_fx_param(FX_RESONANCE, 0.3f);
+    set_fx_param(FX_DRIVE_DB, 0.0f);
+    set_envelope_preset(0);
+    fx_state.cutoff = 2000.0f;
+    fx_state.resonance = 0.3f;
+    fx_state.drive = 1.0f;
+}
+
+// Advance the envelope by n samples into fx_state.gain.
+void adsr_block(int n, int gate, float attack, float decay, float sustain, float release, int rate) {
+    FxState *s = &fx_state;
+    if (gate && (s->stage == ADSR_IDLE || s->stage == ADSR_RELEASE)) s->stage = ADSR_ATTACK;
+    if (!gate && s->stage != ADSR_IDLE && s->stage != ADSR_RELEASE) {
+        s->stage = ADSR_RELEASE;
+        s->release_step = s->env / (release * rate + 1.0f);
+    }
+    float attack_step = 1.0f / (attack * rate + 1.0f);
+    float decay_step = (1.0f - sustain) / (decay * rate + 1.0f);
+    if (s->stage == ADSR_SUSTAIN || s->stage == ADSR_IDLE) {
+        if (s->stage == ADSR_SUSTAIN) s->env = sustain;
+        for (int i = 0; i < n; i++) s->gain[i] = s->env;
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        switch (s->stage) {
+            case ADSR_ATTACK:
+                if ((s->env += attack_step) >= 1.0f) { s->env = 1.0f; s->stage = ADSR_DECAY; }
+                break;
+            case ADSR_DECAY:
+                if ((s->env -= decay_step) <= sustain) { s->env = sustain; s->stage = ADSR_SUSTAIN; }
+                break;
+            case ADSR_SUSTAIN:
+                s->env = sustain;
+                break;
+            case ADSR_RELEASE:
+                if ((s->env -= s->release_step) <= 0.0f) { s->env = 0.0f; s->stage = ADSR_IDLE; }
+                break;
+        }
+        s->gain[i] = s->env;
+    }
+}
+
+// tanh within 0.03 for |x| <= 3 and exactly +-1 beyond.
+static inline float soft_clip(float x) {
+    x = x < -3.0f ? -3.0f : (x > 3.0f ? 3.0f : x);
+    return x * (27.0f + x * x) / (27.0f + 9.0f * x * x);
+}
+
+// Filter, clip and DC-block one block of every channel in place. The
+// smoothed parameters advance once per FX_BLOCK and are shared by all
+// channels; each channel keeps its own filter state.
+void process_fx(float *const *out, int channels, int n, int rate) {
+    FxState *s = &fx_state;
+    int mode = (int)get_fx_param(FX_FILTER_MODE);
+    float cutoff = fmaxf(20.0f, fminf(get_fx_param(FX_CUTOFF), 0.45f * rate));
+    float resonance = fmaxf(0.0f, fminf(get_fx_param(FX_RESONANCE), 1.0f));
+    float drive = powf(10.0f, get_fx_param(FX_DRIVE_DB) / 20.0f);
+    float dc_r = 1.0f - (float)(2.0 * M_PI * FX_DC_HZ / rate);
+
+    for (int pos = 0; pos < n; pos += FX_BLOCK) {
+        int m = n - pos < FX_BLOCK ? n - pos : FX_BLOCK;
+        // Glide the cutoff in octaves so sweeps sound even, and snap once
+        // close enough that the coefficients can stay cached.
+        if (s->cutoff != cutoff)
+            s->cutoff = fabsf(s->cutoff - cutoff) < 0.001f * cutoff ? cutoff : s->cutoff * powf(cutoff / s->cutoff, FX_GLIDE);
+        if (s->resonance != resonance)
+            s->resonance = fabsf(s->resonance - resonance) < 0.001f ? resonance : s->resonance + (resonance - s->resonance) * FX_GLIDE;
+        if (s->drive != drive)
+            s->drive = fabsf(s->drive - drive) < 0.001f * drive ? drive : s->drive + (drive - s->drive) * FX_GLIDE;
+
+        // Trapezoidal SVF (Simper); k runs from 2 (no peak) down to 0.04.
+        if (mode != FILTER_OFF && (s->coef_cutoff != s->cutoff || s->coef_resonance != s->resonance || s->coef_rate != rate)) {
+            s->coef_cutoff = s->cutoff;
+            s->coef_resonance = s->resonance;
+            s->coef_rate = rate;
+            s->g = tanf((float)M_PI * s->cutoff / rate);
+            s->k = 2.0f - 1.96f * s->resonance;
+        }
+        float g = s->g, k = s->k;
+        float a1 = 1.0f / (1.0f + g * (g + k)), a2 = g * a1, a3 = g * a2;
+        // Written as a 2x2 state update, so each sample waits on two
+        // multiply-adds, and the band/low outputs (v1 = a2 x + a1 ic1 -
+        // a2 ic2, v2 = a3 x + a2 ic1 + (1 - a3) ic2) are folded into
+        // one weighted sum of the input and the old states per mode.
+        float m11 = 2.0f * a1 - 1.0f, m12 = -2.0f * a2, n1 = 2.0f * a2;
+        float m21 = 2.0f * a2, m22 = 1.0f - 2.0f * a3, n2 = 2.0f * a3;
+        float band = mode == FILTER_BANDPASS ? 1.0f : (mode == FILTER_HIGHPASS ? -k : 0.0f);
+        float low = mode == FILTER_LOWPASS ? 1.0f : (mode == FILTER_HIGHPASS ? -1.0f : 0.0f);
+        float cx = (mode == FILTER_HIGHPASS ? 1.0f : 0.0f) + band * a2 + low * a3;
+        float c1 = band * a1 + low * a2;
+        float c2 = low * (1.0f - a3) - band * a2;
+        float gain = s->drive;
+
+        for (int c = 0; c < channels; c++) {
+            float *x = out[c] + pos;
+            if (mode != FILTER_OFF) {
+                float ic1 = s->ic1[c], ic2 = s->ic2[c];
+                for (int i = 0; i < m; i++) {
+                    float in = x[i];
+                    x[i] = cx * in + c1 * ic1 + c2 * ic2;
+                    float next1 = m11 * ic1 + m12 * ic2 + n1 * in;
+                    ic2 = m21 * ic1 + m22 * ic2 + n2 * in;
+                    ic1 = next1;
+                }
+                s->ic1[c] = ic1;
+                s->ic2[c] = ic2;
+            }
+
+            for (int i = 0; i < m; i++) x[i] = soft_clip(x[i] * gain);
+
+            float x1 = s->dc_x1[c], y1 = s->dc_y1[c];
+            for (int i = 0; i < m; i++) {
+                float y = x[i] - x1 + dc_r * y1;
+                x1 = x[i];
+                x[i] = y1 = y;
+            }
+            s->dc_x1[c] = x1;
+            s->dc_y1[c] = y1;
+        }
+    }
+
+    // Flush-to-zero may be unavailable, so the recursive states are
+    // cleared by hand once they decay below audibility.
+    for (int c = 0; c < channels; c++) {
+        if (fabsf(s->ic1[c]) < 1e-15f) s->ic1[c] = 0.0f;
+        if (fabsf(s->ic2[c]) < 1e-15f) s->ic2[c] = 0.0f;
+        if (fabsf(s->dc_y1[c]) < 1e-15f) s->dc_y1[c] = 0.0f;
+    }
+}
+
+// Channel c's table at a morph position: the frame itself when the
+// position sits on one, else its two neighbours blended into dst.
+const float *morph_table(const float *wave, float position, int c, float *dst) {
+    int f = (int)position;
+    float w = position - f;
+    const float *a = wave + ((size_t)f * channel_count + c) * snapshot_stride;
+    if (w == 0.0f || f + 1 >= frame_count) return a;
+    const float *b = a + (size_t)channel_count * snapshot_stride;
+    for (int i = -SNAPSHOT_GUARD; i < buffer_samples + SNAPSHOT_GUARD; i++) dst[i] = a[i] + (b[i] - a[i]) * w;
+    return dst;
+}
+
+// Point tables[c] at the wavetable position the last block ended on. If
+// the morph control has moved since, fade_tables[c] get the new position
+// and the returned ramp crossfades to it over the n frames; otherwise the
+// result is NULL. A move across several frames fades straight from the
+// old blend to the new one, which then becomes the cached blend.
+const float *morph_frames(const float *wave, const float **tables, const float **fade_tables, int channels, int n) {
+    float target = fmaxf(0.0f, fminf(get_morph(), 1.0f)) * (frame_count - 1);
+    if (morph_position > frame_count - 1) {
+        morph_position = target;
+        morph_cached = 0;
+    }
+    if (!morph_cached) {
+        for (int c = 0; c < channel_count; c++)
+            morph_current_tables[c] = morph_table(wave, morph_position, c, morph_tables[morph_current] + (size_t)c * snapshot_stride);
+        morph_cached = 1;
+    }
+    int moving = target != morph_position;
+    const float *to[MAX_CHANNELS];
+    for (int c = 0; c < channel_count; c++)
+        to[c] = moving ? morph_table(wave, target, c, morph_tables[!morph_current] + (size_t)c * snapshot_stride) : morph_current_tables[c];
+    for (int c = 0; c < channels; c++) {
+        tables[c] = morph_current_tables[c < channel_count ? c : 0];
+        fade_tables[c] = to[c < channel_count ? c : 0];
+    }
+    if (!moving) return NULL;
+    for (int i = 0; i < n; i++) morph_fade[i] = (i + 1) / (float)n;
+
+    // tables[] still point into the old set for this block; the next
+    // block starts from the new one.
+    for (int c = 0; c < channel_count; c++) morph_current_tables[c] = to[c];
+    morph_current = !morph_current;
+    morph_position = target;
+    return morph_fade;
+}
+
+// Render n frames of every output channel into out[c]: the monitor
+// (through the envelope when the chain is on), then the voices and the
+// insert chain. Channels the waveform lacks repeat channel 0.
+void render_audio_block(const float *wave, float *const *out, int channels, int n, int interp, int fx_on) {
+    const float *tables[MAX_CHANNELS], *fade_tables[MAX_CHANNELS];
+    const float *fade = NULL;
+    if (frame_count > 1) {
+        fade = morph_frames(wave, tables, fade_tables, channels, n);
+    } else {
+        for (int c = 0; c < channels; c++) tables[c] = fade_tables[c] = wave + (size_t)(c < channel_count ? c : 0) * snapshot_stride;
+    }
+
+    // With the chain on, the monitor keeps sounding through its release.
+    // Wavetable frames hold one cycle, so they play at A4 rather than at
+    // the buffer's own rate.
+    if (playing || (fx_on && fx_state.stage != ADSR_IDLE)) {
+        Uint64 start = playback_phase;
+        Uint64 step = frame_count > 1 ? note_step(69) : phase_step(phase_increment * device_ratio);
+        for (int c = 0; c < channels; c++) {
+            playback_phase = start;
+            render_crossfade(tables[c], fade_tables[c], fade, buffer_samples, &playback_phase, step, out[c], n, interp);
+        }
+        SDL_AtomicSet(&playhead_position, (int)(playback_phase >> 32));
+    } else {
+        for (int c = 0; c < channels; c++) memset(out[c], 0, n * sizeof(float));
+    }
+    if (fx_on) {
+        float attack = get_fx_param(FX_ATTACK), decay = get_fx_param(FX_DECAY);
+        float sustain = get_fx_param(FX_SUSTAIN), release = get_fx_param(FX_RELEASE);
+        for (int pos = 0; pos < n; pos += FX_BLOCK) {
+            int m = n - pos < FX_BLOCK ? n - pos : FX_BLOCK;
+            adsr_block(m, playing, attack, decay, sustain, release, have.freq);
+            for (int c = 0; c < channels; c++)
+                for (int i = 0; i < m; i++) out[c][pos + i] *= fx_state.gain[i];
+        }
+    } else {
+        fx_state.stage = ADSR_IDLE;
+        fx_state.env = 0.0f;
+    }
+    process_voices(tables, fade_tables, fade, out, channels, n, interp, have.freq);
+    if (fx_on) process_fx(out, channels, n, have.freq);
+    audio_frames += n;
+}
+
+void audio_callback(void *userdata, Uint8 *stream, int len) {
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    float *out = (float *)stream;
+    int channels = have.channels > 0 ? have.channels : 1;
+    int frames = len / (int)(channels * sizeof(float));
+
+    if (SDL_AtomicGet(&snapshot_shared) & SNAPSHOT_FRESH) {
+        int prev = SDL_AtomicSet(&snapshot_shared, snapshot_front);
+        snapshot_front = prev & SNAPSHOT_INDEX_MASK;
+        morph_cached = 0;
+    }
+    const float *wave = snapshots[snapshot_front].samples;
+    if (SDL_AtomicSet(&playhead_reset, 0)) playback_phase = 0;
+    int interp = SDL_AtomicGet(&interp_setting);
+
+    if (!wave) {
+        memset(stream, 0, len);
+        return;
+    }
+#ifdef HAVE_X86_SIMD
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | 0x8040);           // flush-to-zero and denormals-are-zero
+#endif
+
+    // Mono renders straight into the stream; more channels render planar
+    // into audio_planes and are interleaved in one pass per block.
+    int fx_on = get_fx_param(FX_ENABLED) != 0.0f;
+    float *planes[MAX_CHANNELS];
+    for (int pos = 0; pos < frames; pos += VOICE_CHUNK) {
+        int n = frames - pos < VOICE_CHUNK ? frames - pos : VOICE_CHUNK;
+        if (channels == 1) {
+            planes[0] = out + pos;
+            render_audio_block(wave, planes, 1, n, interp, fx_on);
+        } else {
+            for (int c = 0; c < channels; c++) planes[c] = audio_planes[c];
+            render_audio_block(wave, planes, channels, n, interp, fx_on);
+            interleave_kernel(planes, channels, n, out + (size_t)pos * channels);
+        }
+    }
+#ifdef HAVE_X86_SIMD
+    _mm_setcsr(csr);
+#endif
+    SDL_AtomicSet(&audio_clock, (int)audio_frames);
+
+    Uint64 elapsed = SDL_GetPerformanceCounter() - t0;
+    SDL_AtomicSet(&block_cost_ns, (int)(elapsed * 1000000000.0 / SDL_GetPerformanceFrequency()));
+    record_callback(t0, elapsed, frames);
+}
+
+void reopen_audio_device(void) {
+    if (audio_device != 0) {
+        SDL_CloseAudioDevice(audio_device);
+        audio_device = 0;
+    }
+
+    SDL_AudioSpec want;
+    SDL_zero(want);
+    want.freq = sample_rate;
+    want.format = AUDIO_F32;
+    want.channels = channel_count;
+    want.samples = 1024;
+    want.callback = audio_callback;
+
+    // Take whatever rate the device prefers and step through the buffer at
+    // the ratio, rather than have SDL resample behind us. Stepping faster
+    // than one sample per frame would fold everything above the device's
+    // Nyquist back down, so a lower rate is left to SDL's converter.
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (audio_device != 0 && have.freq < sample_rate) {
+        SDL_CloseAudioDevice(audio_device);
+        audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    }
+    if (audio_device == 0) {
+        fprintf(stderr, "Failed to open audio: %s\n", SDL_GetError());
+    } else {
+        device_ratio = (double)sample_rate / have.freq;
+        SDL_PauseAudioDevice(audio_device, playing ? 0 : 1);
+    }
+}
+
+Button make_button(int x, int y, int w, int h, const char *label) {
+    Button b;
+    b.rect = (SDL_Rect){x, y, w, h};
+    strncpy(b.label, label, 31);
+    b.label[31] = '\0';
+    return b;
+}
+
+void init_buttons() {
+    SDL_GetWindowSize(window, &current_window_width, &current_window_height);
+
+    const int margin = 30;
+    const int btn_w = 105;
+    const int btn_h = 18;
+    const int spacing_h = 15;
+    const int spacing_v = 2;
+
+    int waveform_top = (int)(current_window_height * WAVEFORM_TOP_MARGIN_RATIO);
+    int waveform_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
+
+    int bottom_row_y = current_window_height - margin - btn_h;
+
+    int row_y[4];
+    row_y[3] = bottom_row_y;
+    row_y[2] = row_y[3] - btn_h - spacing_v;
+    row_y[1] = row_y[2] - btn_h - spacing_v;
+    row_y[0] = row_y[1] - btn_h - spacing_v;
+
+    int left_x = margin;
+
+    wave_buttons[0] = make_button(left_x + 0*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Sine");
+    wave_buttons[1] = make_button(left_x + 1*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Square");
+    wave_buttons[2] = make_button(left_x + 2*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Sawtooth");
+    wave_buttons[3] = make_button(left_x + 3*(btn_w+spacing_h), row_y[0], btn_w, btn_h, "Triangle");
+
+    const char* row1_labels[5] = {"Free Draw", "Line", "Sine Seg", "Smooth", "Add Free"};
+    for (int i = 0; i < 5; i++) tool_buttons[i] = make_button(left_x + i*(btn_w+spacing_h), row_y[1], btn_w, btn_h, row1_labels[i]);
+
+    const char* row2_labels[5] = {"Add Smooth", "Multiply", "Amplify", "Add Sine", "Add Square"};
+    for (int i = 0; i < 5; i++) tool_buttons[5+i] = make_button(left_x + i*(btn_w+spacing_h), row_y[2], btn_w, btn_h, row2_labels[i]);
+
+    const char* row3_labels[8] = {"Add Saw", "Add Tri", "Blend", "Smear", "Soften", "Add Treb", "Add Mid", "Sub Bass"};
+    for (int i = 0; i < 8; i++) tool_buttons[10+i] = make_button(left_x + i*(btn_w+spacing_h), row_y[3], btn_w, btn_h, row3_labels[i]);
+
+    int right_margin = margin + 20;
+    int control_w = 240;
+    int control_h = 60;
+    int bar_w = 250;
+    int bar_h = 20;
+
+    int right_x = current_window_width - right_margin - control_w;
+
+    export_button = make_button(right_x, waveform_top + 20, control_w, control_h, "Export WAV");
+    control_buttons[0] = make_button(right_x, current_window_height - margin - control_h - 80, control_w, control_h, "Play / Pause");
+    control_buttons[1] = make_button(right_x, current_window_height - margin - control_h, control_w + 50, 50, "Freq: 440.0 Hz");
+
+    // NEW: Undo and Redo buttons (below Play/Pause)
+    undo_button = make_button(right_x, control_buttons[0].rect.y + control_h + 10, 115, 40, "Undo");
+    redo_button = make_button(right_x + 125, control_buttons[0].rect.y + control_h + 10, 115, 40, "Redo");
+
+    spectrum_rect = (SDL_Rect){left_x, waveform_top + waveform_height + 10, right_x - left_x - 20, row_y[0] - (waveform_top + waveform_height) - 20};
+
+    intensity_bar = make_button(current_window_width - right_margin - bar_w, export_button.rect.y + control_h + 30, bar_w, bar_h, "Intensity");
+    smear_width_bar = make_button(current_window_width - right_margin - bar_w, intensity_bar.rect.y + bar_h + 20, bar_w, bar_h, "Smear Width");
+    morph_bar = make_button(current_window_width - right_margin - bar_w, smear_width_bar.rect.y + bar_h + 20, bar_w, bar_h, "Morph");
+}
+
+void put_le16(Uint8 *p, Uint16 v) { p[0] = v & 0xff; p[1] = v >> 8; }
+void put_le32(Uint8 *p, Uint32 v) { put_le16(p, v & 0xffff); put_le16(p + 2, v >> 16); }
+
+int wav_bytes_per_sample(int format) {
+    return format == EXPORT_PCM16 ? 2 : format == EXPORT_PCM24 ? 3 : 4;
+}
+
+void build_wav_header(Uint8 h[44], int sample_rate, int channels, int format, Uint32 frames) {
+    int bytes = wav_bytes_per_sample(format);
+    Uint32 data_size = frames * channels * bytes;
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, 36 + data_size);
+    memcpy(h + 8, "WAVE", 4);
+    memcpy(h + 12, "fmt ", 4);
+    put_le32(h + 16, 16);
+    put_le16(h + 20, format == EXPORT_FLOAT32 ? 3 : 1);
+    put_le16(h + 22, channels);
+    put_le32(h + 24, sample_rate);
+    put_le32(h + 28, sample_rate * channels * bytes);
+    put_le16(h + 32, channels * bytes);
+    put_le16(h + 34, bytes * 8);
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, data_size);
+}
+
+int write_wav_header(FILE *f, int sample_rate, int channels, int format, Uint32 frames) {
+    Uint8 h[44];
+    build_wav_header(h, sample_rate, channels, format, frames);
+    return fwrite(h, 1, sizeof(h), f) == sizeof(h) ? 0 : -1;
+}
+
+// Triangular (TPDF) dither: the sum of two uniform variables, +-1 LSB.
+float tpdf_dither(Uint32 *state) {
+    Uint32 x = *state;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    float a = x * (1.0f / 4294967296.0f);
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    float b = x * (1.0f / 4294967296.0f);
+    *state = x;
+    return a - b;
+}
+
+// Convert float samples to the export format, in place into bytes.
+void encode_samples(const float *in, Uint8 *out, int n, int format, Uint32 *dither) {
+    if (format == EXPORT_FLOAT32) {
+        for (int i = 0; i < n; i++) {
+            Uint32 bits;
+            memcpy(&bits, &in[i], 4);
+            put_le32(out + 4 * i, bits);
+        }
+        return;
+    }
+    float scale = (format == EXPORT_PCM16) ? 32767.0f : 8388607.0f;
+    long lo = (format == EXPORT_PCM16) ? -32768 : -8388608;
+    long hi = (format == EXPORT_PCM16) ? 32767 : 8388607;
+    for (int i = 0; i < n; i++) {
+        long v = lrintf(in[i] * scale + tpdf_dither(dither));
+        v = v < lo ? lo : (v > hi ? hi : v);
+        if (format == EXPORT_PCM16) {
+            put_le16(out + 2 * i, (Uint16)v);
+        } else {
+            Uint32 u = (Uint32)v;
+            out[3 * i] = u & 0xff;
+            out[3 * i + 1] = (u >> 8) & 0xff;
+            out[3 * i + 2] = (u >> 16) & 0xff;
+        }
+    }
+}
+
+ExportJob *create_export_job(FILE *f) {
+    ExportJob *job = calloc(1, sizeof(ExportJob));
+    int stride = buffer_samples + 2 * SNAPSHOT_GUARD;
+    int planes = channel_count * frame_count;
+    job->storage = malloc((size_t)stride * planes * sizeof(float));
+    if (!job->storage) { free(job); return NULL; }
+    job->wave = job->storage + SNAPSHOT_GUARD;
+    for (int p = 0; p < planes; p++) {
+        memcpy(job->wave + (size_t)p * stride, channel_data + (size_t)p * buffer_samples, buffer_samples * sizeof(float));
+        fill_guards(job->wave + (size_t)p * stride, buffer_samples);
+    }
+    job->file = f;
+    job->length = buffer_samples;
+    job->channels = channel_count;
+    job->frames = frame_count;
+    job->seconds = export_seconds > 0 ? export_seconds : buffer_duration();
+    job->rate_ratio = phase_increment;
+    job->format = export_format;
+    job->interp = SDL_AtomicGet(&interp_setting);
+    job->sample_rate = sample_rate;
+    return job;
+}
+
+void free_export_job(ExportJob *job) {
+    free(job->storage);
+    free(job);
+}
+
+// Render n frames of every channel of the job and interleave them into out.
+// planes is scratch for n * channels floats; mono renders into out directly.
+void render_job_block(const ExportJob *job, Uint64 *phase, Uint64 step, float *planes, float *out, int n) {
+    if (job->channels == 1) {
+        render_block(job->wave, job->length, phase, step, out, n, job->interp);
+        return;
+    }
+    float *plane[MAX_CHANNELS];
+    Uint64 start = *phase;
+    for (int c = 0; c < job->channels; c++) {
+        plane[c] = planes + (size_t)c * n;
+        *phase = start;
+        render_block(job->wave + (size_t)c * (job->length + 2 * SNAPSHOT_GUARD), job->length, phase, step, plane[c], n, job->interp);
+    }
+    interleave_kernel(plane, job->channels, n, out);
+}
+
+// Write the job's wavetable frames to job->file in one pass, frame after
+// frame with the channels interleaved. A "clm " chunk in the form Serum
+// writes carries the frame length for synths that read it.
+int write_wavetable(ExportJob *job, SDL_atomic_t *progress) {
+    FILE *f = job->file;
+    int bytes = wav_bytes_per_sample(job->format);
+    Uint32 frames = (Uint32)job->length * job->frames;
+    char marker[48];
+    int marker_len = snprintf(marker, sizeof(marker), "<!>%d 00000000 wavetable (AudioGen)", job->length);
+    if (marker_len & 1) marker[marker_len++] = ' ';
+    if ((Uint64)frames * job->channels * bytes > 0xFFFFFFFFu - 44 - 8 - marker_len) {
+        fprintf(stderr, "Wavetable too large for a WAV file\n");
+        fclose(f);
+        return -1;
+    }
+
+    Uint8 h[44], chunk[8];
+    build_wav_header(h, job->sample_rate, job->channels, job->format, frames);
+    put_le32(h + 4, 36 + 8 + marker_len + frames * job->channels * bytes);
+    memcpy(chunk, "clm ", 4);
+    put_le32(chunk + 4, marker_len);
+    setvbuf(f, NULL, _IOFBF, EXPORT_WRITE_BUFFER);
+    int ok = fwrite(h, 1, 36, f) == 36 && fwrite(chunk, 1, 8, f) == 8
+          && fwrite(marker, 1, marker_len, f) == (size_t)marker_len && fwrite(h + 36, 1, 8, f) == 8;
+
+    float block[EXPORT_BLOCK];
+    Uint8 encoded[EXPORT_BLOCK * 4];
+    int block_frames = EXPORT_BLOCK / job->channels;
+    int stride = job->length + 2 * SNAPSHOT_GUARD;
+    Uint32 dither = 0x9E3779B9u;
+    for (int k = 0; ok && k < job->frames; k++) {
+        float *plane[MAX_CHANNELS];
+        for (int c = 0; c < job->channels; c++) plane[c] = job->wave + ((size_t)k * job->channels + c) * stride;
+        for (int done = 0; ok && done < job->length; done += block_frames) {
+            int n = job->length - done < block_frames ? job->length - done : block_frames;
+            int count = n * job->channels;
+            interleave_kernel(plane, job->channels, n, block);
+            for (int c = 0; c < job->channels; c++) plane[c] += n;
+            encode_samples(block, encoded, count, job->format, &dither);
+            ok = fwrite(encoded, bytes, count, f) == (size_t)count;
+        }
+        if (progress) {
+            int permille = (k + 1) * 1000 / job->frames;
+            if (SDL_AtomicSet(progress, permille) / 10 != permille / 10) wake_main_loop();
+        }
+    }
+    if (fclose(f) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+// Render the job and stream it to job->file, which is closed on return.
+int render_wav(ExportJob *job, SDL_atomic_t *progress) {
+    if (job->frames > 1) return write_wavetable(job, progress);
+    FILE *f = job->file;
+    int bytes = wav_bytes_per_sample(job->format);
+    double total = job->seconds * job->sample_rate;
+    if (total < 1 || total * bytes * job->channels > 0xFFFFFFFFu - 44) {
+        fprintf(stderr, "Export length out of range\n");
+        fclose(f);
+        return -1;
+    }
+    Uint32 frames = (Uint32)total;
+
+    setvbuf(f, NULL, _IOFBF, EXPORT_WRITE_BUFFER);
+    int ok = write_wav_header(f, job->sample_rate, job->channels, job->format, frames) == 0;
+
+    // Blocks hold EXPORT_BLOCK samples whatever the channel count.
+    float planes[EXPORT_BLOCK], block[EXPORT_BLOCK];
+    Uint8 encoded[EXPORT_BLOCK * 4];
+    int block_frames = EXPORT_BLOCK / job->channels;
+    Uint64 phase = 0, step = phase_step(job->rate_ratio);
+    Uint32 dither = 0x9E3779B9u;
+    for (Uint32 done = 0; ok && done < frames; ) {
+        int n = (frames - done < (Uint32)block_frames) ? (int)(frames - done) : block_frames;
+        int count = n * job->channels;
+        render_job_block(job, &phase, step, planes, block, n);
+        encode_samples(block, encoded, count, job->format, &dither);
+        ok = fwrite(encoded, bytes, count, f) == (size_t)count;
+        done += n;
+        if (progress) {
+            int permille = (int)((Uint64)done * 1000 / frames);
+            if (SDL_AtomicSet(progress, permille) / 10 != permille / 10) wake_main_loop();
+        }
+    }
+    if (fclose(f) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+int export_thread(void *data) {
+    ExportJob *job = data;
+    int result = render_wav(job, &export_progress);
+    free_export_job(job);
+    SDL_AtomicSet(&export_result, result == 0 ? 1 : -1);
+    wake_main_loop();
+    return result;
+}
+
+// Claim the next free waveform_NNN.wav; "x" makes the create exclusive, so a
+// file that already exists is skipped rather than overwritten.
+FILE *open_next_export(int *number) {
+    static int export_count = 0;
+    char filename[64];
+    for (int tries = 0; tries < 10000; tries++) {
+        export_count++;
+        snprintf(filename, sizeof(filename), "waveform_%03d.wav", export_count);
+        FILE *f = fopen(filename, "wbx");
+        if (f) { *number = export_count; return f; }
+        if (errno != EEXIST) break;
+    }
+    fprintf(stderr, "Could not create an export file: %s\n", strerror(errno));
+    return NULL;
+}
+
+void export_wav() {
+    if (export_worker) return;
+    FILE *f = open_next_export(&export_number);
+    if (!f) return;
+    ExportJob *job = create_export_job(f);
+    if (!job) { fclose(f); return; }
+    SDL_AtomicSet(&export_progress, 0);
+    SDL_AtomicSet(&export_result, 0);
+    export_worker = SDL_CreateThread(export_thread, "export", job);
+    if (!export_worker) {
+        fprintf(stderr, "Could not start export: %s\n", SDL_GetError());
+        fclose(f);
+        free_export_job(job);
+    }
+}
+
+// Offline renderer for packs of variants (wave types across a frequency
+// grid, or the current buffer at several pitches). A fixed pool of workers
+// renders them in parallel, each out of its own scratch arena, and the
+// finished files go through one shared output stage that does the writes.
+#define RENDER_MAX_THREADS 64
+#define RENDER_MAX_VARIANTS 4096
+
+const char *render_type_names[] = {"sine", "square", "saw", "triangle", "current"};
+
+// Bump allocator, reset per variant. It only grows between variants, so
+// pointers handed out while rendering one stay valid.
+typedef struct {
+    Uint8 *base;
+    size_t size;
+    size_t used;
+} Arena;
+
+int arena_reserve(Arena *a, size_t bytes) {
+    a->used = 0;
+    if (bytes <= a->size) return 0;
+    free(a->base);
+    a->base = malloc(bytes);
+    a->size = a->base ? bytes : 0;
+    return a->base ? 0 : -1;
+}
+
+void *arena_alloc(Arena *a, size_t bytes) {
+    void *p = a->base + a->used;
+    a->used += (bytes + 63) & ~(size_t)63;
+    return p;
+}
+
+// A copy of the session buffer shared by every variant of one pack; the
+// last worker to finish with it frees it.
+typedef struct {
+    SDL_atomic_t refs;
+    int length;
+    int channels;
+    float samples[];        // planar, length per channel
+} RenderSource;
+
+typedef struct RenderVariant {
+    struct RenderVariant *next;
+    char path[512];
+    int type;                   // WaveType; CUSTOM plays `source`
+    int cycles;                 // for the classic types
+    RenderSource *source;
+    ExportJob job;              // length, duration, rate and format; wave is set by the worker
+} RenderVariant;
+
+typedef struct {
+    SDL_Thread *thread;
+    Arena arena;
+} RenderWorker;
+
+RenderWorker render_workers[RENDER_MAX_THREADS];
+int render_thread_count = 0;
+int render_threads = 0;                 // 0 uses every core
+RenderVariant *render_queue_head = NULL, *render_queue_tail = NULL;
+SDL_mutex *render_queue_lock = NULL;
+SDL_mutex *render_output_lock = NULL;
+SDL_sem *render_pending = NULL;         // one post per queued variant
+SDL_sem *render_idle = NULL;            // posted when the last variant finishes
+SDL_atomic_t render_outstanding;        // queued plus in progress
+SDL_atomic_t render_quit;
+SDL_atomic_t render_written;
+SDL_atomic_t render_failed;
+int render_quiet = 0;                   // skip printing each path
+
+// The shared output stage. Workers arrive with a complete file in memory;
+// writes go one at a time so the disk sees large sequential writes.
+int write_render_output(const char *path, const Uint8 *data, size_t bytes) {
+    SDL_LockMutex(render_output_lock);
+    FILE *f = fopen(path, "wb");
+    int ok = f && fwrite(data, 1, bytes, f) == bytes;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok) {
+        SDL_AtomicAdd(&render_written, 1);
+        if (!render_quiet) printf("%s\n", path);
+    } else {
+        SDL_AtomicAdd(&render_failed, 1);
+        fprintf(stderr, "Could not write %s\n", path);
+    }
+    SDL_UnlockMutex(render_output_lock);
+    return ok ? 0 : -1;
+}
+
+int render_variant(RenderVariant *v, Arena *arena) {
+    ExportJob *job = &v->job;
+    int bytes = wav_bytes_per_sample(job->format);
+    double total = job->seconds * job->sample_rate;
+    if (total < 1 || total * bytes * job->channels > 0xFFFFFFFFu - 44) {
+        fprintf(stderr, "%s: length out of range\n", v->path);
+        SDL_AtomicAdd(&render_failed, 1);
+        return -1;
+    }
+    Uint32 frames = (Uint32)total;
+    int stride = job->length + 2 * SNAPSHOT_GUARD;
+    size_t wave_bytes = (size_t)stride * job->channels * sizeof(float);
+    size_t file_bytes = 44 + (size_t)frames * job->channels * bytes;
+    if (arena_reserve(arena, wave_bytes + file_bytes + 2 * EXPORT_BLOCK * sizeof(float) + 4 * 64) != 0) {
+        fprintf(stderr, "%s: out of memory\n", v->path);
+        SDL_AtomicAdd(&render_failed, 1);
+        return -1;
+    }
+
+    job->wave = (float *)arena_alloc(arena, wave_bytes) + SNAPSHOT_GUARD;
+    for (int c = 0; c < job->channels; c++) {
+        float *plane = job->wave + (size_t)c * stride;
+        if (v->source) memcpy(plane, v->source->samples + (size_t)c * job->length, job->length * sizeof(float));
+        else fill_classic_waveform(plane, job->length, v->type, v->cycles);
+        fill_guards(plane, job->length);
+    }
+
+    Uint8 *file = arena_alloc(arena, file_bytes);
+    float *planes = arena_alloc(arena, EXPORT_BLOCK * sizeof(float));
+    float *block = arena_alloc(arena, EXPORT_BLOCK * sizeof(float));
+    build_wav_header(file, job->sample_rate, job->channels, job->format, frames);
+    int block_frames = EXPORT_BLOCK / job->channels;
+    Uint64 phase = 0, step = phase_step(job->rate_ratio);
+    Uint32 dither = 0x9E3779B9u;
+    for (Uint32 done = 0; done < frames; ) {
+        int n = (frames - done < (Uint32)block_frames) ? (int)(frames - done) : block_frames;
+        render_job_block(job, &phase, step, planes, block, n);
+        encode_samples(block, file + 44 + (size_t)done * job->channels * bytes, n * job->channels, job->format, &dither);
+        done += n;
+    }
+    return write_render_output(v->path, file, file_bytes);
+}
+
+int render_worker(void *data) {
+    RenderWorker *worker = data;
+    for (;;) {
+        SDL_SemWait(render_pending);
+        if (SDL_AtomicGet(&render_quit)) break;
+        SDL_LockMutex(render_queue_lock);
+        RenderVariant *v = render_queue_head;
+        if (v) {
+            render_queue_head = v->next;
+            if (!render_queue_head) render_queue_tail = NULL;
+        }
+        SDL_UnlockMutex(render_queue_lock);
+        if (!v) continue;
+
+        render_variant(v, &worker->arena);
+        if (v->source && SDL_AtomicAdd(&v->source->refs, -1) == 1) free(v->source);
+        free(v);
+        if (SDL_AtomicAdd(&render_outstanding, -1) == 1) SDL_SemPost(render_idle);
+        wake_main_loop();
+    }
+    return 0;
+}
+
+int start_render_pool(int threads) {
+    if (threads <= 0) threads = SDL_GetCPUCount();
+    if (threads > RENDER_MAX_THREADS) threads = RENDER_MAX_THREADS;
+    if (render_thread_count > 0) return 0;
+    if (!render_queue_lock) {
+        render_queue_lock = SDL_CreateMutex();
+        render_output_lock = SDL_CreateMutex();
+        render_pending = SDL_CreateSemaphore(0);
+        render_idle = SDL_CreateSemaphore(0);
+        if (!render_queue_lock || !render_output_lock || !render_pending || !render_idle) return -1;
+    }
+    SDL_AtomicSet(&render_quit, 0);
+    for (int i = 0; i < threads; i++) {
+        render_workers[i].thread = SDL_CreateThread(render_worker, "render", &render_workers[i]);
+        if (!render_workers[i].thread) break;
+        render_thread_count++;
+    }
+    return render_thread_count > 0 ? 0 : -1;
+}
+
+// Block until every queued variant has been written.
+void wait_render_pool(void) {
+    while (SDL_AtomicGet(&render_outstanding) > 0) SDL_SemWait(render_idle);
+}
+
+void stop_render_pool(void) {
+    if (render_thread_count == 0) return;
+    wait_render_pool();
+    SDL_AtomicSet(&render_quit, 1);
+    for (int i = 0; i < render_thread_count; i++) SDL_SemPost(render_pending);
+    for (int i = 0; i < render_thread_count; i++) {
+        SDL_WaitThread(render_workers[i].thread, NULL);
+        free(render_workers[i].arena.base);
+        memset(&render_workers[i], 0, sizeof(RenderWorker));
+    }
+    render_thread_count = 0;
+}
+
+// Queue one variant per type and frequency, named <prefix>_<type>_<freq>.wav.
+// Types are WaveType values; CUSTOM plays the current buffer, every channel
+// of it, pitched to each frequency, and the classic types render mono.
+// Returns immediately; the variants own copies of what they need.
+int render_pack(const char *prefix, const int *types, int type_count, const double *freqs, int freq_count, double seconds) {
+    if (type_count * freq_count > RENDER_MAX_VARIANTS) return -1;
+    // The current buffer replayed a whole loop or more per sample is noise.
+    for (int t = 0; t < type_count; t++) {
+        for (int k = 0; types[t] == CUSTOM && k < freq_count; k++) {
+            if (phase_increment * freqs[k] / current_freq >= buffer_samples) {
+                fprintf(stderr, "%g Hz is too high to replay the current buffer\n", freqs[k]);
+                return -1;
+            }
+        }
+    }
+    if (start_render_pool(render_threads) != 0) return -1;
+
+    RenderSource *source = NULL;
+    for (int t = 0; t < type_count; t++) {
+        if (types[t] != CUSTOM || source) continue;
+        save_undo_state();
+        // A wavetable renders the frame on show.
+        size_t samples = (size_t)buffer_samples * channel_count;
+        source = malloc(sizeof(RenderSource) + samples * sizeof(float));
+        if (!source) return -1;
+        SDL_AtomicSet(&source->refs, 0);
+        source->length = buffer_samples;
+        source->channels = channel_count;
+        memcpy(source->samples, frame_plane(active_frame, 0), samples * sizeof(float));
+    }
+
+    // Classic variants get a loop of their own, session_seconds long, so
+    // their pitch grid does not depend on the buffer being edited.
+    int classic_length = (int)lround(sample_rate * session_seconds);
+    if (classic_length < 1) classic_length = 1;
+
+    RenderVariant *first = NULL, *last = NULL;
+    int count = 0;
+    for (int t = 0; t < type_count; t++) {
+        for (int k = 0; k < freq_count; k++) {
+            RenderVariant *v = calloc(1, sizeof(RenderVariant));
+            if (!v) break;
+            snprintf(v->path, sizeof(v->path), "%s_%s_%g.wav", prefix, render_type_names[types[t]], freqs[k]);
+            v->type = types[t];
+            v->job.length = types[t] == CUSTOM ? buffer_samples : classic_length;
+            v->job.channels = types[t] == CUSTOM ? channel_count : 1;
+            // A wavetable frame is a single cycle, too short to stand as the
+            // default length.
+            v->job.seconds = seconds > 0 ? seconds
+                           : types[t] == CUSTOM && frame_count == 1 ? buffer_duration() : session_seconds;
+            v->job.format = export_format;
+            v->job.interp = SDL_AtomicGet(&interp_setting);
+            v->job.sample_rate = sample_rate;
+            if (types[t] == CUSTOM) {
+                v->source = source;
+                SDL_AtomicAdd(&source->refs, 1);
+                v->job.rate_ratio = phase_increment * freqs[k] / current_freq;
+            } else {
+                double cycles = freqs[k] * classic_length / sample_rate;
+                v->cycles = cycles >= 1.0 ? (int)round(cycles) : 1;
+                v->job.rate_ratio = 1.0;
+            }
+            if (last) last->next = v; else first = v;
+            last = v;
+            count++;
+        }
+    }
+    if (source && SDL_AtomicGet(&source->refs) == 0) free(source);
+    if (count == 0) return -1;
+
+    SDL_AtomicAdd(&render_outstanding, count);
+    SDL_LockMutex(render_queue_lock);
+    if (render_queue_tail) render_queue_tail->next = first; else render_queue_head = first;
+    render_queue_tail = last;
+    SDL_UnlockMutex(render_queue_lock);
+    for (int i = 0; i < count; i++) SDL_SemPost(render_pending);
+    return 0;
+}
+
+// P in the editor: the four classic types and the current buffer over six
+// octaves from 55 Hz, into the next free pack_NNN directory.
+int render_default_pack(int *number) {
+    static int pack_count = 0;
+    static const int types[] = {SINE, SQUARE, SAWTOOTH, TRIANGLE, CUSTOM};
+    double freqs[6];
+    char prefix[64];
+    for (int k = 0; k < 6; k++) freqs[k] = 55.0 * (1 << k);
+    for (int tries = 0; tries < 10000; tries++) {
+        snprintf(prefix, sizeof(prefix), "pack_%03d", ++pack_count);
+        if (mkdir(prefix, 0777) == 0) {
+            *number = pack_count;
+            strcat(prefix, "/wave");
+            return render_pack(prefix, types, 5, freqs, 6, 0.0);
+        }
+        if (errno != EEXIST) break;
+    }
+    fprintf(stderr, "Could not create a pack directory: %s\n", strerror(errno));
+    return -1;
+}
+
+void init_history(void) {
+    history_shadow = malloc((size_t)total_samples() * sizeof(float));
+    history_touched = calloc((total_samples() + HISTORY_BLOCK - 1) / HISTORY_BLOCK, 1);
+    touched_first = touched_last = -1;
+}
+
+void *history_alloc(size_t size, HistoryChunk **owner) {
+    size = (size + 7) & ~(size_t)7;
+    if (!history_chunk || history_chunk->used + size > history_chunk->size) {
+        HistoryChunk *c = NULL;
+        if (size <= HISTORY_CHUNK_BYTES && history_pool) {
+            c = history_pool;
+            history_pool = c->next;
+            history_pool_count--;
+        } else {
+            size_t cap = size > HISTORY_CHUNK_BYTES ? size : HISTORY_CHUNK_BYTES;
+            c = malloc(sizeof(HistoryChunk) + cap);
+            if (!c) return NULL;
+            c->size = cap;
+        }
+        c->next = NULL;
+        c->used = 0;
+        c->live = 0;
+        // A chunk left behind with no live edits would never be released.
+        if (history_chunk && history_chunk->live == 0) free(history_chunk);
+        history_chunk = c;
+    }
+    void *p = (char *)(history_chunk + 1) + history_chunk->used;
+    history_chunk->used += size;
+    history_chunk->live++;
+    *owner = history_chunk;
+    return p;
+}
+
+void history_release(HistoryEdit *e) {
+    HistoryChunk *c = e->chunk;
+    history_bytes -= e->bytes;
+    if (--c->live > 0) return;
+    if (c == history_chunk) {
+        c->used = 0;
+    } else if (c->size == HISTORY_CHUNK_BYTES && history_pool_count < HISTORY_POOL_CHUNKS) {
+        c->next = history_pool;
+        history_pool = c;
+        history_pool_count++;
+    } else {
+        free(c);
+    }
+}
+
+HistorySpan *next_span(HistorySpan *span) {
+    return (HistorySpan *)((char *)(span + 1) + 2 * span->length * sizeof(float));
+}
+
+void clear_touched(void) {
+    if (touched_first >= 0) memset(history_touched + touched_first, 0, touched_last - touched_first + 1);
+    touched_first = touched_last = -1;
+}
+
+void history_reset(void) {
+    for (int i = 0; i < history_count; i++) history_release(&history_edits[i]);
+    history_count = history_pos = 0;
+    if (history_shadow) memcpy(history_shadow, channel_data, (size_t)total_samples() * sizeof(float));
+    if (history_touched) clear_touched();
+}
+
+void free_history(void) {
+    for (int i = 0; i < history_count; i++) history_release(&history_edits[i]);
+    history_count = history_pos = 0;
+    free(history_chunk);
+    while (history_pool) {
+        HistoryChunk *next = history_pool->next;
+        free(history_pool);
+        history_pool = next;
+    }
+    history_chunk = NULL;
+    history_pool_count = 0;
+    free(history_edits);
+    free(history_runs);
+    if (shadow_map) munmap(shadow_map, shadow_map_bytes);
+    else free(history_shadow);
+    shadow_map = NULL;
+    free(history_touched);
+    history_edits = NULL;
+    history_runs = NULL;
+    history_shadow = NULL;
+    history_touched = NULL;
+    history_cap = history_runs_cap = 0;
+}
+
+// Collect the runs that differ from the shadow in the blocks touched since
+// the last commit into history_runs. Returns the run count and sets *bytes
+// to the size of an edit holding them.
+int touched_runs(size_t *bytes) {
+    int run_count = 0;
+    *bytes = 0;
+    if (touched_first < 0) return 0;
+    for (int b = touched_first; b <= touched_last; ) {
+        if (!history_touched[b]) { b++; continue; }
+        int first = b * HISTORY_BLOCK;
+        while (b <= touched_last && history_touched[b]) b++;
+        int last = b * HISTORY_BLOCK - 1;
+        if (last > total_samples() - 1) last = total_samples() - 1;
+
+        while (first <= last && history_shadow[first] == channel_data[first]) first++;
+        while (last >= first && history_shadow[last] == channel_data[last]) last--;
+        if (first > last) continue;
+
+        if (2 * (run_count + 1) > history_runs_cap) {
+            history_runs_cap = history_runs_cap ? history_runs_cap * 2 : 64;
+            history_runs = realloc(history_runs, history_runs_cap * sizeof(int));
+        }
+        history_runs[2 * run_count] = first;
+        history_runs[2 * run_count + 1] = last - first + 1;
+        run_count++;
+        *bytes += sizeof(HistorySpan) + 2 * (size_t)(last - first + 1) * sizeof(float);
+    }
+    return run_count;
+}
+
+// Fill spans with the shadow and current values of the runs from
+// touched_runs(). The shadow is left alone.
+void fill_touched_spans(HistorySpan *span, int run_count) {
+    for (int r = 0; r < run_count; r++) {
+        span->offset = history_runs[2 * r];
+        span->length = history_runs[2 * r + 1];
+        float *before = (float *)(span + 1);
+        memcpy(before, history_shadow + span->offset, span->length * sizeof(float));
+        memcpy(before + span->length, channel_data + span->offset, span->length * sizeof(float));
+        span = next_span(span);
+    }
+}
+
+// Commit the spans touched since the last call as one undoable edit.
+// Cost is proportional to the touched range, not the buffer length.
+void save_undo_state(void) {
+    if (touched_first < 0) return;
+
+    size_t bytes;
+    int run_count = touched_runs(&bytes);
+    clear_touched();
+    if (run_count == 0) return;
+
+    // A new edit discards the redo branch, then the oldest edits go until
+    // the new one fits in the budget.
+    while (history_count > history_pos) history_release(&history_edits[--history_count]);
+    int evict = 0;
+    while (evict < history_count && history_bytes + bytes > HISTORY_BUDGET_BYTES)
+        history_release(&history_edits[evict++]);
+    if (evict > 0) {
+        memmove(history_edits, history_edits + evict, (history_count - evict) * sizeof(HistoryEdit));
+        history_count -= evict;
+        history_pos = history_count;
+    }
+
+    HistoryEdit e;
+    e.spans = history_alloc(bytes, &e.chunk);
+    if (!e.spans) {
+        fprintf(stderr, "Out of memory recording undo history\n");
+        memcpy(history_shadow, channel_data, (size_t)total_samples() * sizeof(float));
+        return;
+    }
+    e.span_count = run_count;
+    e.bytes = bytes;
+
+    fill_touched_spans(e.spans, run_count);
+    HistorySpan *span = e.spans;
+    for (int r = 0; r < run_count; r++) {
+        memcpy(history_shadow + span->offset, (float *)(span + 1) + span->length, span->length * sizeof(float));
+        span = next_span(span);
+    }
+
+    if (history_count == history_cap) {
+        history_cap = history_cap ? history_cap * 2 : 64;
+        history_edits = realloc(history_edits, history_cap * sizeof(HistoryEdit));
+    }
+    history_edits[history_count++] = e;
+    history_pos = history_count;
+    history_bytes += bytes;
+}
+
+void apply_history_edit(HistoryEdit *e, int use_after) {
+    HistorySpan *span = e->spans;
+    for (int i = 0; i < e->span_count; i++) {
+        float *values = (float *)(span + 1) + (use_after ? span->length : 0);
+        memcpy(channel_data + span->offset, values, span->length * sizeof(float));
+        memcpy(history_shadow + span->offset, values, span->length * sizeof(float));
+        invalidate_range(span->offset, span->offset + span->length - 1);
+        span = next_span(span);
+    }
+    publish_waveform();
+}
+
+void undo(void) {
+    save_undo_state();
+    if (history_pos <= 0) return;
+    apply_history_edit(&history_edits[--history_pos], 0);
+}
+
+void redo(void) {
+    save_undo_state();
+    if (history_pos >= history_count) return;
+    apply_history_edit(&history_edits[history_pos++], 1);
+}
+
+// Brush kernels. Each brush builds (or reuses) its parabolic weight window,
+// picks one op outside the loop, and hands a contiguous span to brush_kernel,
+// which is bound at start-up to the widest instruction set the CPU supports.
+enum {
+    KERNEL_BLEND,           // x*(1-w) + a*w
+    KERNEL_ADD,             // x + a*w
+    KERNEL_SMOOTH,          // x + (a-x)*w*b
+    KERNEL_SCALE,           // x * (1 + a*w)
+    KERNEL_ADD_SIGNAL,      // x + s*w*a
+    KERNEL_MIX_SIGNAL,      // s*a + x*(1-a)
+    KERNEL_ADD_SIGNAL_CONST,// x + s*a
+    KERNEL_BLEND_SIGNAL     // x + (s-x)*w
+};
+
+typedef void (*BrushKernel)(float *x, const float *w, const float *sig, int n, int op, float a, float b);
+
+#define BRUSH_WINDOW_CACHE 4
+
+typedef struct {
+    int radius;
+    float strength;
+    int cap;
+    float *weights;         // 2*radius-1 entries, centre at radius-1
+} BrushWindow;
+
+BrushWindow brush_windows[BRUSH_WINDOW_CACHE];
+int brush_window_next = 0;
+
+float *kernel_scratch = NULL;
+int kernel_scratch_cap = 0;
+double *sum_scratch = NULL;
+int sum_scratch_cap = 0;
+
+float clamp_amplitude(float v) {
+    const float hi = (float)AMPLITUDE;
+    v = v > hi ? hi : v;
+    return v < -hi ? -hi : v;
+}
+
+void brush_kernel_scalar(float *x, const float *w, const float *sig, int n, int op, float a, float b) {
+    switch (op) {
+        case KERNEL_BLEND:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] * (1.0f - w[i]) + a * w[i]);
+            break;
+        case KERNEL_ADD:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] + a * w[i]);
+            break;
+        case KERNEL_SMOOTH:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] + (a - x[i]) * w[i] * b);
+            break;
+        case KERNEL_SCALE:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] * (1.0f + a * w[i]));
+            break;
+        case KERNEL_ADD_SIGNAL:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] + sig[i] * w[i] * a);
+            break;
+        case KERNEL_MIX_SIGNAL:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(sig[i] * a + x[i] * (1.0f - a));
+            break;
+        case KERNEL_ADD_SIGNAL_CONST:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] + sig[i] * a);
+            break;
+        case KERNEL_BLEND_SIGNAL:
+            for (int i = 0; i < n; i++) x[i] = clamp_amplitude(x[i] + (sig[i] - x[i]) * w[i]);
+            break;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+TARGET_SSE2
+void brush_kernel_sse2(float *x, const float *w, const float *sig, int n, int op, float a, float b) {
+    const __m128 hi = _mm_set1_ps((float)AMPLITUDE), lo = _mm_set1_ps((float)-AMPLITUDE);
+    const __m128 one = _mm_set1_ps(1.0f), va = _mm_set1_ps(a), vb = _mm_set1_ps(b);
+    int i = 0;
+    switch (op) {
+        case KERNEL_BLEND:
+            for (; i + 4 <= n; i += 4) {
+                __m128 xv = _mm_loadu_ps(x + i), wv = _mm_loadu_ps(w + i);
+                __m128 r = _mm_add_ps(_mm_mul_ps(xv, _mm_sub_ps(one, wv)), _mm_mul_ps(va, wv));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_ADD:
+            for (; i + 4 <= n; i += 4) {
+                __m128 r = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(va, _mm_loadu_ps(w + i)));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_SMOOTH:
+            for (; i + 4 <= n; i += 4) {
+                __m128 xv = _mm_loadu_ps(x + i);
+                __m128 r = _mm_add_ps(xv, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(va, xv), _mm_loadu_ps(w + i)), vb));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_SCALE:
+            for (; i + 4 <= n; i += 4) {
+                __m128 r = _mm_mul_ps(_mm_loadu_ps(x + i), _mm_add_ps(one, _mm_mul_ps(va, _mm_loadu_ps(w + i))));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_ADD_SIGNAL:
+            for (; i + 4 <= n; i += 4) {
+                __m128 r = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(sig + i), _mm_loadu_ps(w + i)), va));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_MIX_SIGNAL: {
+            __m128 keep = _mm_set1_ps(1.0f - a);
+            for (; i + 4 <= n; i += 4) {
+                __m128 r = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(sig + i), va), _mm_mul_ps(_mm_loadu_ps(x + i), keep));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        }
+        case KERNEL_ADD_SIGNAL_CONST:
+            for (; i + 4 <= n; i += 4) {
+                __m128 r = _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(_mm_loadu_ps(sig + i), va));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_BLEND_SIGNAL:
+            for (; i + 4 <= n; i += 4) {
+                __m128 xv = _mm_loadu_ps(x + i);
+                __m128 r = _mm_add_ps(xv, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(sig + i), xv), _mm_loadu_ps(w + i)));
+                _mm_storeu_ps(x + i, _mm_min_ps(_mm_max_ps(r, lo), hi));
+            }
+            break;
+    }
+    if (i < n) brush_kernel_scalar(x + i, w ? w + i : NULL, sig ? sig + i : NULL, n - i, op, a, b);
+}
+
+TARGET_AVX2
+void brush_kernel_avx2(float *x, const float *w, const float *sig, int n, int op, float a, float b) {
+    const __m256 hi = _mm256_set1_ps((float)AMPLITUDE), lo = _mm256_set1_ps((float)-AMPLITUDE);
+    const __m256 one = _mm256_set1_ps(1.0f), va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b);
+    int i = 0;
+    switch (op) {
+        case KERNEL_BLEND:
+            for (; i + 8 <= n; i += 8) {
+                __m256 xv = _mm256_loadu_ps(x + i), wv = _mm256_loadu_ps(w + i);
+                __m256 r = _mm256_add_ps(_mm256_mul_ps(xv, _mm256_sub_ps(one, wv)), _mm256_mul_ps(va, wv));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_ADD:
+            for (; i + 8 <= n; i += 8) {
+                __m256 r = _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(va, _mm256_loadu_ps(w + i)));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_SMOOTH:
+            for (; i + 8 <= n; i += 8) {
+                __m256 xv = _mm256_loadu_ps(x + i);
+                __m256 r = _mm256_add_ps(xv, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(va, xv), _mm256_loadu_ps(w + i)), vb));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_SCALE:
+            for (; i + 8 <= n; i += 8) {
+                __m256 r = _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_add_ps(one, _mm256_mul_ps(va, _mm256_loadu_ps(w + i))));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_ADD_SIGNAL:
+            for (; i + 8 <= n; i += 8) {
+                __m256 r = _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(sig + i), _mm256_loadu_ps(w + i)), va));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_MIX_SIGNAL: {
+            __m256 keep = _mm256_set1_ps(1.0f - a);
+            for (; i + 8 <= n; i += 8) {
+                __m256 r = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(sig + i), va), _mm256_mul_ps(_mm256_loadu_ps(x + i), keep));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        }
+        case KERNEL_ADD_SIGNAL_CONST:
+            for (; i + 8 <= n; i += 8) {
+                __m256 r = _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(_mm256_loadu_ps(sig + i), va));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+        case KERNEL_BLEND_SIGNAL:
+            for (; i + 8 <= n; i += 8) {
+                __m256 xv = _mm256_loadu_ps(x + i);
+                __m256 r = _mm256_add_ps(xv, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(sig + i), xv), _mm256_loadu_ps(w + i)));
+                _mm256_storeu_ps(x + i, _mm256_min_ps(_mm256_max_ps(r, lo), hi));
+            }
+            break;
+    }
+    // The scalar tail is legacy SSE code, which stalls on dirty upper halves.
+    _mm256_zeroupper();
+    if (i < n) brush_kernel_scalar(x + i, w ? w + i : NULL, sig ? sig + i : NULL, n - i, op, a, b);
+}
+#endif
+
+void mix_kernel_scalar(float *out, const float *in, int n, float gain, float delta) {
+    for (int i = 0; i < n; i++) out[i] += in[i] * (gain + i * delta);
+}
+
+#ifdef HAVE_X86_SIMD
+TARGET_SSE2
+void mix_kernel_sse2(float *out, const float *in, int n, float gain, float delta) {
+    __m128 g = _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_set1_ps(delta), _mm_setr_ps(0, 1, 2, 3)));
+    __m128 step = _mm_set1_ps(4.0f * delta);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+        g = _mm_add_ps(g, step);
+    }
+    if (i < n) mix_kernel_scalar(out + i, in + i, n - i, gain + i * delta, delta);
+}
+
+TARGET_AVX2
+void mix_kernel_avx2(float *out, const float *in, int n, float gain, float delta) {
+    __m256 g = _mm256_add_ps(_mm256_set1_ps(gain), _mm256_mul_ps(_mm256_set1_ps(delta), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+    __m256 step = _mm256_set1_ps(8.0f * delta);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(_mm256_loadu_ps(in + i), g)));
+        g = _mm256_add_ps(g, step);
+    }
+    _mm256_zeroupper();
+    if (i < n) mix_kernel_scalar(out + i, in + i, n - i, gain + i * delta, delta);
+}
+#endif
+
+void interleave_kernel_scalar(float *const *planes, int channels, int n, float *out) {
+    if (channels == 1) {
+        memcpy(out, planes[0], n * sizeof(float));
+        return;
+    }
+    for (int c = 0; c < channels; c++) {
+        const float *in = planes[c];
+        float *o = out + c;
+        for (int i = 0; i < n; i++) o[i * channels] = in[i];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+// Stereo and quad are whole-register shuffles; other counts take the
+// strided scalar copy.
+TARGET_SSE2
+void interleave_kernel_sse2(float *const *planes, int channels, int n, float *out) {
+    int i = 0;
+    if (channels == 2) {
+        const float *l = planes[0], *r = planes[1];
+        for (; i + 4 <= n; i += 4) {
+            __m128 a = _mm_loadu_ps(l + i), b = _mm_loadu_ps(r + i);
+            _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(a, b));
+            _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(a, b));
+        }
+    } else if (channels == 4) {
+        for (; i + 4 <= n; i += 4) {
+            __m128 a = _mm_loadu_ps(planes[0] + i), b = _mm_loadu_ps(planes[1] + i);
+            __m128 c = _mm_loadu_ps(planes[2] + i), d = _mm_loadu_ps(planes[3] + i);
+            _MM_TRANSPOSE4_PS(a, b, c, d);
+            _mm_storeu_ps(out + 4 * i, a);
+            _mm_storeu_ps(out + 4 * i + 4, b);
+            _mm_storeu_ps(out + 4 * i + 8, c);
+            _mm_storeu_ps(out + 4 * i + 12, d);
+        }
+    }
+    if (i < n) {
+        float *rest[MAX_CHANNELS];
+        for (int c = 0; c < channels; c++) rest[c] = planes[c] + i;
+        interleave_kernel_scalar(rest, channels, n - i, out + (size_t)i * channels);
+    }
+}
+#endif
+
+BrushKernel brush_kernel = brush_kernel_scalar;
+const char *brush_kernel_name = "scalar";
+
+// Pick the brush, mix, interleave and EQ kernels for this CPU.
+// AUDIOGEN_SIMD=scalar|sse2|avx2 caps the choice, which is handy for
+// comparing implementations.
+void select_kernels(void) {
+    const char *cap = getenv("AUDIOGEN_SIMD");
+    brush_kernel = brush_kernel_scalar;
+    mix_kernel = mix_kernel_scalar;
+    interleave_kernel = interleave_kernel_scalar;
+    eq_kernel = eq_kernel_scalar;
+    brush_kernel_name = "scalar";
+    if (cap && strcmp(cap, "scalar") == 0) return;
+#ifdef HAVE_X86_SIMD
+    if (SDL_HasSSE2()) {
+        brush_kernel = brush_kernel_sse2;
+        mix_kernel = mix_kernel_sse2;
+        interleave_kernel = interleave_kernel_sse2;
+        eq_kernel = eq_kernel_sse2;
+        brush_kernel_name = "sse2";
+    }
+    if (cap && strcmp(cap, "sse2") == 0) return;
+    if (SDL_HasAVX2()) {
+        brush_kernel = brush_kernel_avx2;
+        mix_kernel = mix_kernel_avx2;
+        eq_kernel = eq_kernel_avx2;
+        brush_kernel_name = "avx2";
+    }
+#endif
+}
+
+// Weights strength * (1 - d^2) for offsets -(radius-1)..radius-1; the
+// returned pointer addresses offset 0. Recently used windows are kept, so a
+// stroke with a fixed tool and intensity builds its window once.
+const float *brush_window(int radius, float strength) {
+    for (int i = 0; i < BRUSH_WINDOW_CACHE; i++) {
+        BrushWindow *bw = &brush_windows[i];
+        if (bw->weights && bw->radius == radius && bw->strength == strength) return bw->weights + radius - 1;
+    }
+    BrushWindow *bw = &brush_windows[brush_window_next];
+    brush_window_next = (brush_window_next + 1) % BRUSH_WINDOW_CACHE;
+    int len = 2 * radius - 1;
+    if (len > bw->cap) {
+        bw->weights = realloc(bw->weights, len * sizeof(float));
+        bw->cap = len;
+    }
+    bw->radius = radius;
+    bw->strength = strength;
+    for (int k = 0; k < radius; k++) {
+        float dist = k / (float)radius;
+        float weight = strength * (1.0f - dist * dist);
+        bw->weights[radius - 1 + k] = weight;
+        bw->weights[radius - 1 - k] = weight;
+    }
+    return bw->weights + radius - 1;
+}
+
+float *get_kernel_scratch(int n) {
+    if (n > kernel_scratch_cap) {
+        kernel_scratch = realloc(kernel_scratch, n * sizeof(float));
+        kernel_scratch_cap = n;
+    }
+    return kernel_scratch;
+}
+
+void free_kernels(void) {
+    for (int i = 0; i < BRUSH_WINDOW_CACHE; i++) {
+        free(brush_windows[i].weights);
+        brush_windows[i].weights = NULL;
+        brush_windows[i].cap = 0;
+    }
+    free(kernel_scratch);
+    kernel_scratch = NULL;
+    kernel_scratch_cap = 0;
+    free(sum_scratch);
+    sum_scratch = NULL;
+    sum_scratch_cap = 0;
+}
+
+void apply_smear(int curr_idx) {
+    if (smear_start_idx == -1) return;
+    int direction = (curr_idx > smear_start_idx) ? 1 : -1;
+    int current_distance = abs(curr_idx - smear_start_idx);
+    if (current_distance < 30) return;
+    if (current_distance > smear_max_distance) smear_max_distance = current_distance;
+
+    float max_fade = buffer_samples * 0.35f;
+    float fade_factor = 1.0f - fmin(1.0f, smear_max_distance / max_fade);
+    float intensity = brush_intensity * fade_factor * 1.2f;
+    if (intensity <= 0.01f) return;
+
+    int copy_half_len = (int)(50 + smear_width * 350);
+    int capture_start = fmax(0, smear_start_idx - copy_half_len);
+    int capture_end = fmin(buffer_samples - 1, smear_start_idx + copy_half_len);
+    int copy_len = capture_end - capture_start + 1;
+    int paste_start = smear_start_idx + direction * current_distance;
+    int paste_end = paste_start + (copy_len - 1) * direction;
+    mark_dirty(paste_start < paste_end ? paste_start : paste_end, paste_start < paste_end ? paste_end : paste_start);
+
+    for (int offset = 0; offset < copy_len; offset++) {
+        int src_idx = capture_start + offset;
+        int dst_idx = paste_start + offset * direction;
+        if (dst_idx < 0 || dst_idx >= buffer_samples) continue;
+        float dist_ratio = (float)abs(dst_idx - smear_start_idx) / (current_distance + copy_len);
+        float weight = intensity * (1.0f - dist_ratio);
+        if (weight > 0.01f) {
+            float copied = waveform_buffer[src_idx];
+            waveform_buffer[dst_idx] += copied * weight;
+            if (waveform_buffer[dst_idx] > AMPLITUDE) waveform_buffer[dst_idx] = AMPLITUDE;
+            if (waveform_buffer[dst_idx] < -AMPLITUDE) waveform_buffer[dst_idx] = -AMPLITUDE;
+        }
+    }
+}
+
+void apply_brush(int center_idx, float target_val, int radius, float base_strength, int mode) {
+    if (radius <= 0) return;
+    float strength = base_strength * brush_intensity;
+    int start = fmax(0, center_idx - radius + 1);
+    int end = fmin(buffer_samples - 1, center_idx + radius - 1);
+    if (start > end) return;
+    mark_dirty(start, end);
+    const float *w = brush_window(radius, strength) + (start - center_idx);
+    int op = (mode == 0) ? KERNEL_BLEND : (mode == 1) ? KERNEL_ADD : KERNEL_SMOOTH;
+    brush_kernel(waveform_buffer + start, w, NULL, end - start + 1, op, target_val, 0.7f);
+}
+
+void apply_multiply(int center_idx, float factor, int radius) {
+    if (radius <= 0) return;
+    int start = fmax(0, center_idx - radius + 1);
+    int end = fmin(buffer_samples - 1, center_idx + radius - 1);
+    if (start > end) return;
+    mark_dirty(start, end);
+    const float *w = brush_window(radius, brush_intensity) + (start - center_idx);
+    brush_kernel(waveform_buffer + start, w, NULL, end - start + 1, KERNEL_SCALE, factor - 1.0f, 0.0f);
+}
+
+void apply_additive_wave(int center_idx, float pitch_norm, int radius, int wave_type) {
+    if (radius <= 0) return;
+    float strength = brush_intensity * 0.8f;
+    // The pattern's phase spans the full (clamped) window, as before; only
+    // samples strictly inside the radius are touched.
+    int start = fmax(0, center_idx - radius);
+    int end = fmin(buffer_samples - 1, center_idx + radius);
+    int first = fmax(start, center_idx - radius + 1);
+    int last = fmin(end, center_idx + radius - 1);
+    if (first > last) return;
+    mark_dirty(first, last);
+
+    double base_freq = 50.0 + pitch_norm * 400.0;
+    double span = end - start + 1;
+    int n = last - first + 1;
+    float *sig = get_kernel_scratch(n);
+    switch (wave_type) {
+        case 0:
+            for (int i = 0; i < n; i++) {
+                double pos = (first + i - start) / span;
+                sig[i] = (float)sin(pos * 2.0 * M_PI + base_freq * pos * 0.1);
+            }
+            break;
+        case 1:
+            for (int i = 0; i < n; i++) {
+                double pos = (first + i - start) / span;
+                sig[i] = (fmod(pos * 2.0 * M_PI * base_freq * 0.05, 2.0 * M_PI) < M_PI) ? 1.0f : -1.0f;
+            }
+            break;
+        case 2:
+            for (int i = 0; i < n; i++) {
+                double pos = (first + i - start) / span;
+                sig[i] = (float)(2.0 * fmod(pos * base_freq * 0.05, 1.0) - 1.0);
+            }
+            break;
+        case 3:
+            for (int i = 0; i < n; i++) {
+                double tri = fmod((first + i - start) / span * base_freq * 0.05, 1.0);
+                sig[i] = (float)((tri < 0.5) ? (4.0 * tri - 1.0) : (3.0 - 4.0 * tri));
+            }
+            break;
+        default:
+            memset(sig, 0, n * sizeof(float));
+    }
+    const float *w = brush_window(radius, strength) + (first - center_idx);
+    brush_kernel(waveform_buffer + first, w, sig, n, KERNEL_ADD_SIGNAL, (float)(AMPLITUDE * 0.6), 0.0f);
+}
+
+// Triangular low-pass with half-width `taps`, computed as two cascaded box
+// filters of width taps+1 with running sums, so the cost per sample does not
+// depend on the kernel size. Everything is read before anything is written,
+// and samples past the buffer ends are left out of both the sum and the
+// weight (normalized convolution) instead of being treated as zero.
+void apply_lowpass_soften(int center_idx, float strength, int radius) {
+    if (strength < 0.05f || radius <= 0) return;
+    int taps = (int)(radius * (0.15f + 0.5f * strength));
+    if (taps < 1) taps = 1;
+    int start = fmax(0, center_idx - radius);
+    int end = fmin(buffer_samples - 1, center_idx + radius);
+    if (start > end) return;
+    int n = end - start + 1;
+    int span = n + taps;
+    mark_dirty(start, end);
+
+    if (2 * span > sum_scratch_cap) {
+        sum_scratch = realloc(sum_scratch, 2 * span * sizeof(double));
+        sum_scratch_cap = 2 * span;
+    }
+    double *box = sum_scratch, *box_w = sum_scratch + span;
+
+    // First box: box[i] = sum of x[i - taps .. i] for i in [start, end + taps].
+    double sum = 0.0, wsum = 0.0;
+    for (int t = start - taps; t <= end + taps; t++) {
+        if (t >= 0 && t < buffer_samples) { sum += waveform_buffer[t]; wsum += 1.0; }
+        int old = t - taps - 1;
+        if (old >= start - taps && old >= 0 && old < buffer_samples) { sum -= waveform_buffer[old]; wsum -= 1.0; }
+        if (t >= start) { box[t - start] = sum; box_w[t - start] = wsum; }
+    }
+
+    // Second box looks forward over the first, centring the triangle.
+    float *delta = get_kernel_scratch(n);
+    sum = wsum = 0.0;
+    for (int k = 0; k < taps; k++) { sum += box[k]; wsum += box_w[k]; }
+    for (int i = 0; i < n; i++) {
+        sum += box[i + taps];
+        wsum += box_w[i + taps];
+        float dist = abs(start + i - center_idx) / (float)radius;
+        float envelope = strength * (1.0f - dist);
+        delta[i] = (envelope < 0.05f) ? 0.0f : ((float)(sum / wsum) - waveform_buffer[start + i]) * envelope;
+        sum -= box[i];
+        wsum -= box_w[i];
+    }
+    brush_kernel(waveform_buffer + start, NULL, delta, n, KERNEL_ADD_SIGNAL_CONST, 1.0f, 0.0f);
+}
+
+// EQ brushes. Each brush is a short cascade of RBJ cookbook biquads run
+// forwards and then backwards over a padded copy of the brush window, which
+// cancels the phase shift and squares the magnitude response (so each pass
+// gets half the requested gain in dB). The difference from the original is
+// then faded in with the usual brush window.
+typedef enum { EQ_LOW_SHELF, EQ_HIGH_SHELF, EQ_PEAKING } EqType;
+
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} Biquad;
+
+typedef struct {
+    int type;
+    float freq, q, gain_db;
+    int rate;
+    int valid;
+    Biquad bq;
+} EqCacheEntry;
+
+#define EQ_CACHE_SIZE 8
+
+EqCacheEntry eq_cache[EQ_CACHE_SIZE];
+int eq_cache_next = 0;
+
+const Biquad *eq_coefficients(int type, float freq, float q, float gain_db) {
+    for (int i = 0; i < EQ_CACHE_SIZE; i++) {
+        EqCacheEntry *e = &eq_cache[i];
+        if (e->valid && e->type == type && e->freq == freq && e->q == q && e->gain_db == gain_db && e->rate == sample_rate)
+            return &e->bq;
+    }
+    EqCacheEntry *e = &eq_cache[eq_cache_next];
+    eq_cache_next = (eq_cache_next + 1) % EQ_CACHE_SIZE;
+    e->type = type;
+    e->freq = freq;
+    e->q = q;
+    e->gain_db = gain_db;
+    e->rate = sample_rate;
+    e->valid = 1;
+
+    double A = pow(10.0, gain_db / 40.0);
+    double w0 = 2.0 * M_PI * freq / sample_rate;
+    double cw = cos(w0), alpha = sin(w0) / (2.0 * q);
+    double sa = 2.0 * sqrt(A) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+    switch (type) {
+        case EQ_LOW_SHELF:
+            b0 = A * ((A + 1) - (A - 1) * cw + sa);
+            b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+            b2 = A * ((A + 1) - (A - 1) * cw - sa);
+            a0 = (A + 1) + (A - 1) * cw + sa;
+            a1 = -2 * ((A - 1) + (A + 1) * cw);
+            a2 = (A + 1) + (A - 1) * cw - sa;
+            break;
+        case EQ_HIGH_SHELF:
+            b0 = A * ((A + 1) + (A - 1) * cw + sa);
+            b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+            b2 = A * ((A + 1) + (A - 1) * cw - sa);
+            a0 = (A + 1) - (A - 1) * cw + sa;
+            a1 = 2 * ((A - 1) - (A + 1) * cw);
+            a2 = (A + 1) - (A - 1) * cw - sa;
+            break;
+        default:
+            b0 = 1 + alpha * A;
+            b1 = -2 * cw;
+            b2 = 1 - alpha * A;
+            a0 = 1 + alpha / A;
+            a1 = -2 * cw;
+            a2 = 1 - alpha / A;
+            break;
+    }
+    e->bq = (Biquad){(float)(b0 / a0), (float)(b1 / a0), (float)(b2 / a0), (float)(a1 / a0), (float)(a2 / a0)};
+    return &e->bq;
+}
+
+#define EQ_MAX_STAGES 2
+
+// Up to two TDF-II biquads in series, four states in all. Besides the
+// per-sample form the cascade is kept as block steps of 4 and 8 samples:
+// with the states s and inputs x of a block,
+//   y[i]  = sum_j s[j] * state_out[j][i]  + sum_k x[k] * input_out[k][i]
+//   s'[i] = sum_j s[j] * state_next[j][i] + sum_k x[k] * input_next[k][i]
+// so the vector kernels carry only s from block to block.
+struct EqCascade {
+    int count;
+    Biquad stages[EQ_MAX_STAGES];
+    double settled[4];                      // steady states for a unit input
+    float state_out4[4][4], input_out4[4][4], state_next4[4][4], input_next4[4][4];
+    float state_out8[4][8], input_out8[8][8], state_next8[4][4], input_next8[8][4];
+};
+
+EqCascade eq_cascade;
+
+double eq_step(const EqCascade *eq, double *s, double in) {
+    for (int k = 0; k < eq->count; k++) {
+        const Biquad *bq = &eq->stages[k];
+        double *st = s + 2 * k;
+        double y = bq->b0 * in + st[0];
+        st[0] = bq->b1 * in - bq->a1 * y + st[1];
+        st[1] = bq->b2 * in - bq->a2 * y;
+        in = y;
+    }
+    return in;
+}
+
+// States for a constant input, so a padded edge does not ring.
+void eq_settle(const EqCascade *eq, double *s, double in) {
+    for (int j = 0; j < 4; j++) s[j] = eq->settled[j] * in;
+}
+
+// Fills the block matrices by running the per-sample cascade from each
+// unit state and each unit impulse, so every path computes the same filter.
+void eq_block_matrices(const EqCascade *eq, int len, float *state_out, float *input_out, float *state_next, float *input_next) {
+    for (int j = 0; j < 4 + len; j++) {
+        double s[4] = {0};
+        if (j < 2 * eq->count) s[j] = 1.0;
+        float *out = j < 4 ? state_out + j * len : input_out + (j - 4) * len;
+        float *next = j < 4 ? state_next + j * 4 : input_next + (j - 4) * 4;
+        for (int i = 0; i < len; i++) out[i] = (float)eq_step(eq, s, i == j - 4 ? 1.0 : 0.0);
+        for (int i = 0; i < 4; i++) next[i] = (float)s[i];
+    }
+}
+
+const EqCascade *get_eq_cascade(const Biquad **stages, int count) {
+    int same = eq_cascade.count == count;
+    for (int k = 0; same && k < count; k++)
+        same = memcmp(&eq_cascade.stages[k], stages[k], sizeof(Biquad)) == 0;
+    if (same) return &eq_cascade;
+    EqCascade *eq = &eq_cascade;
+    eq->count = count;
+    for (int k = 0; k < count; k++) eq->stages[k] = *stages[k];
+    double in = 1.0;
+    for (int k = 0; k < EQ_MAX_STAGES; k++) {
+        double *st = eq->settled + 2 * k;
+        if (k >= count) { st[0] = st[1] = 0.0; continue; }
+        const Biquad *bq = &eq->stages[k];
+        double y = in * (bq->b0 + bq->b1 + bq->b2) / (1.0 + bq->a1 + bq->a2);
+        st[0] = y - bq->b0 * in;
+        st[1] = bq->b2 * in - bq->a2 * y;
+        in = y;
+    }
+    eq_block_matrices(eq, 4, eq->state_out4[0], eq->input_out4[0], eq->state_next4[0], eq->input_next4[0]);
+    eq_block_matrices(eq, 8, eq->state_out8[0], eq->input_out8[0], eq->state_next8[0], eq->input_next8[0]);
+    return eq;
+}
+
+void eq_kernel_scalar(const EqCascade *eq, float *x, int n, int step, double *s) {
+    for (int i = 0; i < n; i++) x[i * step] = (float)eq_step(eq, s, x[i * step]);
+}
+
+#ifdef HAVE_X86_SIMD
+// Four samples per block. The input terms do not depend on the states, so
+// the only serial work is the 4x4 state update. A backward pass reads each
+// block from its far end and stores it reversed.
+TARGET_SSE2
+void eq_kernel_sse2(const EqCascade *eq, float *x, int n, int step, double *s) {
+    __m128 so[4], io[4], sn[4], in[4];
+    for (int j = 0; j < 4; j++) {
+        so[j] = _mm_loadu_ps(eq->state_out4[j]);
+        io[j] = _mm_loadu_ps(eq->input_out4[j]);
+        sn[j] = _mm_loadu_ps(eq->state_next4[j]);
+        in[j] = _mm_loadu_ps(eq->input_next4[j]);
+    }
+    __m128 st = _mm_setr_ps((float)s[0], (float)s[1], (float)s[2], (float)s[3]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float *b = x + i * step;
+        __m128 x0 = _mm_set1_ps(b[0]), x1 = _mm_set1_ps(b[step]);
+        __m128 x2 = _mm_set1_ps(b[2 * step]), x3 = _mm_set1_ps(b[3 * step]);
+        __m128 s0 = _mm_shuffle_ps(st, st, 0x00), s1 = _mm_shuffle_ps(st, st, 0x55);
+        __m128 s2 = _mm_shuffle_ps(st, st, 0xAA), s3 = _mm_shuffle_ps(st, st, 0xFF);
+        __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(io[0], x0), _mm_mul_ps(io[1], x1)),
+                              _mm_add_ps(_mm_mul_ps(io[2], x2), _mm_mul_ps(io[3], x3)));
+        __m128 nx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(in[0], x0), _mm_mul_ps(in[1], x1)),
+                               _mm_add_ps(_mm_mul_ps(in[2], x2), _mm_mul_ps(in[3], x3)));
+        y = _mm_add_ps(y, _mm_add_ps(_mm_add_ps(_mm_mul_ps(so[0], s0), _mm_mul_ps(so[1], s1)),
+                                     _mm_add_ps(_mm_mul_ps(so[2], s2), _mm_mul_ps(so[3], s3))));
+        st = _mm_add_ps(nx, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sn[0], s0), _mm_mul_ps(sn[1], s1)),
+                                       _mm_add_ps(_mm_mul_ps(sn[2], s2), _mm_mul_ps(sn[3], s3))));
+        if (step > 0) _mm_storeu_ps(b, y);
+        else _mm_storeu_ps(b - 3, _mm_shuffle_ps(y, y, 0x1B));
+    }
+    float f[4];
+    _mm_storeu_ps(f, st);
+    for (int j = 0; j < 4; j++) s[j] = f[j];
+    if (i < n) eq_kernel_scalar(eq, x + i * step, n - i, step, s);
+}
+
+// Eight samples per block. The states are kept in both halves of a
+// register so each one broadcasts with an in-lane permute.
+TARGET_AVX2
+void eq_kernel_avx2(const EqCascade *eq, float *x, int n, int step, double *s) {
+    __m256 so[4], sn[4], io[8], in[8];
+    for (int j = 0; j < 4; j++) {
+        so[j] = _mm256_loadu_ps(eq->state_out8[j]);
+        __m128 r = _mm_loadu_ps(eq->state_next8[j]);
+        sn[j] = _mm256_set_m128(r, r);
+    }
+    for (int k = 0; k < 8; k++) {
+        io[k] = _mm256_loadu_ps(eq->input_out8[k]);
+        __m128 r = _mm_loadu_ps(eq->input_next8[k]);
+        in[k] = _mm256_set_m128(r, r);
+    }
+    __m256 st = _mm256_setr_ps((float)s[0], (float)s[1], (float)s[2], (float)s[3],
+                               (float)s[0], (float)s[1], (float)s[2], (float)s[3]);
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float *b = x + i * step;
+        __m256 y = _mm256_setzero_ps(), nx = _mm256_setzero_ps();
+        for (int k = 0; k < 8; k += 2) {
+            __m256 xa = _mm256_broadcast_ss(b + k * step), xb = _mm256_broadcast_ss(b + (k + 1) * step);
+            y = _mm256_add_ps(y, _mm256_add_ps(_mm256_mul_ps(io[k], xa), _mm256_mul_ps(io[k + 1], xb)));
+            nx = _mm256_add_ps(nx, _mm256_add_ps(_mm256_mul_ps(in[k], xa), _mm256_mul_ps(in[k + 1], xb)));
+        }
+        __m256 s0 = _mm256_permute_ps(st, 0x00), s1 = _mm256_permute_ps(st, 0x55);
+        __m256 s2 = _mm256_permute_ps(st, 0xAA), s3 = _mm256_permute_ps(st, 0xFF);
+        y = _mm256_add_ps(y, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(so[0], s0), _mm256_mul_ps(so[1], s1)),
+                                           _mm256_add_ps(_mm256_mul_ps(so[2], s2), _mm256_mul_ps(so[3], s3))));
+        st = _mm256_add_ps(nx, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sn[0], s0), _mm256_mul_ps(sn[1], s1)),
+                                             _mm256_add_ps(_mm256_mul_ps(sn[2], s2), _mm256_mul_ps(sn[3], s3))));
+        if (step > 0) _mm256_storeu_ps(b, y);
+        else _mm256_storeu_ps(b - 7, _mm256_permutevar8x32_ps(y, reverse));
+    }
+    float f[4];
+    _mm_storeu_ps(f, _mm256_castps256_ps128(st));
+    _mm256_zeroupper();
+    for (int j = 0; j < 4; j++) s[j] = f[j];
+    if (i < n) eq_kernel_scalar(eq, x + i * step, n - i, step, s);
+}
+#endif
+
+void apply_eq_brush(int center_idx, const Biquad **stages, int count, float lowest_freq, float strength, int radius) {
+    if (strength < 0.02f || radius <= 0) return;
+    if (strength > 1.0f) strength = 1.0f;
+    int start = fmax(0, center_idx - radius + 1);
+    int end = fmin(buffer_samples - 1, center_idx + radius - 1);
+    if (start > end) return;
+    // A few periods of the lowest corner lets the filter settle before the
+    // samples that are kept. The window fades to nothing at its edges, so
+    // half a radius of lead-in is as much as a small brush can use.
+    int pad = (int)fmin(3.0f * sample_rate / lowest_freq, radius / 4 + 1);
+    int lo = fmax(0, start - pad);
+    int hi = fmin(buffer_samples - 1, end + pad);
+    int n = hi - lo + 1;
+    mark_dirty(start, end);
+
+    // The stages are linear and time-invariant, so the whole cascade can run
+    // forward and then backward for a zero-phase result.
+    const EqCascade *eq = get_eq_cascade(stages, count);
+    float *work = get_kernel_scratch(n);
+    double s[4];
+    memcpy(work, waveform_buffer + lo, n * sizeof(float));
+    eq_settle(eq, s, work[0]);
+    eq_kernel(eq, work, n, 1, s);
+    eq_settle(eq, s, work[n - 1]);
+    eq_kernel(eq, work + n - 1, n, -1, s);
+
+    const float *w = brush_window(radius, strength) + (start - center_idx);
+    brush_kernel(waveform_buffer + start, w, work + (start - lo), end - start + 1, KERNEL_BLEND_SIGNAL, 0.0f, 0.0f);
+}
+
+void apply_add_treble(int center_idx, float mouse_strength) {
+    float gain_db = 3.0f + mouse_strength * 9.0f;
+    const Biquad *stages[] = { eq_coefficients(EQ_HIGH_SHELF, 4000.0f, 0.707f, gain_db * 0.5f) };
+    apply_eq_brush(center_idx, stages, 1, 4000.0f, brush_intensity, view_radius(40));
+}
+
+void apply_add_mid(int center_idx, float mouse_strength) {
+    float gain_db = 3.0f + mouse_strength * 9.0f;
+    const Biquad *stages[] = { eq_coefficients(EQ_PEAKING, 1000.0f, 0.9f, gain_db * 0.5f) };
+    apply_eq_brush(center_idx, stages, 1, 1000.0f, brush_intensity, view_radius(50));
+}
+
+void apply_sub_bass(int center_idx, float mouse_strength) {
+    // Boost the lows and trim the top a little so the boost is audible
+    // without pushing the rest of the signal into the clip.
+    float gain_db = 3.0f + mouse_strength * 9.0f;
+    const Biquad *stages[] = {
+        eq_coefficients(EQ_LOW_SHELF, 120.0f, 0.707f, gain_db * 0.5f),
+        eq_coefficients(EQ_HIGH_SHELF, 3000.0f, 0.707f, -gain_db * 0.25f),
+    };
+    apply_eq_brush(center_idx, stages, 2, 120.0f, brush_intensity, view_radius(40));
+}
+
+void draw_line(int start_idx, float start_val, int end_idx, float end_val) {
+    int steps = abs(end_idx - start_idx);
+    if (steps == 0) return;
+    mark_dirty(start_idx < end_idx ? start_idx : end_idx, start_idx < end_idx ? end_idx : start_idx);
+    float dx = (float)(end_idx - start_idx);
+    for (int i = 0; i <= steps; i++) {
+        float t = i / (float)steps;
+        int idx = (int)roundf(start_idx + t * dx);
+        if (idx < 0 || idx >= buffer_samples) continue;
+        float val = start_val + t * (end_val - start_val);
+        waveform_buffer[idx] = val * brush_intensity + waveform_buffer[idx] * (1.0f - brush_intensity);
+    }
+}
+
+void draw_sine_segment(int start_idx, float start_val, int end_idx, float end_val, int additive) {
+    int steps = abs(end_idx - start_idx);
+    if (steps < 10) { draw_line(start_idx, start_val, end_idx, end_val); return; }
+    float offset = (start_val + end_val) / 2.0f;
+    float amplitude = fabsf(start_val - end_val) / 2.0f + 0.05f * AMPLITUDE;
+    int dir = (end_idx > start_idx) ? 1 : -1;
+    int lo = (dir > 0) ? start_idx : end_idx;
+    int first = fmax(0, lo), last = fmin(buffer_samples - 1, lo + steps);
+    if (first > last) return;
+    mark_dirty(first, last);
+
+    // Segment values in buffer order, then one blend pass over the span.
+    int n = last - first + 1;
+    float *sig = get_kernel_scratch(n);
+    for (int k = 0; k < n; k++) {
+        int i = (dir > 0) ? (first + k - lo) : (steps - (first + k - lo));
+        double phase = i / (double)steps * 2.0 * M_PI;
+        sig[k] = offset + (float)sin(phase) * amplitude;
+    }
+    brush_kernel(waveform_buffer + first, NULL, sig, n,
+                 additive ? KERNEL_ADD_SIGNAL_CONST : KERNEL_MIX_SIGNAL, brush_intensity, 0.0f);
+}
+
+int is_brush_tool(int mode) {
+    return mode == DRAW_FREE || mode == DRAW_SMOOTH || mode == DRAW_ADD_FREE || mode == DRAW_ADD_SMOOTH || mode == DRAW_BLEND;
+}
+
+// One swept pass of apply_brush() along a run of points that is monotonic
+// in idx. Each sample takes its weight from the distance to the nearest
+// point of the run and its target from the run's piecewise-linear level,
+// so a stamp-free path gets exactly one application per sample.
+void apply_brush_run(const StrokePoint *pts, int n, int radius, float base_strength, int mode) {
+    if (radius <= 0 || n <= 0) return;
+    int dir = (pts[n - 1].idx >= pts[0].idx) ? 1 : -1;
+    int lo = dir > 0 ? pts[0].idx : pts[n - 1].idx;
+    int hi = dir > 0 ? pts[n - 1].idx : pts[0].idx;
+    int start = fmax(0, lo - radius + 1);
+    int end = fmin(buffer_samples - 1, hi + radius - 1);
+    if (start > end) return;
+    mark_dirty(start, end);
+
+    const float *w = brush_window(radius, base_strength * brush_intensity);
+    float *delta = get_kernel_scratch(end - start + 1);
+    float mix = (mode == 2) ? 0.7f : 1.0f;
+    int seg = 0;        // run index in increasing idx order
+    for (int i = start; i <= end; i++) {
+        int pos = i < lo ? lo : (i > hi ? hi : i);
+        while (seg < n - 2 && pts[dir > 0 ? seg + 1 : n - 2 - seg].idx < pos) seg++;
+        const StrokePoint *a = &pts[dir > 0 ? seg : n - 1 - seg];
+        const StrokePoint *b = (n > 1) ? &pts[dir > 0 ? seg + 1 : n - 2 - seg] : a;
+        float t = (b->idx != a->idx) ? (pos - a->idx) / (float)(b->idx - a->idx) : 1.0f;
+        float target = (a->norm_y + (b->norm_y - a->norm_y) * t) * (float)(AMPLITUDE * 0.8);
+        float weight = w[i - pos];
+        float x = waveform_buffer[i];
+        delta[i - start] = (mode == 1) ? target * weight : (target - x) * weight * mix;
+    }
+    brush_kernel(waveform_buffer + start, NULL, delta, end - start + 1, KERNEL_ADD_SIGNAL_CONST, 1.0f, 0.0f);
+}
+
+// Tools that work on an area around one position. Strokes place these at
+// a fixed spacing along the path.
+void apply_stroke_stamp(int idx, float norm_y) {
+    float mouse_strength = (norm_y > 0.0f) ? norm_y : 0.3f;
+    if (draw_mode == DRAW_SMEAR) { smear_current_idx = idx; apply_smear(idx); }
+    else if (draw_mode >= DRAW_ADD_SINE && draw_mode <= DRAW_ADD_TRIANGLE) {
+        float pitch_norm = (norm_y + 1.0) / 2.0;
+        int radius = view_radius(30);
+        int wave_type = draw_mode - DRAW_ADD_SINE;
+        apply_additive_wave(idx, pitch_norm, radius, wave_type);
+    }
+    else if (draw_mode == DRAW_MULTIPLY || draw_mode == DRAW_AMPLIFY) {
+        float factor = (draw_mode == DRAW_AMPLIFY)
+            ? (norm_y > 0 ? 1.0f + norm_y * 3.0f : 1.0f + norm_y * 0.8f)
+            : (norm_y > 0 ? 1.5f : 0.7f);
+        int radius = view_radius(25);
+        apply_multiply(idx, factor, radius);
+    }
+    else if (draw_mode == DRAW_SOFTEN) {
+        float soften_strength = brush_intensity * (norm_y < 0 ? (1.0f - norm_y) : 0.5f);
+        int radius = view_radius(40);
+        apply_lowpass_soften(idx, soften_strength, radius);
+    }
+    else if (draw_mode == DRAW_ADD_TREBLE) apply_add_treble(idx, mouse_strength);
+    else if (draw_mode == DRAW_ADD_MID) apply_add_mid(idx, mouse_strength);
+    else if (draw_mode == DRAW_SUB_BASS) apply_sub_bass(idx, mouse_strength);
+}
+
+void begin_stroke(void) {
+    stroke_count = 0;
+    stroke_active = 0;
+    stroke_travel = 0.0;
+}
+
+void queue_stroke_point(int idx, float norm_y) {
+    // A full queue keeps its newest slot current; the path stays connected.
+    if (stroke_count == STROKE_MAX_POINTS) stroke_count--;
+    stroke_points[stroke_count++] = (StrokePoint){idx, norm_y};
+}
+
+// Apply the queued points to the selected channel.
+void stroke_channel(void) {
+    if (is_brush_tool(draw_mode)) {
+        int radius = view_radius((draw_mode == DRAW_SMOOTH || draw_mode == DRAW_ADD_SMOOTH || draw_mode == DRAW_BLEND) ? 25 : 15);
+        float bstrength = (draw_mode == DRAW_SMOOTH || draw_mode == DRAW_ADD_SMOOTH || draw_mode == DRAW_BLEND) ? 0.6f : 1.0f;
+        int mode = (draw_mode == DRAW_BLEND) ? 2 : ((draw_mode == DRAW_ADD_FREE || draw_mode == DRAW_ADD_SMOOTH) ? 1 : 0);
+
+        // Prepend the previous frame's last point so the path stays joined,
+        // then cut the polyline into runs that move one way along the buffer.
+        StrokePoint path[STROKE_MAX_POINTS + 1];
+        int n = 0;
+        if (stroke_active) path[n++] = stroke_last;
+        memcpy(path + n, stroke_points, stroke_count * sizeof(StrokePoint));
+        n += stroke_count;
+
+        int run = 0, dir = 0;
+        for (int k = 1; k <= n; k++) {
+            int d = (k < n) ? (path[k].idx > path[k - 1].idx) - (path[k].idx < path[k - 1].idx) : 0;
+            if (k < n && (d == 0 || dir == 0 || d == dir)) {
+                if (d) dir = d;
+                continue;
+            }
+            apply_brush_run(path + run, k - run, radius, bstrength, mode);
+            run = k - 1;
+            dir = d;
+        }
+    } else {
+        int spacing = view_radius(STROKE_SPACING_PX);
+        int k = 0;
+        if (!stroke_active) {
+            apply_stroke_stamp(stroke_points[0].idx, stroke_points[0].norm_y);
+            stroke_last = stroke_points[0];
+            k = 1;
+        }
+        for (; k < stroke_count; k++) {
+            StrokePoint a = stroke_last, b = stroke_points[k];
+            double length = abs(b.idx - a.idx);
+            // Stamps continue the spacing left over from the previous segment.
+            double t = spacing - stroke_travel;
+            for (; t <= length; t += spacing) {
+                double f = t / length;
+                apply_stroke_stamp(a.idx + (int)round((b.idx - a.idx) * f), a.norm_y + (float)((b.norm_y - a.norm_y) * f));
+            }
+            stroke_travel = length - (t - spacing);
+            stroke_last = b;
+        }
+    }
+}
+
+// Apply everything queued since the last frame to each channel being
+// edited, starting each from the same stroke state, and publish once.
+void flush_stroke(void) {
+    if (stroke_count == 0) return;
+
+    StrokePoint last = stroke_last;
+    int active = stroke_active;
+    double travel = stroke_travel;
+    for (int c = edit_first_channel(); c <= edit_last_channel(); c++) {
+        select_channel(c);
+        stroke_last = last;
+        stroke_active = active;
+        stroke_travel = travel;
+        stroke_channel();
+    }
+    select_channel(active_channel);
+
+    stroke_last = stroke_points[stroke_count - 1];
+    stroke_active = 1;
+    stroke_count = 0;
+    publish_waveform();
+}
+
+Uint32 text_hash(const char *text, SDL_Color color) {
+    Uint32 h = 2166136261u;
+    for (const char *p = text; *p; p++) h = (h ^ (Uint8)*p) * 16777619u;
+    h = (h ^ color.r) * 16777619u;
+    h = (h ^ color.g) * 16777619u;
+    h = (h ^ color.b) * 16777619u;
+    return (h ^ color.a) * 16777619u;
+}
+
+void text_cache_clear(void) {
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        if (text_cache[i].texture) SDL_DestroyTexture(text_cache[i].texture);
+        text_cache[i].texture = NULL;
+        text_cache[i].last_used = 0;
+    }
+    if (text_uncached.texture) SDL_DestroyTexture(text_uncached.texture);
+    text_uncached.texture = NULL;
+}
+
+// Release textures nobody has drawn recently. Call once per frame.
+void text_cache_end_frame(void) {
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        CachedText *e = &text_cache[i];
+        if (e->texture && text_cache_frame - e->last_used > TEXT_CACHE_MAX_AGE) {
+            SDL_DestroyTexture(e->texture);
+            e->texture = NULL;
+        }
+    }
+    if (text_uncached.texture) SDL_DestroyTexture(text_uncached.texture);
+    text_uncached.texture = NULL;
+    text_cache_frame++;
+}
+
+SDL_Texture *rasterize_text(SDL_Renderer *renderer, const char *text, SDL_Color color, int *w, int *h) {
+    SDL_Surface *surf = TTF_RenderText_Shaded(font, text, color, (SDL_Color){0,0,0,0});
+    if (!surf) return NULL;
+    SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
+    *w = surf->w;
+    *h = surf->h;
+    SDL_FreeSurface(surf);
+    return tex;
+}
+
+// The texture for text, valid until the next call. A string longer than
+// the cache key replaces text_uncached instead of a cache entry.
+CachedText *get_text(SDL_Renderer *renderer, const char *text, SDL_Color color) {
+    if (!font) return NULL;
+    if (strlen(text) >= TEXT_CACHE_KEY_LEN) {
+        if (text_uncached.texture) SDL_DestroyTexture(text_uncached.texture);
+        text_uncached.texture = rasterize_text(renderer, text, color, &text_uncached.w, &text_uncached.h);
+        return text_uncached.texture ? &text_uncached : NULL;
+    }
+
+    Uint32 h = text_hash(text, color);
+    CachedText *victim = &text_cache[0];
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        CachedText *e = &text_cache[i];
+        if (e->texture && e->hash == h && memcmp(&e->color, &color, sizeof(color)) == 0 && strcmp(e->text, text) == 0) {
+            e->last_used = text_cache_frame;
+            return e;
+        }
+        if (!e->texture) { if (victim->texture) victim = e; }
+        else if (victim->texture && e->last_used < victim->last_used) victim = e;
+    }
+
+    int w, h_px;
+    SDL_Texture *tex = rasterize_text(renderer, text, color, &w, &h_px);
+    if (!tex) return NULL;
+
+    if (victim->texture) SDL_DestroyTexture(victim->texture);
+    victim->hash = h;
+    strcpy(victim->text, text);
+    victim->color = color;
+    victim->texture = tex;
+    victim->w = w;
+    victim->h = h_px;
+    victim->last_used = text_cache_frame;
+    return victim;
+}
+
+void draw_text(SDL_Renderer *renderer, const char *text, SDL_Color color, int x, int y) {
+    CachedText *t = get_text(renderer, text, color);
+    if (!t) return;
+    SDL_Rect dst = {x, y, t->w, t->h};
+    SDL_RenderCopy(renderer, t->texture, NULL, &dst);
+}
+
+void draw_text_centered(SDL_Renderer *renderer, const char *text, SDL_Color color, const SDL_Rect *rect) {
+    CachedText *t = get_text(renderer, text, color);
+    if (!t) return;
+    SDL_Rect dst = {rect->x + (rect->w - t->w)/2, rect->y + (rect->h - t->h)/2, t->w, t->h};
+    SDL_RenderCopy(renderer, t->texture, NULL, &dst);
+}
+
+void render_buttons(SDL_Renderer *renderer, Button *buttons, int count, int active_idx) {
+    for (int i = 0; i < count; i++) {
+        Button *b = &buttons[i];
+        int active = (i == active_idx);
+        SDL_SetRenderDrawColor(renderer, active ? 100 : 60, active ? 220 : 70, active ? 160 : 100, 255);
+        SDL_RenderFillRect(renderer, &b->rect);
+        SDL_SetRenderDrawColor(renderer, 220, 220, 255, 255);
+        SDL_RenderDrawRect(renderer, &b->rect);
+        draw_text_centered(renderer, b->label, (SDL_Color){255,255,255,255}, &b->rect);
+    }
+}
+
+void toggle_fullscreen() {
+    fullscreen = !fullscreen;
+    Uint32 flags = fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0;
+    SDL_SetWindowFullscreen(window, flags);
+    if (!fullscreen) {
+        SDL_SetWindowSize(window, INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT);
+        SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+    }
+    SDL_Delay(100);
+    init_buttons();
+}
+
+// Percent of the buffer period below which `fraction` of callbacks finished,
+// read off the load histogram.
+int load_percentile(double fraction) {
+    int total = 0;
+    for (int b = 0; b <= LOAD_BINS; b++) total += SDL_AtomicGet(&load_histogram[b]);
+    int seen = 0;
+    for (int b = 0; b <= LOAD_BINS; b++) {
+        seen += SDL_AtomicGet(&load_histogram[b]);
+        if (seen >= fraction * total) return (b + 1) * 100 / LOAD_BINS;
+    }
+    return 100;
+}
+
+void format_audio_stats(char lines[3][96]) {
+    int count = SDL_AtomicGet(&callback_count);
+    double period_ms = have.freq > 0 ? have.samples * 1000.0 / have.freq : 0.0;
+    snprintf(lines[0], 96, "Device: %d Hz, %d frames (%.1f ms), %d ch, %s", have.freq, have.samples, period_ms,
+             have.channels, have.format == AUDIO_F32 ? "f32" : "other");
+    snprintf(lines[1], 96, "Callbacks %d, late %d, gaps %d", count, SDL_AtomicGet(&callback_late), SDL_AtomicGet(&callback_gaps));
+    snprintf(lines[2], 96, "Load p50 <%d%%  p99 <%d%%  max %.2f ms", load_percentile(0.5), load_percentile(0.99),
+             SDL_AtomicGet(&callback_max_ns) / 1e6);
+}
+
+void draw_audio_stats(SDL_Renderer *renderer, char lines[3][96]) {
+    SDL_Rect panel = {current_window_width - 380, 14, 360, 128};
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 10, 10, 25, 220);
+    SDL_RenderFillRect(renderer, &panel);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(renderer, 120, 120, 170, 255);
+    SDL_RenderDrawRect(renderer, &panel);
+    for (int i = 0; i < 3; i++) draw_text(renderer, lines[i], (SDL_Color){220,220,255,255}, panel.x + 8, panel.y + 6 + i * 20);
+
+    // Load histogram, log-scaled counts; the last bar is overruns.
+    SDL_Rect bars[LOAD_BINS + 1];
+    int bar_w = (panel.w - 16) / (LOAD_BINS + 1);
+    int base = panel.y + panel.h - 6, max_h = 50;
+    for (int b = 0; b <= LOAD_BINS; b++) {
+        int count = SDL_AtomicGet(&load_histogram[b]);
+        int h = count > 0 ? (int)(log10(count + 1.0) / 5.0 * max_h) : 0;
+        if (h > max_h) h = max_h;
+        bars[b] = (SDL_Rect){panel.x + 8 + b * bar_w, base - h, bar_w - 1, h};
+    }
+    SDL_SetRenderDrawColor(renderer, 120, 200, 255, 255);
+    SDL_RenderFillRects(renderer, bars, LOAD_BINS);
+    SDL_SetRenderDrawColor(renderer, 255, 90, 90, 255);
+    SDL_RenderFillRect(renderer, &bars[LOAD_BINS]);
+}
+
+// Write the retained callback records as CSV. Call with the device closed.
+void write_audio_timeline(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    int count = SDL_AtomicGet(&callback_count);
+    int first = count > TIMELINE_SIZE ? count - TIMELINE_SIZE : 0;
+    fprintf(f, "callback,start_us,cost_ns,interval_us,period_us,load\n");
+    for (int n = first; n < count; n++) {
+        const CallbackRecord *r = &timeline[n & (TIMELINE_SIZE - 1)];
+        fprintf(f, "%d,%u,%u,%u,%u,%.4f\n", n, r->start_us, r->cost_ns, r->interval_us, r->period_us,
+                r->period_us ? r->cost_ns / (r->period_us * 1000.0) : 0.0);
+    }
+    fclose(f);
+}
+
+// Snapshot slots and peak pyramid already filled from a buffer that is about
+// to become the session. load_session() builds them before it takes the
+// audio lock, so only the pointer swap in start_session() happens under it.
+typedef struct {
+    WaveSnapshot snapshots[SNAPSHOT_SLOTS];
+    float *morph_storage;
+    float *peak_min[PEAK_MAX_LEVELS];
+    float *peak_max[PEAK_MAX_LEVELS];
+    int peak_len[PEAK_MAX_LEVELS];
+    int peak_levels;
+} SessionTables;
+
+int build_session_tables(SessionTables *t, const float *data, int samples, int channels, int frames) {
+    int total = samples * channels * frames;
+    if (alloc_snapshot_slots(t->snapshots, &t->morph_storage, data, samples, channels, frames) < 0) return -1;
+    t->peak_levels = alloc_peak_levels(t->peak_min, t->peak_max, t->peak_len, total);
+    if (t->peak_levels < 0) {
+        free_snapshot_slots(t->snapshots, &t->morph_storage);
+        return -1;
+    }
+    build_peak_levels(t->peak_min, t->peak_max, t->peak_len, t->peak_levels, data, total, 0, total - 1);
+    return 0;
+}
+
+// Move the live snapshots and peaks into t, leaving none behind.
+void take_session_tables(SessionTables *t) {
+    memcpy(t->snapshots, snapshots, sizeof(snapshots));
+    memset(snapshots, 0, sizeof(snapshots));
+    t->morph_storage = morph_storage;
+    morph_storage = NULL;
+    memcpy(t->peak_min, peak_min, sizeof(peak_min));
+    memcpy(t->peak_max, peak_max, sizeof(peak_max));
+    memcpy(t->peak_len, peak_len, sizeof(peak_len));
+    t->peak_levels = peak_levels;
+    peak_levels = 0;
+}
+
+void free_session_tables(SessionTables *t) {
+    free_snapshot_slots(t->snapshots, &t->morph_storage);
+    for (int k = 0; k < t->peak_levels; k++) {
+        free(t->peak_min[k]);
+        free(t->peak_max[k]);
+    }
+    t->peak_levels = 0;
+}
+
+// Set up everything that hangs off a planar buffer of `channels` planes of
+// `samples` floats. The buffer is owned by the session from here on, and so
+// are the tables, if given; without them the snapshots and peaks start
+// empty and fill on the next publish and draw.
+void start_session(float *buffer, int samples, int channels, int frames, SessionTables *tables) {
+    select_kernels();
+    init_sinc_table();
+    buffer_samples = samples;
+    channel_count = channels;
+    frame_count = frames;
+    channel_data = buffer;
+    if (active_channel >= channels) active_channel = 0;
+    if (active_frame >= frames) active_frame = 0;
+    select_channel(active_channel);
+    morph_position = fmaxf(0.0f, fminf(get_morph(), 1.0f)) * (frames - 1);
+    // Ranges left over from the previous buffer mean nothing in this one.
+    dirty_start = dirty_end = -1;
+    layer_dirty_start = layer_dirty_end = -1;
+    layer_full_redraw = 1;
+    reset_view();
+    if (tables) {
+        memcpy(snapshots, tables->snapshots, sizeof(snapshots));
+        morph_storage = tables->morph_storage;
+        use_snapshot_slots();
+        memcpy(peak_min, tables->peak_min, sizeof(peak_min));
+        memcpy(peak_max, tables->peak_max, sizeof(peak_max));
+        memcpy(peak_len, tables->peak_len, sizeof(peak_len));
+        peak_levels = tables->peak_levels;
+        peaks_dirty_start = peaks_dirty_end = -1;
+    } else {
+        init_snapshots();
+        init_peaks();
+    }
+    phase_increment = 1.0;
+
+    init_history();
+}
+
+void init_session_length(int samples) {
+    start_session(calloc((size_t)samples * channel_count, sizeof(float)), samples, channel_count, 1, NULL);
+    generate_classic_waveform();
+}
+
+void init_session(void) {
+    init_session_length((int)lround(sample_rate * session_seconds));
+}
+
+// Make c the channel edits go to (and the analyzer and harmonic editor
+// read from).
+void set_active_channel(int c) {
+    if (c < 0 || c >= channel_count || c == active_channel) return;
+    save_undo_state();
+    active_channel = c;
+    select_channel(c);
+    spectrum_dirty = 1;
+    layer_full_redraw = 1;
+}
+
+// Show and edit frame f of a wavetable. The morph follows, so what plays
+// is the frame being edited.
+void set_active_frame(int f) {
+    if (f < 0 || f >= frame_count || f == active_frame) return;
+    save_undo_state();
+    active_frame = f;
+    select_channel(active_channel);
+    set_morph(f / (float)(frame_count - 1));
+    spectrum_dirty = 1;
+    layer_full_redraw = 1;
+}
+
+// Everything of the session but the snapshots. The audio thread reads none
+// of it, so this needs no audio lock.
+void free_editor_state(void) {
+    free_history();
+    if (session_map) {
+        munmap(session_map, session_map_bytes);
+        session_map = NULL;
+    } else {
+        free(channel_data);
+    }
+    channel_data = waveform_buffer = NULL;
+    free_peaks();
+    free_kernels();
+    if (harmonic_plan.n) fft_free(&harmonic_plan);
+}
+
+void free_session(void) {
+    free_editor_state();
+    free_snapshots();
+}
+
+Uint32 fnv1a(Uint32 hash, const void *data, size_t len) {
+    const Uint8 *p = data;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+Uint32 session_checksum(const SessionHeader *h, const SessionEdit *edits) {
+    SessionHeader copy = *h;
+    copy.checksum = 0;
+    Uint32 hash = fnv1a(2166136261u, &copy, sizeof(copy));
+    return fnv1a(hash, edits, h->history_count * sizeof(SessionEdit));
+}
+
+int write_padding(FILE *f, Uint64 from, Uint64 to) {
+    static const char zeros[64];
+    while (from < to) {
+        size_t n = to - from < sizeof(zeros) ? (size_t)(to - from) : sizeof(zeros);
+        if (fwrite(zeros, 1, n, f) != n) return -1;
+        from += n;
+    }
+    return 0;
+}
+
+// Write the session to a temporary file, flush it to disk, then rename it
+// over `path`, so a crash mid-save leaves the previous file intact. Edits
+// not yet committed go in as one more undo step in the file only, so a
+// save (the autosave included) never changes the history in memory.
+int save_session(const char *path) {
+    HistoryEdit pending = {0};
+    size_t pending_bytes;
+    int pending_runs = touched_runs(&pending_bytes);
+    int history_written = pending_runs ? history_pos + 1 : history_count;
+    const HistoryEdit **written = malloc((history_written ? history_written : 1) * sizeof(HistoryEdit *));
+    if (pending_runs) {
+        pending.spans = malloc(pending_bytes);
+        pending.span_count = pending_runs;
+        pending.bytes = pending_bytes;
+    }
+    if (!written || (pending_runs && !pending.spans)) {
+        fprintf(stderr, "Out of memory saving %s\n", path);
+        free(written);
+        free(pending.spans);
+        return -1;
+    }
+    if (pending_runs) fill_touched_spans(pending.spans, pending_runs);
+    for (int i = 0; i < history_written; i++) written[i] = i < history_pos || !pending_runs ? &history_edits[i] : &pending;
+
+    SessionHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SESSION_MAGIC, 8);
+    h.version = SESSION_VERSION;
+    h.header_bytes = sizeof(SessionHeader);
+    h.sample_rate = sample_rate;
+    h.samples = buffer_samples;
+    h.history_count = history_written;
+    h.history_pos = pending_runs ? history_written : history_pos;
+    h.frequency = current_freq;
+    h.phase_increment = phase_increment;
+    h.brush_intensity = brush_intensity;
+    h.smear_width = smear_width;
+    h.draw_mode = draw_mode;
+    h.wave_type = current_type;
+    h.channels = channel_count;
+    h.frames = frame_count;
+
+    Uint64 table_end = sizeof(SessionHeader) + (Uint64)history_written * sizeof(SessionEdit);
+    h.samples_offset = (table_end + SESSION_ALIGN - 1) & ~(Uint64)(SESSION_ALIGN - 1);
+    h.history_offset = (h.samples_offset + (Uint64)total_samples() * sizeof(float) + 7) & ~(Uint64)7;
+
+    SessionEdit *edits = calloc(history_written ? history_written : 1, sizeof(SessionEdit));
+    Uint64 at = h.history_offset;
+    for (int i = 0; i < history_written; i++) {
+        edits[i].offset = at;
+        edits[i].bytes = written[i]->bytes;
+        edits[i].span_count = written[i]->span_count;
+        at += (written[i]->bytes + 7) & ~(Uint64)7;
+    }
+    h.file_bytes = at;
+    h.checksum = session_checksum(&h, edits);
+
+    char temp[1024];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *f = fopen(temp, "wb");
+    if (!f) {
+        fprintf(stderr, "Could not write %s: %s\n", temp, strerror(errno));
+        free(edits);
+        free(written);
+        free(pending.spans);
+        return -1;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+          && fwrite(edits, sizeof(SessionEdit), history_written, f) == (size_t)history_written
+          && write_padding(f, table_end, h.samples_offset) == 0
+          && fwrite(channel_data, sizeof(float), total_samples(), f) == (size_t)total_samples()
+          && write_padding(f, h.samples_offset + (Uint64)total_samples() * sizeof(float), h.history_offset) == 0;
+    for (int i = 0; ok && i < history_written; i++) {
+        ok = fwrite(written[i]->spans, 1, written[i]->bytes, f) == written[i]->bytes
+          && write_padding(f, edits[i].offset + edits[i].bytes, (edits[i].offset + edits[i].bytes + 7) & ~(Uint64)7) == 0;
+    }
+    free(edits);
+    free(written);
+    free(pending.spans);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) ok = 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(temp, path) != 0) {
+        fprintf(stderr, "Could not save session %s: %s\n", path, strerror(errno));
+        remove(temp);
+        return -1;
+    }
+    saved_generation = waveform_generation;
+    return 0;
+}
+
+// Check that every span of a mapped edit lies inside its blob and the buffer.
+int session_edit_valid(const Uint8 *base, const SessionEdit *e, Uint64 file_bytes, int samples) {
+    if (e->offset % 8 || e->offset > file_bytes || e->bytes > file_bytes - e->offset) return 0;
+    const Uint8 *p = base + e->offset, *end = p + e->bytes;
+    for (Uint32 k = 0; k < e->span_count; k++) {
+        if (end - p < (ptrdiff_t)sizeof(HistorySpan)) return 0;
+        const HistorySpan *span = (const HistorySpan *)p;
+        if (span->offset < 0 || span->length <= 0 || span->length > samples - span->offset) return 0;
+        if ((Uint64)(end - p - sizeof(HistorySpan)) < 2 * (Uint64)span->length * sizeof(float)) return 0;
+        p = (const Uint8 *)next_span((HistorySpan *)span);
+    }
+    return 1;
+}
+
+// Map a session file and adopt its buffer and history in place. Only the
+// header and edit table are read up front; the current session is left
+// untouched if anything fails to validate. The undo shadow is a second
+// private mapping of the same samples, so it costs nothing until edits
+// write to it. Filling the playback snapshot and the peak pyramid still
+// reads every sample once.
+int load_session(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED, *shadow = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (Uint64)st.st_size >= sizeof(SessionHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        shadow = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED || shadow == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        if (shadow != MAP_FAILED) munmap(shadow, st.st_size);
+        return -1;
+    }
+
+    const SessionHeader *h = map;
+    const SessionEdit *edits = (const SessionEdit *)(h + 1);
+    Uint64 size = st.st_size;
+    int channels = h->channels ? (int)h->channels : 1;
+    int frames = h->frames ? (int)h->frames : 1;
+    Uint64 total = (Uint64)h->samples * channels * frames;
+    int ok = memcmp(h->magic, SESSION_MAGIC, 8) == 0 && h->version == SESSION_VERSION
+          && h->header_bytes == sizeof(SessionHeader) && h->file_bytes <= size
+          && h->samples > 0 && channels <= MAX_CHANNELS && frames <= MAX_FRAMES && total < (1u << 30) && valid_sample_rate(h->sample_rate)
+          && h->history_pos <= h->history_count
+          && sizeof(SessionHeader) + (Uint64)h->history_count * sizeof(SessionEdit) <= h->samples_offset
+          && h->samples_offset % SESSION_ALIGN == 0
+          && h->samples_offset + total * sizeof(float) <= h->history_offset
+          && h->history_offset <= h->file_bytes
+          && session_checksum(h, edits) == h->checksum;
+    for (Uint32 i = 0; ok && i < h->history_count; i++)
+        ok = edits[i].offset >= h->history_offset && session_edit_valid(map, &edits[i], h->file_bytes, (int)total);
+    if (!ok) {
+        fprintf(stderr, "%s is not a valid session file\n", path);
+        munmap(map, st.st_size);
+        munmap(shadow, st.st_size);
+        return -1;
+    }
+
+    // Everything that reads the whole mapping, frees the old session or can
+    // fail happens outside the audio lock; under it only the snapshots the
+    // audio thread reads are swapped.
+    float *data = (float *)((Uint8 *)map + h->samples_offset);
+    SessionTables tables;
+    HistoryChunk *chunk = NULL;
+    HistoryEdit *loaded = NULL;
+    if (h->history_count > 0) {
+        chunk = calloc(1, sizeof(HistoryChunk));
+        loaded = malloc(h->history_count * sizeof(HistoryEdit));
+    }
+    if ((h->history_count > 0 && (!chunk || !loaded))
+        || build_session_tables(&tables, data, h->samples, channels, frames) < 0) {
+        fprintf(stderr, "Out of memory loading %s\n", path);
+        free(chunk);
+        free(loaded);
+        munmap(map, st.st_size);
+        munmap(shadow, st.st_size);
+        return -1;
+    }
+    // The edits point straight into the mapping; their chunk is a bare
+    // descriptor that history_release() frees once the last edit goes.
+    for (Uint32 i = 0; i < h->history_count; i++) {
+        loaded[i].chunk = chunk;
+        loaded[i].spans = (HistorySpan *)((Uint8 *)map + edits[i].offset);
+        loaded[i].span_count = edits[i].span_count;
+        loaded[i].bytes = edits[i].bytes;
+    }
+    if (chunk) chunk->live = h->history_count;
+
+    int old_rate = sample_rate, old_channels = channel_count;
+    SessionTables old;
+    free_editor_state();
+    if (audio_device) SDL_LockAudioDevice(audio_device);
+    take_session_tables(&old);
+    session_map = map;
+    session_map_bytes = st.st_size;
+    sample_rate = h->sample_rate;
+    start_session(data, h->samples, channels, frames, &tables);
+    phase_increment = h->phase_increment;
+    current_freq = h->frequency;
+    current_type = (h->wave_type >= SINE && h->wave_type <= CUSTOM) ? (WaveType)h->wave_type : CUSTOM;
+    draw_mode = (h->draw_mode >= DRAW_FREE && h->draw_mode <= DRAW_SUB_BASS) ? (DrawMode)h->draw_mode : DRAW_FREE;
+    brush_intensity = fmax(0.0f, fmin(1.0f, h->brush_intensity));
+    smear_width = fmax(0.0f, fmin(1.0f, h->smear_width));
+
+    if (loaded) {
+        history_cap = h->history_count;
+        history_edits = loaded;
+        for (Uint32 i = 0; i < h->history_count; i++) history_bytes += loaded[i].bytes;
+        history_count = h->history_count;
+        history_pos = h->history_pos;
+    }
+    free(history_shadow);
+    shadow_map = shadow;
+    shadow_map_bytes = st.st_size;
+    history_shadow = (float *)((Uint8 *)shadow + h->samples_offset);
+    SDL_AtomicSet(&playhead_reset, 1);
+    if (audio_device) SDL_UnlockAudioDevice(audio_device);
+    free_session_tables(&old);
+    // The tables already hold the samples, so there is nothing to publish.
+    spectrum_dirty = 1;
+    waveform_generation++;
+    if (audio_device && (sample_rate != old_rate || channel_count != old_channels)) reopen_audio_device();
+
+    saved_generation = waveform_generation;
+    return 0;
+}
+
+void apply_spans(float *dst, const HistoryEdit *e, int use_after) {
+    HistorySpan *span = e->spans;
+    for (int i = 0; i < e->span_count; i++) {
+        memcpy(dst + span->offset, (float *)(span + 1) + (use_after ? span->length : 0), span->length * sizeof(float));
+        span = next_span(span);
+    }
+}
+
+int compare_ranges(const void *a, const void *b) {
+    const int *x = a, *y = b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+// Append [first, last] to a growable array of ranges.
+int push_range(int **ranges, int *count, int *cap, int first, int last) {
+    if (2 * (*count + 1) > *cap) {
+        int grown_cap = *cap ? *cap * 2 : 16;
+        int *grown = realloc(*ranges, grown_cap * sizeof(int));
+        if (!grown) return -1;
+        *ranges = grown;
+        *cap = grown_cap;
+    }
+    (*ranges)[2 * *count] = first;
+    (*ranges)[2 * *count + 1] = last;
+    (*count)++;
+    return 0;
+}
+
+// The old channel a converted channel is built from: itself if it existed,
+// else channel 0.
+int source_channel(int c, int from_channels) {
+    return c < from_channels ? c : 0;
+}
+
+// The old plane a converted plane is built from. Frames keep their place;
+// only the channels within each frame change.
+int source_plane(int p, int channels, int from_channels) {
+    return p / channels * from_channels + source_channel(p % channels, from_channels);
+}
+
+// Convert one edit given the full (planar) states on either side of it.
+// Each span is cut at channel boundaries, grows by the filter reach, wraps
+// around the loop and repeats with it, and lands on every new plane built
+// from its plane, so undoing the result lands exactly on the converted
+// neighbouring state. The spans live in a malloc'd blob until the new
+// history takes them.
+int convert_edit(const Resampler *rs, const HistoryEdit *e, const float *before, const float *after,
+                 int from_channels, int samples, int channels, HistoryEdit *out) {
+    int count = 0, cap = 0;
+    int *ranges = NULL;
+    double scale = rs->up / (double)rs->down;
+    int half = rs->taps / 2, m = rs->out_len, in_len = rs->in_len;
+    HistorySpan *span = e->spans;
+    for (int i = 0; i < e->span_count; i++, span = next_span(span)) {
+        int end = span->offset + span->length;
+        for (int at = span->offset; at < end; ) {
+            int src = at / in_len, base = src * in_len;
+            int first = at - base;
+            int last = (end < base + in_len ? end : base + in_len) - 1 - base;
+            at = base + in_len;
+
+            int lo = (int)floor((first - half) * scale);
+            int len = (int)ceil((last + half) * scale) - lo + 1;
+            int pieces[4], n = 0;
+            if (len >= m) {
+                pieces[n++] = 0; pieces[n++] = m - 1;
+            } else {
+                lo = ((lo % m) + m) % m;
+                int hi = lo + len - 1;
+                pieces[n++] = lo; pieces[n++] = hi < m ? hi : m - 1;
+                if (hi >= m) { pieces[n++] = 0; pieces[n++] = hi - m; }
+            }
+            for (int c = 0; c < channels * frame_count; c++) {
+                if (source_plane(c, channels, from_channels) != src) continue;
+                int to = c * samples;
+                for (int p = 0; p < n; p += 2) {
+                    for (int t = 0; pieces[p] + t * m < samples; t++) {
+                        int hi = pieces[p + 1] + t * m < samples ? pieces[p + 1] + t * m : samples - 1;
+                        if (push_range(&ranges, &count, &cap, to + pieces[p] + t * m, to + hi) != 0) {
+                            free(ranges);
+                            return -1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    qsort(ranges, count, 2 * sizeof(int), compare_ranges);
+    int merged = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        // Ranges only merge within a channel, so every span stays in one.
+        if (merged > 0 && ranges[2 * i] <= ranges[2 * merged - 1] + 1
+            && ranges[2 * i] / samples == ranges[2 * merged - 1] / samples) {
+            if (ranges[2 * i + 1] > ranges[2 * merged - 1]) ranges[2 * merged - 1] = ranges[2 * i + 1];
+            continue;
+        }
+        ranges[2 * merged] = ranges[2 * i];
+        ranges[2 * merged + 1] = ranges[2 * i + 1];
+        merged++;
+    }
+    for (int i = 0; i < merged; i++)
+        bytes += sizeof(HistorySpan) + 2 * (size_t)(ranges[2 * i + 1] - ranges[2 * i] + 1) * sizeof(float);
+
+    out->chunk = NULL;
+    out->spans = malloc(bytes ? bytes : 1);
+    out->span_count = merged;
+    out->bytes = bytes;
+    if (!out->spans) { free(ranges); return -1; }
+    span = out->spans;
+    for (int i = 0; i < merged; i++) {
+        span->offset = ranges[2 * i];
+        span->length = ranges[2 * i + 1] - ranges[2 * i] + 1;
+        int c = span->offset / samples, base = c * samples;
+        size_t src = (size_t)source_plane(c, channels, from_channels) * in_len;
+        float *values = (float *)(span + 1);
+        resample_loop(rs, before + src, values, ranges[2 * i] - base, ranges[2 * i + 1] - base);
+        resample_loop(rs, after + src, values + span->length, ranges[2 * i] - base, ranges[2 * i + 1] - base);
+        span = next_span(span);
+    }
+    free(ranges);
+    return 0;
+}
+
+// Change the session's rate, length and channel count in place. The buffer
+// and every undo/redo state are resampled, not regenerated; a longer buffer
+// repeats the loop and a shorter one cuts it, and added channels start as
+// copies of channel 0.
+int set_session_format(int rate, int samples, int channels) {
+    if (!valid_sample_rate(rate) || channels < 1 || channels > MAX_CHANNELS
+        || samples < 1 || (Sint64)samples * channels * frame_count >= (1 << 30)) return -1;
+    if (rate == sample_rate && samples == buffer_samples && channels == channel_count) return 0;
+    save_undo_state();
+
+    Resampler rs;
+    if (init_resampler(&rs, sample_rate, rate, buffer_samples) != 0) return -1;
+    size_t old_total = (size_t)total_samples();
+    float *buffer = malloc((size_t)samples * channels * frame_count * sizeof(float));
+    float *before = malloc(old_total * sizeof(float));
+    float *after = malloc(old_total * sizeof(float));
+    HistoryEdit *converted = calloc(history_count ? history_count : 1, sizeof(HistoryEdit));
+    int ok = buffer && before && after && converted;
+
+    if (ok) {
+        int m = rs.out_len < samples ? rs.out_len : samples;
+        for (int c = 0; c < channels * frame_count; c++) {
+            float *plane = buffer + (size_t)c * samples;
+            resample_loop(&rs, channel_data + (size_t)source_plane(c, channels, channel_count) * buffer_samples, plane, 0, m - 1);
+            for (int i = m; i < samples; i += m)
+                memcpy(plane + i, plane, (samples - i < m ? samples - i : m) * sizeof(float));
+        }
+
+        // Walk out from the current state in both directions, keeping the
+        // states on either side of each edit in `before` and `after`.
+        memcpy(before, channel_data, old_total * sizeof(float));
+        memcpy(after, channel_data, old_total * sizeof(float));
+        for (int i = history_pos - 1; ok && i >= 0; i--) {
+            apply_spans(before, &history_edits[i], 0);
+            ok = convert_edit(&rs, &history_edits[i], before, after, channel_count, samples, channels, &converted[i]) == 0;
+            apply_spans(after, &history_edits[i], 0);
+        }
+        memcpy(before, channel_data, old_total * sizeof(float));
+        memcpy(after, channel_data, old_total * sizeof(float));
+        for (int i = history_pos; ok && i < history_count; i++) {
+            apply_spans(after, &history_edits[i], 1);
+            ok = convert_edit(&rs, &history_edits[i], before, after, channel_count, samples, channels, &converted[i]) == 0;
+            apply_spans(before, &history_edits[i], 1);
+        }
+    }
+    free(before);
+    free(after);
+    free_resampler(&rs);
+    if (!ok) {
+        fprintf(stderr, "Out of memory converting to %d Hz\n", rate);
+        for (int i = 0; converted && i < history_count; i++) free(converted[i].spans);
+        free(converted);
+        free(buffer);
+        return -1;
+    }
 
-    FILE *f = fopen(filename, "wb");
-    if (!f) {
-        fprintf(stderr, "Could not open %s for writing\n", filename);
-        return;
+    // A higher rate can push the history over budget; the oldest undo
+    // steps go first, the redo branch is kept.
+    int count = history_count, pos = history_pos, evict = 0;
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += converted[i].bytes;
+    while (evict < pos && total > HISTORY_BUDGET_BYTES) {
+        total -= converted[evict].bytes;
+        free(converted[evict++].spans);
     }
 
-    uint32_t num_samples = buffer_samples;
-    uint32_t byte_rate = SAMPLE_RATE * 4;
-    uint32_t data_size = num_samples * 4;
-
-    fwrite("RIFF", 1, 4, f);
-    uint32_t chunk_size = 36 + data_size;
-    fwrite(&chunk_size, 4, 1, f);
-    fwrite("WAVE", 1, 4, f);
-    fwrite("fmt ", 1, 4, f);
-    uint32_t fmt_size = 16;
-    fwrite(&fmt_size, 4, 1, f);
-    uint16_t audio_format = 3;
-    uint16_t num_channels = 1;
-    uint16_t bits_per_sample = 32;
-    uint16_t block_align = 4;
-    fwrite(&audio_format, 2, 1, f);
-    fwrite(&num_channels, 2, 1, f);
-    fwrite(&sample_rate, 4, 1, f);
-    fwrite(&byte_rate, 4, 1, f);
-    fwrite(&block_align, 2, 1, f);
-    fwrite(&bits_per_sample, 2, 1, f);
-    fwrite("data", 1, 4, f);
-    fwrite(&data_size, 4, 1, f);
-    fwrite(waveform_buffer, 4, num_samples, f);
+    int old_rate = sample_rate, old_channels = channel_count;
+    if (audio_device) SDL_LockAudioDevice(audio_device);
+    free_session();
+    sample_rate = rate;
+    start_session(buffer, samples, channels, frame_count, NULL);
+    memcpy(history_shadow, channel_data, (size_t)total_samples() * sizeof(float));
+    history_cap = count - evict > 0 ? count - evict : 1;
+    history_edits = malloc(history_cap * sizeof(HistoryEdit));
+    ok = history_edits != NULL;
+    for (int i = evict; i < count; i++) {
+        HistoryEdit e = converted[i];
+        if (ok && (e.spans = history_alloc(e.bytes, &e.chunk)) != NULL) {
+            memcpy(e.spans, converted[i].spans, e.bytes);
+            history_edits[history_count++] = e;
+            history_bytes += e.bytes;
+        } else {
+            ok = 0;
+        }
+        free(converted[i].spans);
+    }
+    free(converted);
+    history_pos = pos - evict;
+    if (!ok) {
+        fprintf(stderr, "Out of memory converting undo history\n");
+        history_pos = history_count;
+        history_reset();
+    }
+    invalidate_range(0, total_samples() - 1);
+    publish_waveform();
+    SDL_AtomicSet(&playhead_reset, 1);
+    spectrum_dirty = 1;
+    if (audio_device) SDL_UnlockAudioDevice(audio_device);
+    if (audio_device && (sample_rate != old_rate || channel_count != old_channels)) reopen_audio_device();
+    return 0;
+}
 
-    fclose(f);
-    snprintf(export_button.label, 32, "Saved %03d.wav", export_count);
+// Read n samples from a loop of `length` samples starting at 0, `step`
+// samples apart, with Hermite interpolation around the wrap.
+void read_loop(const float *src, int length, double step, float *out, int n) {
+    for (int i = 0; i < n; i++) {
+        double pos = i * step;
+        int k = (int)pos;
+        float t = (float)(pos - k), x[4];
+        for (int j = 0; j < 4; j++) x[j] = src[(k + j - 1 + length) % length];
+        float c1 = 0.5f * (x[2] - x[0]);
+        float c2 = x[0] - 2.5f * x[1] + 2.0f * x[2] - 0.5f * x[3];
+        float c3 = 0.5f * (x[3] - x[0]) + 1.5f * (x[1] - x[2]);
+        out[i] = ((c3 * t + c2) * t + c1) * t + x[1];
+    }
 }
 
-void save_undo_state(void) {
-    if (current_type != CUSTOM) return;
+// Switch between a plain loop and a wavetable of `frames` single-cycle
+// frames of `length` samples. Entering makes every frame one cycle of the
+// current loop (or of the nearest old frame when already a wavetable);
+// leaving builds a loop of about session_seconds from whole cycles of the
+// frame being edited, near DEFAULT_FREQ. Cycles change length through the
+// polyphase resampler, so shrinking one filters what would alias. The undo
+// history starts over, since its spans mean nothing in the new shape.
+int set_frame_count(int frames, int length) {
+    if (frames < 1 || frames > MAX_FRAMES) return -1;
+    // Cycles in each old plane and each new one, and a new cycle's length.
+    int source_cycles = 1, cycles = 1, cycle_len = length;
+    if (frames == 1) {
+        if (frame_count == 1) return 0;
+        cycle_len = (int)lround(sample_rate / DEFAULT_FREQ);
+        cycles = (int)fmax(1.0, round(sample_rate * session_seconds / cycle_len));
+        length = cycle_len * cycles;
+    } else if (frame_count == 1) {
+        source_cycles = (int)fmax(1.0, round(current_freq * buffer_samples / sample_rate));
+    }
+    if (cycle_len < 4 || (Sint64)length * channel_count * frames >= (1 << 30)) return -1;
+    if (frames == frame_count && length == buffer_samples) return 0;
 
-    int next = (undo_index + 1) % UNDO_LEVELS;
-    if (undo_stack[next] == NULL) {
-        undo_stack[next] = malloc(buffer_samples * sizeof(float));
+    // A source cycle that is not a whole number of samples is read at the
+    // next whole length above it first. That only oversamples, so the
+    // Hermite read adds no aliasing of its own.
+    int read_len = (int)ceil(buffer_samples / (double)source_cycles);
+    Resampler rs;
+    if (init_resampler(&rs, read_len, cycle_len, read_len) != 0) return -1;
+    float *buffer = malloc((size_t)length * channel_count * frames * sizeof(float));
+    float *cycle = malloc((size_t)read_len * sizeof(float));
+    if (!buffer || !cycle) {
+        fprintf(stderr, "Out of memory building a %d frame wavetable\n", frames);
+        free(buffer);
+        free(cycle);
+        free_resampler(&rs);
+        return -1;
+    }
+    for (int f = 0; f < frames; f++) {
+        int from = frames == 1 ? active_frame
+                 : frame_count == 1 ? 0
+                 : (int)lround(f * (frame_count - 1) / (double)(frames - 1));
+        for (int c = 0; c < channel_count; c++) {
+            const float *src = frame_plane(from, c);
+            float *dst = buffer + ((size_t)f * channel_count + c) * length;
+            if (source_cycles > 1) {
+                read_loop(src, buffer_samples, buffer_samples / (double)source_cycles / read_len, cycle, read_len);
+                src = cycle;
+            }
+            resample_loop(&rs, src, dst, 0, cycle_len - 1);
+            for (int k = 1; k < cycles; k++) memcpy(dst + (size_t)k * cycle_len, dst, cycle_len * sizeof(float));
+        }
     }
-    memcpy(undo_stack[next], waveform_buffer, buffer_samples * sizeof(float));
-    undo_index = next;
-    if (undo_count < UNDO_LEVELS) undo_count++;
+    free(cycle);
+    free_resampler(&rs);
+
+    if (audio_device) SDL_LockAudioDevice(audio_device);
+    free_session();
+    set_morph(0.0f);
+    active_frame = 0;
+    start_session(buffer, length, channel_count, frames, NULL);
+    memcpy(history_shadow, channel_data, (size_t)total_samples() * sizeof(float));
+    current_type = CUSTOM;
+    current_freq = (double)sample_rate / cycle_len;
+    invalidate_range(0, total_samples() - 1);
+    publish_waveform();
+    SDL_AtomicSet(&playhead_reset, 1);
+    spectrum_dirty = 1;
+    if (audio_device) SDL_UnlockAudioDevice(audio_device);
+    return 0;
 }
 
-void undo(void) {
-    if (undo_count <= 0) return;
-    int prev = (undo_index - 1 + UNDO_LEVELS) % UNDO_LEVELS;
-    memcpy(waveform_buffer, undo_stack[prev], buffer_samples * sizeof(float));
-    undo_index = prev;
-    undo_count--;
+// Headless batch rendering. Each script line is one command; positions are
+// fractions of the buffer (0..1) and levels are fractions of AMPLITUDE
+// (-1..1), matching what the mouse would produce in the editor:
+//
+//   wave <sine|square|saw|triangle> <freq>   start a job from a classic wave;
+//                          in a wavetable, one cycle into the current frame
+//                          whatever freq says
+//   clear                                    start a job from silence
+//   channels <n>           resize to n channels (new ones copy channel 1)
+//   channel <n|all>        edit commands below go to channel n (from 1) or to all
+//   wavetable <frames> [length]   make a wavetable of single-cycle frames
+//                          (default 2048 samples); 1 goes back to a loop
+//   frame <n>              edit commands below go to frame n (from 1)
+//   morph <0..1>           the position playback and export read from
+//   intensity <0..1>       smear_width <0..1>
+//   view <from> <to>       zoom to that part of the buffer; treble, mid and
+//                          bass take their reach from the view
+//   brush <pos> <level> <radius> [strength] [blend|add|smooth]
+//   multiply <pos> <factor> <radius>
+//   additive <pos> <pitch 0..1> <radius> <sine|square|saw|triangle>
+//   soften <pos> <strength> [radius]
+//   save|load <file>       write or map a session file (waveform, history, settings)
+//   analyze                load the harmonic table from the current cycle
+//   harmonic <n> <amp 0..1> [phase]   set one harmonic and resynthesize
+//   treble|mid|bass <pos> <strength 0..1>
+//   line|sine_seg <pos0> <level0> <pos1> <level1>
+//   smear <from> <to>
+//   interp <linear|hermite|sinc>
+//   export <file.wav> [seconds] [freq] [float|pcm16|pcm24]
+//
+// export renders through the playback engine; freq replays the buffer so its
+// base frequency lands on the given pitch. A wavetable exports its frames
+// back to back instead, and seconds and freq are ignored.
+int parse_wave_type(const char *name) {
+    if (strcmp(name, "sine") == 0) return SINE;
+    if (strcmp(name, "square") == 0) return SQUARE;
+    if (strcmp(name, "saw") == 0 || strcmp(name, "sawtooth") == 0) return SAWTOOTH;
+    if (strcmp(name, "triangle") == 0 || strcmp(name, "tri") == 0) return TRIANGLE;
+    return -1;
 }
 
-void redo(void) {
-    if (undo_count >= UNDO_LEVELS) return;
-    int next = (undo_index + 1) % UNDO_LEVELS;
-    if (undo_stack[next] == NULL) return;
-    memcpy(waveform_buffer, undo_stack[next], buffer_samples * sizeof(float));
-    undo_index = next;
-    undo_count++;
+int parse_interp(const char *name) {
+    for (int i = 0; i < INTERP_MODES; i++)
+        if (strcmp(name, interp_names[i]) == 0) return i;
+    return -1;
 }
 
-void apply_smear(int curr_idx) {
-    if (smear_start_idx == -1) return;
-    int direction = (curr_idx > smear_start_idx) ? 1 : -1;
-    int current_distance = abs(curr_idx - smear_start_idx);
-    if (current_distance < 30) return;
-    if (current_distance > smear_max_distance) smear_max_distance = current_distance;
+int parse_export_format(const char *name) {
+    for (int i = 0; i < EXPORT_FORMATS; i++)
+        if (strcmp(name, export_format_names[i]) == 0) return i;
+    return -1;
+}
 
-    float max_fade = buffer_samples * 0.35f;
-    float fade_factor = 1.0f - fmin(1.0f, smear_max_distance / max_fade);
-    float intensity = brush_intensity * fade_factor * 1.2f;
-    if (intensity <= 0.01f) return;
+int batch_index(double pos) {
+    int idx = (int)(pos * buffer_samples);
+    if (idx < 0) idx = 0;
+    if (idx > buffer_samples - 1) idx = buffer_samples - 1;
+    return idx;
+}
 
-    int copy_half_len = (int)(50 + smear_width * 350);
-    int capture_start = fmax(0, smear_start_idx - copy_half_len);
-    int capture_end = fmin(buffer_samples - 1, smear_start_idx + copy_half_len);
-    int copy_len = capture_end - capture_start + 1;
-    int paste_start = smear_start_idx + direction * current_distance;
+// Commands that edit the selected channel. Returns 1 for anything else.
+int run_batch_edit(const char *cmd, const char *line) {
+    char name[32] = "";
+    double a = 0, b = 0, c = 0, d = 0;
 
-    for (int offset = 0; offset < copy_len; offset++) {
-        int src_idx = capture_start + offset;
-        int dst_idx = paste_start + offset * direction;
-        if (dst_idx < 0 || dst_idx >= buffer_samples) continue;
-        float dist_ratio = (float)abs(dst_idx - smear_start_idx) / (current_distance + copy_len);
-        float weight = intensity * (1.0f - dist_ratio);
-        if (weight > 0.01f) {
-            float copied = waveform_buffer[src_idx];
-            waveform_buffer[dst_idx] += copied * weight;
-            if (waveform_buffer[dst_idx] > AMPLITUDE) waveform_buffer[dst_idx] = AMPLITUDE;
-            if (waveform_buffer[dst_idx] < -AMPLITUDE) waveform_buffer[dst_idx] = -AMPLITUDE;
+    if (strcmp(cmd, "brush") == 0) {
+        d = 1.0;
+        int n = sscanf(line, "%*s %lf %lf %lf %lf %31s", &a, &b, &c, &d, name);
+        if (n < 3 || c < 1) return -1;
+        int mode = 0;
+        if (n == 5) {
+            if (strcmp(name, "add") == 0) mode = 1;
+            else if (strcmp(name, "smooth") == 0) mode = 2;
+            else if (strcmp(name, "blend") != 0) return -1;
         }
+        apply_brush(batch_index(a), (float)(b * AMPLITUDE), (int)c, (float)d, mode);
+    } else if (strcmp(cmd, "multiply") == 0) {
+        if (sscanf(line, "%*s %lf %lf %lf", &a, &b, &c) != 3 || c < 1) return -1;
+        apply_multiply(batch_index(a), (float)b, (int)c);
+    } else if (strcmp(cmd, "additive") == 0) {
+        int type;
+        if (sscanf(line, "%*s %lf %lf %lf %31s", &a, &b, &c, name) != 4 || c < 1 || (type = parse_wave_type(name)) < 0) return -1;
+        apply_additive_wave(batch_index(a), (float)b, (int)c, type);
+    } else if (strcmp(cmd, "soften") == 0) {
+        c = 40;
+        if (sscanf(line, "%*s %lf %lf %lf", &a, &b, &c) < 2 || c < 1) return -1;
+        apply_lowpass_soften(batch_index(a), (float)b, (int)c);
+    } else if (strcmp(cmd, "treble") == 0 || strcmp(cmd, "mid") == 0 || strcmp(cmd, "bass") == 0) {
+        if (sscanf(line, "%*s %lf %lf", &a, &b) != 2) return -1;
+        if (cmd[0] == 't') apply_add_treble(batch_index(a), (float)b);
+        else if (cmd[0] == 'm') apply_add_mid(batch_index(a), (float)b);
+        else apply_sub_bass(batch_index(a), (float)b);
+    } else if (strcmp(cmd, "line") == 0 || strcmp(cmd, "sine_seg") == 0) {
+        if (sscanf(line, "%*s %lf %lf %lf %lf", &a, &b, &c, &d) != 4) return -1;
+        if (cmd[0] == 'l') draw_line(batch_index(a), (float)(b * AMPLITUDE), batch_index(c), (float)(d * AMPLITUDE));
+        else draw_sine_segment(batch_index(a), (float)(b * AMPLITUDE), batch_index(c), (float)(d * AMPLITUDE), 0);
+    } else if (strcmp(cmd, "smear") == 0) {
+        if (sscanf(line, "%*s %lf %lf", &a, &b) != 2) return -1;
+        smear_start_idx = batch_index(a);
+        smear_max_distance = 0.0f;
+        apply_smear(batch_index(b));
+        smear_start_idx = -1;
+    } else {
+        return 1;
     }
+    return 0;
 }
 
-void apply_brush(int center_idx, float target_val, int radius, float base_strength, int mode) {
-    float strength = base_strength * brush_intensity;
-    int start = fmax(0, center_idx - radius);
-    int end = fmin(buffer_samples - 1, center_idx + radius);
-    for (int i = start; i <= end; i++) {
-        float dist = fabsf(i - center_idx) / (float)radius;
-        if (dist < 1.0f) {
-            float weight = strength * (1.0f - dist * dist);
-            float current = waveform_buffer[i];
-            float new_val;
-            if (mode == 0) new_val = current * (1.0f - weight) + target_val * weight;
-            else if (mode == 1) new_val = current + target_val * weight;
-            else new_val = current + (target_val - current) * weight * 0.7f;
-            if (new_val > AMPLITUDE) new_val = AMPLITUDE;
-            if (new_val < -AMPLITUDE) new_val = -AMPLITUDE;
-            waveform_buffer[i] = new_val;
+int run_batch_command(char *line) {
+    char cmd[32], name[32] = "";
+    double a = 0, b = 0, c = 0;
+    char path[512];
+
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    if (sscanf(line, "%31s", cmd) != 1) return 0;
+
+    if (strcmp(cmd, "wave") == 0) {
+        int type;
+        if (sscanf(line, "%*s %31s %lf", name, &a) != 2 || (type = parse_wave_type(name)) < 0 || a <= 0) return -1;
+        current_type = (WaveType)type;
+        current_freq = a;
+        generate_classic_waveform();
+    } else if (strcmp(cmd, "clear") == 0) {
+        current_type = CUSTOM;
+        memset(channel_data, 0, (size_t)total_samples() * sizeof(float));
+        history_reset();
+        invalidate_range(0, total_samples() - 1);
+    } else if (strcmp(cmd, "intensity") == 0) {
+        if (sscanf(line, "%*s %lf", &a) != 1) return -1;
+        brush_intensity = fmax(0.0f, fmin(1.0f, a));
+    } else if (strcmp(cmd, "smear_width") == 0) {
+        if (sscanf(line, "%*s %lf", &a) != 1) return -1;
+        smear_width = fmax(0.0f, fmin(1.0f, a));
+    } else if (strcmp(cmd, "view") == 0) {
+        if (sscanf(line, "%*s %lf %lf", &a, &b) != 2 || b <= a) return -1;
+        set_view_range(batch_index(a), batch_index(b));
+    } else if (strcmp(cmd, "save") == 0 || strcmp(cmd, "load") == 0) {
+        if (sscanf(line, "%*s %511s", path) != 1) return -1;
+        return cmd[0] == 's' ? save_session(path) : load_session(path);
+    } else if (strcmp(cmd, "format") == 0) {
+        int n = sscanf(line, "%*s %lf %lf", &a, &b);
+        if (n < 1) return -1;
+        if (n < 2) b = buffer_duration();
+        if (b <= 0) return -1;
+        return set_session_format((int)a, (int)lround(a * b), channel_count);
+    } else if (strcmp(cmd, "channels") == 0) {
+        if (sscanf(line, "%*s %lf", &a) != 1) return -1;
+        return set_session_format(sample_rate, buffer_samples, (int)a);
+    } else if (strcmp(cmd, "channel") == 0) {
+        if (sscanf(line, "%*s %31s", name) != 1) return -1;
+        if (strcmp(name, "all") == 0) {
+            linked_edit = 1;
+        } else {
+            int ch = atoi(name) - 1;
+            if (ch < 0 || ch >= channel_count) return -1;
+            linked_edit = 0;
+            set_active_channel(ch);
+        }
+    } else if (strcmp(cmd, "wavetable") == 0) {
+        b = WAVETABLE_FRAME_LENGTH;
+        if (sscanf(line, "%*s %lf %lf", &a, &b) < 1) return -1;
+        return set_frame_count((int)a, (int)b);
+    } else if (strcmp(cmd, "frame") == 0) {
+        if (sscanf(line, "%*s %lf", &a) != 1 || a < 1 || a > frame_count) return -1;
+        set_active_frame((int)a - 1);
+    } else if (strcmp(cmd, "morph") == 0) {
+        if (sscanf(line, "%*s %lf", &a) != 1) return -1;
+        set_morph((float)fmax(0.0, fmin(1.0, a)));
+    } else if (strcmp(cmd, "render") == 0) {
+        // render <prefix> <type,...|all> <lowest Hz> <highest Hz> <steps> [seconds]
+        char types_arg[128];
+        int steps = 0;
+        int n = sscanf(line, "%*s %511s %127s %lf %lf %d %lf", path, types_arg, &a, &b, &steps, &c);
+        if (n < 5 || a <= 0 || b < a || steps < 1 || steps > RENDER_MAX_VARIANTS) return -1;
+        int types[8], type_count = 0;
+        if (strcmp(types_arg, "all") == 0) {
+            for (int t = SINE; t <= TRIANGLE; t++) types[type_count++] = t;
+        } else {
+            for (char *tok = strtok(types_arg, ","); tok && type_count < 8; tok = strtok(NULL, ",")) {
+                int type = strcmp(tok, "current") == 0 ? CUSTOM : parse_wave_type(tok);
+                if (type < 0) return -1;
+                types[type_count++] = type;
+            }
+        }
+        double *freqs = malloc(steps * sizeof(double));
+        if (!freqs) return -1;
+        for (int k = 0; k < steps; k++) freqs[k] = steps > 1 ? a * pow(b / a, k / (double)(steps - 1)) : a;
+        int result = render_pack(path, types, type_count, freqs, steps, n == 6 ? c : 0.0);
+        free(freqs);
+        return result;
+    } else if (strcmp(cmd, "threads") == 0) {
+        if (sscanf(line, "%*s %lf", &a) != 1 || a < 0) return -1;
+        stop_render_pool();
+        render_threads = (int)a;
+    } else if (strcmp(cmd, "analyze") == 0) {
+        harmonics_from_waveform();
+    } else if (strcmp(cmd, "harmonic") == 0) {
+        int n = sscanf(line, "%*s %lf %lf %lf", &a, &b, &c);
+        if (n < 2 || a < 1 || a > HARMONIC_COUNT) return -1;
+        harmonic_amp[(int)a] = fmax(0.0, fmin(1.0, b));
+        if (n == 3) harmonic_phase[(int)a] = (float)c;
+        resynthesize_harmonics();
+    } else if (strcmp(cmd, "interp") == 0) {
+        int mode;
+        if (sscanf(line, "%*s %31s", name) != 1 || (mode = parse_interp(name)) < 0) return -1;
+        SDL_AtomicSet(&interp_setting, mode);
+    } else if (strcmp(cmd, "export") == 0) {
+        int n = sscanf(line, "%*s %511s %lf %lf %31s", path, &a, &b, name);
+        if (n < 1) return -1;
+        int format = export_format;
+        if (n == 4 && (format = parse_export_format(name)) < 0) return -1;
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            fprintf(stderr, "Could not open %s for writing\n", path);
+            return -1;
+        }
+        ExportJob *job = create_export_job(f);
+        if (!job) { fclose(f); return -1; }
+        if (n >= 2 && a > 0) job->seconds = a;
+        if (n >= 3 && b > 0) job->rate_ratio = phase_increment * b / current_freq;
+        if (job->frames == 1 && job->rate_ratio >= job->length) {
+            fprintf(stderr, "%g Hz is too high to replay the current buffer\n", b);
+            free_export_job(job);
+            fclose(f);
+            return -1;
+        }
+        job->format = format;
+        int result = render_wav(job, NULL);
+        free_export_job(job);
+        if (result != 0) return -1;
+        printf("%s\n", path);
+    } else {
+        int result = 0;
+        for (int ch = edit_first_channel(); ch <= edit_last_channel() && result == 0; ch++) {
+            select_channel(ch);
+            result = run_batch_edit(cmd, line);
         }
+        select_channel(active_channel);
+        if (result != 0) return -1;
     }
+    return 0;
 }
 
-void apply_multiply(int center_idx, float factor, int radius) {
-    float strength = brush_intensity;
-    int start = fmax(0, center_idx - radius);
-    int end = fmin(buffer_samples - 1, center_idx + radius);
-    for (int i = start; i <= end; i++) {
-        float dist = fabsf(i - center_idx) / (float)radius;
-        if (dist < 1.0f) {
-            float weight = strength * (1.0f - dist * dist);
-            waveform_buffer[i] *= (1.0f + (factor - 1.0f) * weight);
-            if (waveform_buffer[i] > AMPLITUDE) waveform_buffer[i] = AMPLITUDE;
-            if (waveform_buffer[i] < -AMPLITUDE) waveform_buffer[i] = -AMPLITUDE;
-        }
+// Run every script given on the command line ("-" reads stdin) against one
+// session, so start-up is paid once for the whole batch.
+int run_batch(int count, char **scripts) {
+    if (count == 0) {
+        fprintf(stderr, "usage: gen --batch <script>...\n");
+        return 2;
     }
-}
+    init_session();
 
-void apply_additive_wave(int center_idx, float pitch_norm, int radius, int wave_type) {
-    float strength = brush_intensity * 0.8f;
-    int start = fmax(0, center_idx - radius);
-    int end = fmin(buffer_samples - 1, center_idx + radius);
-    double base_freq = 50.0 + pitch_norm * 400.0;
-    for (int i = start; i <= end; i++) {
-        float dist = fabsf(i - center_idx) / (float)radius;
-        if (dist >= 1.0f) continue;
-        float weight = strength * (1.0f - dist * dist);
-        double pos = (i - start) / (double)(end - start + 1);
-        double phase = pos * 2.0 * M_PI;
-        float sample = 0.0f;
-        if (wave_type == 0) sample = (float)sin(phase + base_freq * pos * 0.1);
-        else if (wave_type == 1) sample = (fmod(phase * base_freq * 0.05, 2.0 * M_PI) < M_PI) ? 1.0f : -1.0f;
-        else if (wave_type == 2) sample = (float)(2.0 * fmod(phase * base_freq * 0.05 / (2.0 * M_PI), 1.0) - 1.0);
-        else if (wave_type == 3) {
-            double tri = fmod(phase * base_freq * 0.05 / (2.0 * M_PI), 1.0);
-            sample = (tri < 0.5) ? (4.0f * tri - 1.0f) : (3.0f - 4.0f * tri);
-        }
-        waveform_buffer[i] += sample * weight * AMPLITUDE * 0.6f;
-        if (waveform_buffer[i] > AMPLITUDE) waveform_buffer[i] = AMPLITUDE;
-        if (waveform_buffer[i] < -AMPLITUDE) waveform_buffer[i] = -AMPLITUDE;
-    }
-}
-
-void apply_lowpass_soften(int center_idx, float strength) {
-    if (strength < 0.05f) return;
-    int kernel = (int)(6 + strength * 20);
-    int start = fmax(0, center_idx - 40);
-    int end = fmin(buffer_samples - 1, center_idx + 40);
-    for (int i = start; i <= end; i++) {
-        float dist = fabsf(i - center_idx) / 40.0f;
-        float envelope = strength * (1.0f - dist);
-        if (envelope < 0.05f) continue;
-        float sum = waveform_buffer[i];
-        float wsum = 1.0f;
-        for (int j = 1; j <= kernel; j++) {
-            if (i - j >= 0) { float w = 1.0f - (float)j / (kernel + 1); sum += waveform_buffer[i - j] * w; wsum += w; }
-            if (i + j < buffer_samples) { float w = 1.0f - (float)j / (kernel + 1); sum += waveform_buffer[i + j] * w; wsum += w; }
+    int errors = 0;
+    for (int i = 0; i < count; i++) {
+        FILE *f = strcmp(scripts[i], "-") == 0 ? stdin : fopen(scripts[i], "r");
+        if (!f) {
+            fprintf(stderr, "Could not open %s\n", scripts[i]);
+            errors++;
+            continue;
+        }
+        char line[1024];
+        int line_no = 0;
+        while (fgets(line, sizeof(line), f)) {
+            line_no++;
+            if (run_batch_command(line) != 0) {
+                fprintf(stderr, "%s:%d: bad command: %s", scripts[i], line_no, line);
+                errors++;
+            }
         }
-        float smoothed = sum / wsum;
-        waveform_buffer[i] = waveform_buffer[i] * (1.0f - envelope) + smoothed * envelope;
-        if (waveform_buffer[i] > AMPLITUDE) waveform_buffer[i] = AMPLITUDE;
-        if (waveform_buffer[i] < -AMPLITUDE) waveform_buffer[i] = -AMPLITUDE;
+        if (f != stdin) fclose(f);
     }
+
+    stop_render_pool();
+    if (SDL_AtomicGet(&render_failed) > 0) errors++;
+    free_session();
+    return errors ? 1 : 0;
 }
 
-void apply_shelving_brush(int center_idx, float gain_factor, float cutoff_norm, int is_low_shelf) {
-    float strength = brush_intensity * gain_factor;
-    if (strength < 0.02f) return;
-    int radius = buffer_samples / current_window_width * 40;
-    int start = fmax(0, center_idx - radius);
-    int end = fmin(buffer_samples - 1, center_idx + radius);
-    float alpha = cutoff_norm;
-    if (is_low_shelf) alpha = 1.0f - alpha;
-    float y1 = 0.0f;
-    for (int i = start; i <= end; i++) {
-        float dist = fabsf(i - center_idx) / (float)radius;
-        if (dist >= 1.0f) continue;
-        float weight = strength * (1.0f - dist * dist);
-        float x = waveform_buffer[i];
-        float y = alpha * x + (1.0f - alpha) * y1;
-        y1 = y;
-        float filtered = is_low_shelf ? y : (x - y);
-        waveform_buffer[i] += filtered * weight;
-        if (waveform_buffer[i] > AMPLITUDE) waveform_buffer[i] = AMPLITUDE;
-        if (waveform_buffer[i] < -AMPLITUDE) waveform_buffer[i] = -AMPLITUDE;
-    }
+
+// --bench: time the DSP paths headlessly over a matrix of buffer lengths
+// and brush radii. One CSV row per case goes to stdout so runs from
+// different commits can be diffed or loaded into a spreadsheet.
+#define BENCH_MAX_RUNS 400
+#define BENCH_CASE_SECONDS 0.2
+
+typedef void (*BenchFn)(int iteration, int radius);
+
+const char *bench_filter = NULL;
+Uint32 bench_seed = 1;
+
+int bench_center(int radius) {
+    bench_seed = bench_seed * 1664525u + 1013904223u;
+    int span = buffer_samples - 2 * radius;
+    return span > 0 ? radius + (int)((bench_seed >> 8) % (Uint32)span) : buffer_samples / 2;
 }
 
-void apply_add_treble(int center_idx, float mouse_strength) {
-    float gain = 0.6f + mouse_strength * 1.2f;
-    apply_shelving_brush(center_idx, gain, 0.85f, 0);
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
 }
 
-void apply_add_mid(int center_idx, float mouse_strength) {
-    float boost = 0.4f + mouse_strength * 0.8f;
-    int radius = buffer_samples / current_window_width * 50;
-    int start = fmax(0, center_idx - radius);
-    int end = fmin(buffer_samples - 1, center_idx + radius);
-    for (int i = start; i <= end; i++) {
-        float dist = fabsf(i - center_idx) / (float)radius;
-        if (dist >= 1.0f) continue;
-        float weight = boost * brush_intensity * (1.0f - dist * dist);
-        waveform_buffer[i] *= (1.0f + weight);
-        if (waveform_buffer[i] > AMPLITUDE) waveform_buffer[i] = AMPLITUDE;
-        if (waveform_buffer[i] < -AMPLITUDE) waveform_buffer[i] = -AMPLITUDE;
+// Run fn until BENCH_MAX_RUNS iterations or BENCH_CASE_SECONDS have passed
+// and report per-sample times; `work` is the samples touched per call.
+void bench_case(const char *name, int radius, double work, BenchFn fn) {
+    if (bench_filter && !strstr(name, bench_filter)) return;
+    static double times[BENCH_MAX_RUNS];
+    double freq = (double)SDL_GetPerformanceFrequency();
+    Uint64 begin = SDL_GetPerformanceCounter();
+    int runs = 0;
+    fn(-1, radius);                         // warm caches and scratch buffers
+    while (runs < BENCH_MAX_RUNS && (runs < 5 || (SDL_GetPerformanceCounter() - begin) / freq < BENCH_CASE_SECONDS)) {
+        Uint64 t0 = SDL_GetPerformanceCounter();
+        fn(runs, radius);
+        times[runs++] = (SDL_GetPerformanceCounter() - t0) * 1e9 / freq;
     }
+    qsort(times, runs, sizeof(double), compare_doubles);
+    double p50 = times[runs / 2], p90 = times[runs * 9 / 10], p99 = times[runs * 99 / 100];
+    printf("%s,%s,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.0f\n", name, brush_kernel_name, buffer_samples, radius, runs,
+           times[0] / work, p50 / work, p90 / work, p99 / work, p50);
+    fflush(stdout);
 }
 
-void apply_sub_bass(int center_idx, float mouse_strength) {
-    float gain = 0.7f + mouse_strength * 1.3f;
-    apply_shelving_brush(center_idx, gain, 0.15f, 1);
-    apply_shelving_brush(center_idx, -0.3f - mouse_strength * 0.4f, 0.7f, 0);
+void bench_generate(int it, int r) { (void)r; current_type = (WaveType)((it & 3)); generate_classic_waveform(); }
+void bench_brush_blend(int it, int r) { (void)it; apply_brush(bench_center(r), 0.1f, r, 1.0f, 0); }
+void bench_brush_add(int it, int r) { (void)it; apply_brush(bench_center(r), 0.01f, r, 1.0f, 1); }
+void bench_brush_smooth(int it, int r) { (void)it; apply_brush(bench_center(r), 0.1f, r, 0.6f, 2); }
+void bench_multiply(int it, int r) { apply_multiply(bench_center(r), (it & 1) ? 1.1f : 0.9f, r); }
+void bench_additive(int it, int r) { apply_additive_wave(bench_center(r), 0.5f, r, it & 3); }
+void bench_soften(int it, int r) { (void)it; apply_lowpass_soften(bench_center(r), 0.8f, r); }
+void bench_treble(int it, int r) { (void)it; apply_add_treble(bench_center(r), 0.5f); }
+void bench_mid(int it, int r) { (void)it; apply_add_mid(bench_center(r), 0.5f); }
+void bench_bass(int it, int r) { (void)it; apply_sub_bass(bench_center(r), 0.5f); }
+void bench_line(int it, int r) { (void)it; int c = bench_center(r); draw_line(c - r, 0.1f, c + r, -0.1f); }
+void bench_sine_segment(int it, int r) { int c = bench_center(r); draw_sine_segment(c - r, 0.1f, c + r, -0.1f, it & 1); }
+
+void bench_smear(int it, int r) {
+    (void)it;
+    int c = bench_center(r);
+    smear_start_idx = c - r / 2;
+    smear_max_distance = 0.0f;
+    apply_smear(c + r / 2);
+    smear_start_idx = -1;
 }
 
-void draw_line(int start_idx, float start_val, int end_idx, float end_val) {
-    int steps = abs(end_idx - start_idx);
-    if (steps == 0) return;
-    float dx = (float)(end_idx - start_idx);
-    for (int i = 0; i <= steps; i++) {
-        float t = i / (float)steps;
-        int idx = (int)roundf(start_idx + t * dx);
-        if (idx < 0 || idx >= buffer_samples) continue;
-        float val = start_val + t * (end_val - start_val);
-        waveform_buffer[idx] = val * brush_intensity + waveform_buffer[idx] * (1.0f - brush_intensity);
-    }
+void bench_stroke(int it, int r) {
+    (void)it;
+    begin_stroke();
+    int c = bench_center(r);
+    for (int k = 0; k < 16; k++) queue_stroke_point(c - r + k * r / 8, 0.3f);
+    flush_stroke();
 }
 
-void draw_sine_segment(int start_idx, float start_val, int end_idx, float end_val, int additive) {
-    int steps = abs(end_idx - start_idx);
-    if (steps < 10) { draw_line(start_idx, start_val, end_idx, end_val); return; }
-    float offset = (start_val + end_val) / 2.0f;
-    float amplitude = fabsf(start_val - end_val) / 2.0f + 0.05f * AMPLITUDE;
-    float dx = (float)(end_idx - start_idx);
-    for (int i = 0; i <= steps; i++) {
-        float t = i / (float)steps;
-        int idx = (int)roundf(start_idx + t * dx);
-        if (idx < 0 || idx >= buffer_samples) continue;
-        double phase = t * 2.0 * M_PI;
-        float val = offset + (float)sin(phase) * amplitude;
-        if (additive) waveform_buffer[idx] += val * brush_intensity;
-        else waveform_buffer[idx] = val * brush_intensity + waveform_buffer[idx] * (1.0f - brush_intensity);
-        if (waveform_buffer[idx] > AMPLITUDE) waveform_buffer[idx] = AMPLITUDE;
-        if (waveform_buffer[idx] < -AMPLITUDE) waveform_buffer[idx] = -AMPLITUDE;
-    }
+void bench_publish(int it, int r) {
+    (void)it;
+    apply_brush(bench_center(r), 0.1f, r, 1.0f, 0);
+    publish_waveform();
 }
 
-void render_buttons(SDL_Renderer *renderer, Button *buttons, int count, int active_idx) {
-    for (int i = 0; i < count; i++) {
-        Button *b = &buttons[i];
-        int active = (i == active_idx);
-        SDL_SetRenderDrawColor(renderer, active ? 100 : 60, active ? 220 : 70, active ? 160 : 100, 255);
-        SDL_RenderFillRect(renderer, &b->rect);
-        SDL_SetRenderDrawColor(renderer, 220, 220, 255, 255);
-        SDL_RenderDrawRect(renderer, &b->rect);
-        if (font) {
-            SDL_Surface *surf = TTF_RenderText_Shaded(font, b->label, (SDL_Color){255,255,255,255}, (SDL_Color){0,0,0,0});
-            if (surf) {
-                SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
-                SDL_Rect dst = {b->rect.x + (b->rect.w - surf->w)/2, b->rect.y + (b->rect.h - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(renderer, tex, NULL, &dst);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
-            }
+void bench_undo_commit(int it, int r) {
+    (void)it;
+    apply_brush(bench_center(r), 0.1f, r, 1.0f, 0);
+    save_undo_state();
+}
+
+void bench_undo_redo(int it, int r) {
+    (void)it; (void)r;
+    undo();
+    redo();
+}
+
+// Column spans for a full-width redraw of the current view, after an edit
+// so the peak update is part of it. There is no renderer, so nothing is
+// submitted.
+void bench_draw(int it, int r) {
+    (void)it;
+    apply_brush(bench_center(r), 0.1f, r, 1.0f, 0);
+    draw_waveform(NULL, current_window_width, 0, 300, 200.0, 0, current_window_width - 1);
+}
+
+float bench_block[VOICE_CHUNK * MAX_CHANNELS];
+int bench_interp = INTERP_LINEAR;
+
+void bench_callback(int it, int r) {
+    (void)it; (void)r;
+    audio_callback(NULL, (Uint8 *)bench_block, VOICE_CHUNK * have.channels * sizeof(float));
+}
+
+// A morph that moves every block, so each one builds and crossfades a
+// fresh pair of blended tables.
+void bench_callback_morph(int it, int r) {
+    (void)r;
+    set_morph(it & 1 ? 0.3f : 0.7f);
+    audio_callback(NULL, (Uint8 *)bench_block, VOICE_CHUNK * have.channels * sizeof(float));
+}
+
+void bench_export(int it, int r) {
+    (void)it; (void)r;
+    FILE *f = tmpfile();
+    if (!f) return;
+    ExportJob *job = create_export_job(f);
+    if (!job) { fclose(f); return; }
+    render_wav(job, NULL);
+    free_export_job(job);
+}
+
+// 32 variants per call through the worker pool, written to a scratch
+// directory so the output stage is part of the measurement.
+char bench_render_dir[64] = "";
+
+void bench_render_pack(int it, int r) {
+    (void)it; (void)r;
+    static const int types[] = {SINE, SQUARE, SAWTOOTH, TRIANGLE};
+    double freqs[8];
+    char prefix[80];
+    for (int k = 0; k < 8; k++) freqs[k] = 55.0 * pow(2.0, k / 2.0);
+    snprintf(prefix, sizeof(prefix), "%s/v", bench_render_dir);
+    render_pack(prefix, types, 4, freqs, 8, 0.0);
+    wait_render_pool();
+}
+
+void bench_render_scaling(void) {
+    strcpy(bench_render_dir, "/tmp/gen-bench-XXXXXX");
+    if (!mkdtemp(bench_render_dir)) return;
+    render_quiet = 1;
+    int cores = SDL_GetCPUCount();
+    for (int threads = 1; ; threads *= 2) {
+        if (threads > cores) threads = cores;
+        char name[64];
+        snprintf(name, sizeof(name), "render_pack_%d_threads", threads);
+        stop_render_pool();
+        render_threads = threads;
+        bench_case(name, 0, 32.0 * buffer_samples, bench_render_pack);
+        if (threads >= cores) break;
+    }
+    stop_render_pool();
+    render_threads = 0;
+    render_quiet = 0;
+
+    char path[128];
+    for (int t = SINE; t <= TRIANGLE; t++) {
+        for (int k = 0; k < 8; k++) {
+            snprintf(path, sizeof(path), "%s/v_%s_%g.wav", bench_render_dir, render_type_names[t], 55.0 * pow(2.0, k / 2.0));
+            remove(path);
         }
     }
+    rmdir(bench_render_dir);
 }
 
-void toggle_fullscreen() {
-    fullscreen = !fullscreen;
-    Uint32 flags = fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0;
-    SDL_SetWindowFullscreen(window, flags);
-    if (!fullscreen) {
-        SDL_SetWindowSize(window, INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT);
-        SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+int run_bench(const char *filter) {
+    static const int lengths[] = {24000, 96000, 960000};
+    static const int radii[] = {64, 512, 4096};
+    bench_filter = filter;
+    printf("case,kernel,buffer_samples,radius,runs,ns_per_sample_min,ns_per_sample_p50,ns_per_sample_p90,ns_per_sample_p99,ns_per_call_p50\n");
+
+    for (int l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++) {
+        init_session_length(lengths[l]);
+        bench_case("generate_classic_waveform", 0, buffer_samples, bench_generate);
+
+        for (int k = 0; k < (int)(sizeof(radii) / sizeof(radii[0])); k++) {
+            int r = radii[k];
+            if (2 * r >= buffer_samples) continue;
+            double window = 2 * r - 1;
+            bench_case("apply_brush_blend", r, window, bench_brush_blend);
+            bench_case("apply_brush_add", r, window, bench_brush_add);
+            bench_case("apply_brush_smooth", r, window, bench_brush_smooth);
+            bench_case("apply_multiply", r, window, bench_multiply);
+            bench_case("apply_additive_wave", r, window, bench_additive);
+            bench_case("apply_lowpass_soften", r, 2 * r + 1, bench_soften);
+            bench_case("apply_smear", r, 2 * (int)(50 + smear_width * 350) + 1, bench_smear);
+            bench_case("draw_line", r, 2 * r + 1, bench_line);
+            bench_case("draw_sine_segment", r, 2 * r + 1, bench_sine_segment);
+            bench_case("stroke_16_points", r, 4 * r, bench_stroke);
+            bench_case("publish_waveform", r, window, bench_publish);
+            bench_case("save_undo_state", r, window, bench_undo_commit);
+            bench_case("undo_redo", r, window, bench_undo_redo);
+
+            // The EQ brushes size their window from the view.
+            current_window_width = buffer_samples * 40 / r;
+            reset_view();
+            int eq_radius = view_radius(40);
+            bench_case("apply_add_treble", eq_radius, 2 * eq_radius - 1, bench_treble);
+            bench_case("apply_add_mid", eq_radius * 5 / 4, 2 * (eq_radius * 5 / 4) - 1, bench_mid);
+            bench_case("apply_sub_bass", eq_radius, 2 * eq_radius - 1, bench_bass);
+            current_window_width = INITIAL_WINDOW_WIDTH;
+            reset_view();
+        }
+
+        // Per-column cost with the whole buffer in view and zoomed to one
+        // sample per pixel.
+        bench_case("draw_waveform_full_view", 64, current_window_width, bench_draw);
+        set_view_range(buffer_samples / 2, buffer_samples / 2 + current_window_width - 1);
+        bench_case("draw_waveform_zoomed", 64, current_window_width, bench_draw);
+        reset_view();
+
+        // One device block, with and without a full chord of voices.
+        have.freq = sample_rate;
+        have.samples = VOICE_CHUNK;
+        have.channels = 1;
+        publish_waveform();
+        playing = 1;
+        static const char *callback_names[INTERP_MODES][2] = {
+            {"audio_callback_linear", "audio_callback_linear_16_voices"},
+            {"audio_callback_hermite", "audio_callback_hermite_16_voices"},
+            {"audio_callback_sinc", "audio_callback_sinc_16_voices"},
+        };
+        for (int m = 0; m < INTERP_MODES; m++) {
+            SDL_AtomicSet(&interp_setting, m);
+            bench_case(callback_names[m][0], 0, VOICE_CHUNK, bench_callback);
+            for (int v = 0; v < 16; v++) {
+                NoteEvent ev = {audio_frames, NOTE_ON, 48 + v * 2, 0.3f, 0};
+                ev.step = note_step(ev.note);
+                post_note_event(&ev);
+            }
+            bench_case(callback_names[m][1], 0, VOICE_CHUNK, bench_callback);
+            memset(voices, 0, sizeof(voices));
+            SDL_AtomicSet(&note_queue_tail, SDL_AtomicGet(&note_queue_head));   // unplayed if the case was filtered out
+        }
+        SDL_AtomicSet(&interp_setting, INTERP_LINEAR);
+
+        // The insert chain on top of plain linear playback.
+        init_fx_params();
+        set_fx_param(FX_ENABLED, 1.0f);
+        set_fx_param(FX_DRIVE_DB, 6.0f);
+        bench_case("audio_callback_linear_fx", 0, VOICE_CHUNK, bench_callback);
+        set_fx_param(FX_ENABLED, 0.0f);
+
+        for (int fmt = 0; fmt < EXPORT_FORMATS; fmt++) {
+            static const char *export_names[EXPORT_FORMATS] = {"render_wav_float", "render_wav_pcm16", "render_wav_pcm24"};
+            export_format = fmt;
+            export_seconds = 0.0;
+            bench_case(export_names[fmt], 0, buffer_samples, bench_export);
+        }
+        export_format = EXPORT_FLOAT32;
+
+        if (buffer_samples == 96000) bench_render_scaling();
+
+        // Wavetable playback with the morph still and moving, and the
+        // whole table written out. The table size does not depend on the
+        // buffer length, so one run is enough.
+        if (buffer_samples == 96000 && set_frame_count(WAVETABLE_FRAMES, WAVETABLE_FRAME_LENGTH) == 0) {
+            set_morph(0.5f);
+            bench_case("audio_callback_wavetable", 0, VOICE_CHUNK, bench_callback);
+            bench_case("audio_callback_wavetable_morph", 0, VOICE_CHUNK, bench_callback_morph);
+            bench_case("render_wav_wavetable", 0, (double)total_samples(), bench_export);
+            set_morph(0.0f);
+            free_session();
+            init_session_length(lengths[l]);
+            publish_waveform();
+        }
+
+        // The same block and export with every channel rendered and
+        // interleaved; per-sample cost should track the mono cases.
+        static const int bench_channels[] = {2, 4, 8};
+        for (int k = 0; k < 3; k++) {
+            char name[64];
+            set_session_format(sample_rate, buffer_samples, bench_channels[k]);
+            have.channels = bench_channels[k];
+            snprintf(name, sizeof(name), "audio_callback_linear_%dch", bench_channels[k]);
+            bench_case(name, 0, VOICE_CHUNK * bench_channels[k], bench_callback);
+            snprintf(name, sizeof(name), "render_wav_float_%dch", bench_channels[k]);
+            bench_case(name, 0, (double)total_samples(), bench_export);
+        }
+        have.channels = 1;
+
+        free_session();
+        channel_count = 1;
     }
-    SDL_Delay(100);
-    init_buttons();
+    return 0;
 }
 
 int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) return run_batch(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) return run_bench(argc > 2 ? argv[2] : NULL);
+
+    int format_given = 0;
+    init_fx_params();
+    for (int i = 1; i < argc; i++) {
+        float adsr[4];
+        int mode;
+        if (strcmp(argv[i], "--interp") == 0 && i + 1 < argc && (mode = parse_interp(argv[i + 1])) >= 0) {
+            SDL_AtomicSet(&interp_setting, mode);
+            i++;
+        } else if (strcmp(argv[i], "--export-format") == 0 && i + 1 < argc && (mode = parse_export_format(argv[i + 1])) >= 0) {
+            export_format = mode;
+            i++;
+        } else if (strcmp(argv[i], "--export-seconds") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            export_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--timeline") == 0 && i + 1 < argc) {
+            timeline_path = argv[++i];
+        } else if (strcmp(argv[i], "--session") == 0 && i + 1 < argc) {
+            session_path = argv[++i];
+        } else if (strcmp(argv[i], "--adsr") == 0 && i + 1 < argc
+                   && sscanf(argv[i + 1], "%f,%f,%f,%f", &adsr[0], &adsr[1], &adsr[2], &adsr[3]) == 4
+                   && adsr[0] >= 0 && adsr[1] >= 0 && adsr[2] >= 0 && adsr[2] <= 1 && adsr[3] >= 0) {
+            for (int k = 0; k < 4; k++) set_fx_param(FX_ATTACK + k, adsr[k]);
+            set_fx_param(FX_ENABLED, 1.0f);
+            i++;
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc && valid_sample_rate(atoi(argv[i + 1]))) {
+            sample_rate = atoi(argv[++i]);
+            format_given = 1;
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            session_seconds = atof(argv[++i]);
+            format_given = 1;
+        } else if (strcmp(argv[i], "--channels") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 1 && atoi(argv[i + 1]) <= MAX_CHANNELS) {
+            channel_count = atoi(argv[++i]);
+            format_given = 1;
+        } else {
+            fprintf(stderr, "usage: gen [--interp linear|hermite|sinc] [--export-format float|pcm16|pcm24] [--export-seconds s]\n"
+                            "           [--timeline callbacks.csv] [--session file.agsn]\n"
+                            "           [--rate 44100|48000|96000|192000] [--seconds s] [--channels 1-8] [--adsr a,d,s,r]\n"
+                            "       gen --batch <script>...\n"
+                            "       gen --bench [case-filter]\n");
+            return 2;
+        }
+    }
+
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
     TTF_Init();
 
@@ -537,47 +5452,186 @@ int main(int argc, char **argv) {
 
     window = SDL_CreateWindow("Waveform Editor", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
                               INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-
-    buffer_samples = (int)(SAMPLE_RATE * DISPLAY_DURATION);
-    waveform_buffer = calloc(buffer_samples, sizeof(float));
-    phase_increment = (double)buffer_samples / (SAMPLE_RATE * DISPLAY_DURATION);
-
-    for (int i = 0; i < UNDO_LEVELS; i++) undo_stack[i] = NULL;
-    undo_stack[0] = malloc(buffer_samples * sizeof(float));
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    SDL_RendererInfo renderer_info;
+    int vsync = SDL_GetRendererInfo(renderer, &renderer_info) == 0 && (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC);
 
-    generate_classic_waveform();
-    memcpy(undo_stack[0], waveform_buffer, buffer_samples * sizeof(float));
-    undo_index = 0;
-    undo_count = 1;
+    int requested_rate = sample_rate, requested_channels = channel_count;
+    init_session();
+    if (access(session_path, F_OK) == 0 && load_session(session_path) == 0 && format_given)
+        set_session_format(requested_rate, (int)lround(requested_rate * session_seconds), requested_channels);
+    char autosave_path[1024];
+    snprintf(autosave_path, sizeof(autosave_path), "%s.autosave", session_path);
 
     init_buttons();
     reopen_audio_device();
 
+    // Number keys 1-8 play a C major scale from middle C.
+    const int scale_notes[8] = {60, 62, 64, 65, 67, 69, 71, 72};
+
     SDL_bool running = SDL_TRUE;
     SDL_Event event;
     Uint32 export_time = 0;
+    int pack_running = 0, pack_number = 0;
+    Uint32 playback_info_time = 0;
+    Uint32 frame_time = 0;
+    Uint32 autosave_time = SDL_GetTicks();
+    Uint32 autosave_generation = waveform_generation;
+    int title_unsaved = -1;
+    char playback_info[128] = "";
+    char fx_info[160] = "";
+    char audio_stats[3][96];
+    int needs_redraw = 1;
+    wake_event = SDL_RegisterEvents(1);
 
     while (running) {
-        while (SDL_PollEvent(&event)) {
+        // Sleep until an event arrives unless a frame is owed. While playing
+        // the cursor moves every frame and vsync paces the loop instead.
+        int have_event;
+        if (needs_redraw || playing) have_event = SDL_PollEvent(&event);
+        else if (export_time > 0) {
+            Uint32 elapsed = SDL_GetTicks() - export_time;
+            have_event = SDL_WaitEventTimeout(&event, elapsed < 2000 ? 2000 - elapsed : 0);
+        }
+        else if (show_audio_stats) have_event = SDL_WaitEventTimeout(&event, 250);
+        else if (waveform_generation != saved_generation) {
+            Uint32 elapsed = SDL_GetTicks() - autosave_time;
+            have_event = SDL_WaitEventTimeout(&event, elapsed < AUTOSAVE_INTERVAL_MS ? AUTOSAVE_INTERVAL_MS - elapsed : 0);
+        }
+        else have_event = SDL_WaitEvent(&event);
+
+        for (; have_event; have_event = SDL_PollEvent(&event)) {
+            if (event.type != SDL_MOUSEMOTION || (event.motion.state & SDL_BUTTON_LMASK)) needs_redraw = 1;
+
             if (event.type == SDL_QUIT) running = SDL_FALSE;
 
+            else if (event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET) {
+                text_cache_clear();
+                layer_full_redraw = 1;
+            }
+
             else if (event.type == SDL_WINDOWEVENT && (event.window.event == SDL_WINDOWEVENT_RESIZED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+                int old_width = current_window_width;
                 init_buttons();
+                resize_view(old_width);
+            }
+
+            else if (event.type == SDL_MOUSEWHEEL) {
+                // The wheel zooms about the pointer; Shift+wheel or a sideways
+                // scroll pans by an eighth of the window per notch.
+                int flip = event.wheel.direction == SDL_MOUSEWHEEL_FLIPPED ? -1 : 1;
+                int mx, my;
+                SDL_GetMouseState(&mx, &my);
+                if (event.wheel.x) pan_view(flip * event.wheel.x * current_window_width / 8.0);
+                if (event.wheel.y && (SDL_GetModState() & KMOD_SHIFT)) pan_view(-flip * event.wheel.y * current_window_width / 8.0);
+                else if (event.wheel.y) zoom_view(pow(VIEW_ZOOM_STEP, -flip * event.wheel.y), mx);
             }
 
             else if (event.type == SDL_KEYDOWN) {
+                playback_info_time = 0;         // most keys change something the info lines show
                 if (event.key.keysym.sym == SDLK_f || event.key.keysym.sym == SDLK_F11) toggle_fullscreen();
                 else if (event.key.keysym.sym == SDLK_ESCAPE || event.key.keysym.sym == SDLK_q) running = SDL_FALSE;
-                else if (event.key.keysym.sym == SDLK_SPACE) { playing = !playing; if (playing) phase_accumulator = 0.0; }
+                else if ((event.key.keysym.mod & KMOD_CTRL) && event.key.keysym.sym == SDLK_s) save_session(session_path);
+                else if ((event.key.keysym.mod & KMOD_CTRL) && event.key.keysym.sym == SDLK_o) load_session(session_path);
+                else if (event.key.keysym.sym == SDLK_SPACE) { playing = !playing; if (playing) SDL_AtomicSet(&playhead_reset, 1); }
+                else if (event.key.keysym.sym >= SDLK_1 && event.key.keysym.sym <= SDLK_8) {
+                    if (!event.key.repeat) {
+                        // Stamp one device buffer ahead so every note sees the same latency.
+                        NoteEvent ev = {(Uint32)SDL_AtomicGet(&audio_clock) + have.samples, NOTE_ON,
+                                        scale_notes[event.key.keysym.sym - SDLK_1], 0.5f, 0};
+                        ev.step = note_step(ev.note);
+                        post_note_event(&ev);
+                    }
+                }
+                else if (event.key.keysym.sym == SDLK_a) {
+                    spectrum_mode = (spectrum_mode + 1) % SPECTRUM_MODES;
+                    spectrum_dirty = 1;
+                }
+                else if (event.key.keysym.sym == SDLK_h) {
+                    harmonic_mode = !harmonic_mode;
+                    if (harmonic_mode) harmonics_from_waveform();
+                }
+                else if (event.key.keysym.sym == SDLK_e) {
+                    export_format = (export_format + 1) % EXPORT_FORMATS;
+                }
+                else if (event.key.keysym.sym == SDLK_o) {
+                    show_audio_stats = !show_audio_stats;
+                    format_audio_stats(audio_stats);
+                }
+                else if (event.key.keysym.sym == SDLK_i) {
+                    SDL_AtomicSet(&interp_setting, (SDL_AtomicGet(&interp_setting) + 1) % INTERP_MODES);
+                }
+                else if (event.key.keysym.sym == SDLK_x) {
+                    set_fx_param(FX_ENABLED, get_fx_param(FX_ENABLED) != 0.0f ? 0.0f : 1.0f);
+                }
+                else if (event.key.keysym.sym == SDLK_v) {
+                    set_fx_param(FX_FILTER_MODE, ((int)get_fx_param(FX_FILTER_MODE) + 1) % FILTER_MODES);
+                }
+                else if (event.key.keysym.sym == SDLK_COMMA || event.key.keysym.sym == SDLK_PERIOD) {
+                    // A third of an octave per press.
+                    float step = event.key.keysym.sym == SDLK_PERIOD ? 1.259921f : 1.0f / 1.259921f;
+                    set_fx_param(FX_CUTOFF, fmaxf(20.0f, fminf(get_fx_param(FX_CUTOFF) * step, 20000.0f)));
+                }
+                else if (event.key.keysym.sym == SDLK_SEMICOLON || event.key.keysym.sym == SDLK_QUOTE) {
+                    float step = event.key.keysym.sym == SDLK_QUOTE ? 0.1f : -0.1f;
+                    set_fx_param(FX_RESONANCE, fmaxf(0.0f, fminf(get_fx_param(FX_RESONANCE) + step, 1.0f)));
+                }
+                else if (event.key.keysym.sym == SDLK_MINUS || event.key.keysym.sym == SDLK_EQUALS) {
+                    float step = event.key.keysym.sym == SDLK_EQUALS ? 3.0f : -3.0f;
+                    set_fx_param(FX_DRIVE_DB, fmaxf(0.0f, fminf(get_fx_param(FX_DRIVE_DB) + step, 24.0f)));
+                }
+                else if (event.key.keysym.sym == SDLK_n) {
+                    set_envelope_preset((envelope_preset + 1) % ENVELOPE_PRESETS);
+                }
+                else if (event.key.keysym.sym == SDLK_p) {
+                    if (!pack_running && render_default_pack(&pack_number) == 0) pack_running = 1;
+                }
+                else if (event.key.keysym.sym == SDLK_r) {
+                    int next = 0;
+                    while (next < SUPPORTED_RATES && supported_rates[next] != sample_rate) next++;
+                    int rate = supported_rates[(next + 1) % SUPPORTED_RATES];
+                    set_session_format(rate, (int)lround(rate * buffer_duration()), channel_count);
+                }
+                else if (frame_count == 1 && (event.key.keysym.sym == SDLK_LEFTBRACKET || event.key.keysym.sym == SDLK_RIGHTBRACKET)) {
+                    // Quarter-second steps; the command line and scripts take any length.
+                    double seconds = round(buffer_duration() * 4.0) / 4.0 + (event.key.keysym.sym == SDLK_RIGHTBRACKET ? 0.25 : -0.25);
+                    if (seconds >= 0.25 && seconds <= 60.0) set_session_format(sample_rate, (int)lround(sample_rate * seconds), channel_count);
+                }
+                else if (event.key.keysym.sym == SDLK_m) {
+                    // 1, 2, 4, 8 channels and back to mono.
+                    set_session_format(sample_rate, buffer_samples, channel_count * 2 <= MAX_CHANNELS ? channel_count * 2 : 1);
+                }
+                else if (event.key.keysym.sym == SDLK_HOME) {
+                    reset_view();
+                }
+                else if (event.key.keysym.sym == SDLK_w) {
+                    set_frame_count(frame_count > 1 ? 1 : WAVETABLE_FRAMES, WAVETABLE_FRAME_LENGTH);
+                }
+                else if (event.key.keysym.sym == SDLK_PAGEUP || event.key.keysym.sym == SDLK_PAGEDOWN) {
+                    int f = active_frame + (event.key.keysym.sym == SDLK_PAGEDOWN ? 1 : -1);
+                    set_active_frame(f < 0 ? 0 : f >= frame_count ? frame_count - 1 : f);
+                }
+                else if (event.key.keysym.sym == SDLK_TAB) {
+                    set_active_channel((active_channel + 1) % channel_count);
+                }
+                else if (event.key.keysym.sym == SDLK_l) {
+                    linked_edit = !linked_edit;
+                    layer_full_redraw = 1;
+                }
                 else if (event.key.keysym.sym == SDLK_c) {
                     current_type = CUSTOM;
-                    memset(waveform_buffer, 0, buffer_samples * sizeof(float));
+                    for (int c = edit_first_channel(); c <= edit_last_channel(); c++) {
+                        select_channel(c);
+                        memset(waveform_buffer, 0, buffer_samples * sizeof(float));
+                        mark_dirty(0, buffer_samples - 1);
+                    }
+                    select_channel(active_channel);
+                    publish_waveform();
                     save_undo_state();
                 }
                 else if (current_type != CUSTOM) {
-                    if (event.key.keysym.sym == SDLK_UP) { current_freq *= 1.1; generate_classic_waveform(); phase_accumulator = 0.0; }
-                    if (event.key.keysym.sym == SDLK_DOWN) { current_freq = fmax(20.0, current_freq / 1.1); generate_classic_waveform(); phase_accumulator = 0.0; }
+                    if (event.key.keysym.sym == SDLK_UP) { current_freq *= 1.1; generate_classic_waveform(); SDL_AtomicSet(&playhead_reset, 1); }
+                    if (event.key.keysym.sym == SDLK_DOWN) { current_freq = fmax(20.0, current_freq / 1.1); generate_classic_waveform(); SDL_AtomicSet(&playhead_reset, 1); }
                 }
                 else if (event.key.keysym.mod & KMOD_CTRL) {
                     if (event.key.keysym.sym == SDLK_z) undo();
@@ -585,20 +5639,26 @@ int main(int argc, char **argv) {
                 }
             }
 
+            else if (event.type == SDL_KEYUP && event.key.keysym.sym >= SDLK_1 && event.key.keysym.sym <= SDLK_8) {
+                NoteEvent ev = {(Uint32)SDL_AtomicGet(&audio_clock) + have.samples, NOTE_OFF,
+                                scale_notes[event.key.keysym.sym - SDLK_1], 0.0f, 0};
+                post_note_event(&ev);
+            }
+
             else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT) {
                 int mx = event.button.x, my = event.button.y;
                 int button_clicked = 0;
 
                 for (int i = 0; i < 4; i++) if (SDL_PointInRect(&(SDL_Point){mx,my}, &wave_buttons[i].rect)) {
-                    current_type = (WaveType)i; generate_classic_waveform(); phase_accumulator = 0.0; button_clicked = 1;
+                    current_type = (WaveType)i; generate_classic_waveform(); SDL_AtomicSet(&playhead_reset, 1); button_clicked = 1;
                 }
                 for (int i = 0; i < 18; i++) if (SDL_PointInRect(&(SDL_Point){mx,my}, &tool_buttons[i].rect)) {
                     draw_mode = (DrawMode)i; line_start_idx = -1; smear_start_idx = -1; smear_max_distance = 0.0f; button_clicked = 1;
                 }
                 if (SDL_PointInRect(&(SDL_Point){mx,my}, &control_buttons[0].rect)) {
-                    playing = !playing; if (playing) phase_accumulator = 0.0; button_clicked = 1;
+                    playing = !playing; if (playing) SDL_AtomicSet(&playhead_reset, 1); button_clicked = 1;
                 }
-                if (SDL_PointInRect(&(SDL_Point){mx,my}, &export_button.rect)) { export_wav(); export_time = SDL_GetTicks(); button_clicked = 1; }
+                if (SDL_PointInRect(&(SDL_Point){mx,my}, &export_button.rect)) { export_wav(); button_clicked = 1; }
                 if (SDL_PointInRect(&(SDL_Point){mx,my}, &intensity_bar.rect)) {
                     brush_intensity = (mx - intensity_bar.rect.x) / (float)intensity_bar.rect.w;
                     brush_intensity = fmax(0.0f, fmin(1.0f, brush_intensity)); button_clicked = 1;
@@ -607,6 +5667,17 @@ int main(int argc, char **argv) {
                     smear_width = (mx - smear_width_bar.rect.x) / (float)smear_width_bar.rect.w;
                     smear_width = fmax(0.0f, fmin(1.0f, smear_width)); button_clicked = 1;
                 }
+                if (frame_count > 1 && SDL_PointInRect(&(SDL_Point){mx,my}, &morph_bar.rect)) {
+                    set_morph(fmaxf(0.0f, fminf(1.0f, (mx - morph_bar.rect.x) / (float)morph_bar.rect.w))); button_clicked = 1;
+                }
+
+                if (harmonic_mode && SDL_PointInRect(&(SDL_Point){mx,my}, &spectrum_rect)) {
+                    save_undo_state();
+                    harmonic_drag = 1;
+                    harmonic_last = -1;
+                    paint_harmonics(mx, my, SDL_GetModState() & KMOD_SHIFT);
+                    button_clicked = 1;
+                }
 
                 // NEW: Undo / Redo button clicks
                 if (SDL_PointInRect(&(SDL_Point){mx,my}, &undo_button.rect)) {
@@ -620,24 +5691,34 @@ int main(int argc, char **argv) {
                 int waveform_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
                 if (!button_clicked && my >= waveform_top && my < waveform_top + waveform_height) {
                     current_type = CUSTOM;
+                    // A click picks the channel by its lane; the second click
+                    // of a line stays with the first one's channel.
+                    if (line_start_idx == -1) set_active_channel(channel_at(my));
                     save_undo_state();
-                    int idx = (int)((mx / (double)current_window_width) * buffer_samples);
+                    int idx = view_sample(mx);
+                    int lane_top, lane_height;
+                    channel_lane(active_channel, &lane_top, &lane_height);
+                    double norm_y = ((lane_top + lane_height / 2) - my) / (lane_height * LANE_SCALE);
+                    norm_y = fmax(-1.0, fmin(1.0, norm_y));
                     if (draw_mode == DRAW_LINE || draw_mode == DRAW_SINE) {
                         if (line_start_idx == -1) {
                             line_start_idx = idx;
-                            double norm_y = ((waveform_top + waveform_height / 2) - my) / (waveform_height * 0.9);
-                            norm_y = fmax(-1.0, fmin(1.0, norm_y));
                             line_start_val = (float)(norm_y * AMPLITUDE * 0.8);
                         } else {
-                            double norm_y = ((waveform_top + waveform_height / 2) - my) / (waveform_height * 0.9);
-                            norm_y = fmax(-1.0, fmin(1.0, norm_y));
                             float end_val = (float)(norm_y * AMPLITUDE * 0.8);
-                            if (draw_mode == DRAW_LINE) draw_line(line_start_idx, line_start_val, idx, end_val);
-                            else draw_sine_segment(line_start_idx, line_start_val, idx, end_val, 0);
+                            for (int c = edit_first_channel(); c <= edit_last_channel(); c++) {
+                                select_channel(c);
+                                if (draw_mode == DRAW_LINE) draw_line(line_start_idx, line_start_val, idx, end_val);
+                                else draw_sine_segment(line_start_idx, line_start_val, idx, end_val, 0);
+                            }
+                            select_channel(active_channel);
+                            publish_waveform();
+                            save_undo_state();
                             line_start_idx = -1;
                         }
                     } else {
                         drawing = 1;
+                        begin_stroke();
                         if (draw_mode == DRAW_SMEAR) { smear_start_idx = idx; smear_current_idx = idx; smear_max_distance = 0.0f; }
                     }
                 }
@@ -652,61 +5733,101 @@ int main(int argc, char **argv) {
                     smear_width = (mx - smear_width_bar.rect.x) / (float)smear_width_bar.rect.w;
                     smear_width = fmax(0.0f, fmin(1.0f, smear_width));
                 }
+                if (frame_count > 1 && SDL_PointInRect(&(SDL_Point){mx,my}, &morph_bar.rect))
+                    set_morph(fmaxf(0.0f, fminf(1.0f, (mx - morph_bar.rect.x) / (float)morph_bar.rect.w)));
+
+                if (harmonic_drag) paint_harmonics(mx, my, SDL_GetModState() & KMOD_SHIFT);
 
                 int waveform_top = (int)(current_window_height * WAVEFORM_TOP_MARGIN_RATIO);
                 int waveform_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
                 if (drawing && my >= waveform_top && my < waveform_top + waveform_height) {
-                    int idx = (int)((mx / (double)current_window_width) * buffer_samples);
-                    int wave_y_center = waveform_top + waveform_height / 2;
-                    double norm_y = (wave_y_center - my) / (waveform_height * 0.9);
+                    int idx = view_sample(mx);
+                    int lane_top, lane_height;
+                    channel_lane(active_channel, &lane_top, &lane_height);
+                    double norm_y = ((lane_top + lane_height / 2) - my) / (lane_height * LANE_SCALE);
                     norm_y = fmax(-1.0, fmin(1.0, norm_y));
-                    float mouse_strength = (norm_y > 0.0f) ? norm_y : 0.3f;
-
-                    if (draw_mode == DRAW_SMEAR) { smear_current_idx = idx; apply_smear(idx); }
-                    else if (draw_mode >= DRAW_ADD_SINE && draw_mode <= DRAW_ADD_TRIANGLE) {
-                        float pitch_norm = (norm_y + 1.0) / 2.0;
-                        int radius = buffer_samples / current_window_width * 30;
-                        int wave_type = draw_mode - DRAW_ADD_SINE;
-                        apply_additive_wave(idx, pitch_norm, radius, wave_type);
-                    }
-                    else if (draw_mode == DRAW_MULTIPLY || draw_mode == DRAW_AMPLIFY) {
-                        float factor = (draw_mode == DRAW_AMPLIFY)
-                            ? (norm_y > 0 ? 1.0f + norm_y * 3.0f : 1.0f + norm_y * 0.8f)
-                            : (norm_y > 0 ? 1.5f : 0.7f);
-                        int radius = buffer_samples / current_window_width * 25;
-                        apply_multiply(idx, factor, radius);
-                    }
-                    else if (draw_mode == DRAW_SOFTEN) {
-                        float soften_strength = brush_intensity * (norm_y < 0 ? (1.0f - norm_y) : 0.5f);
-                        apply_lowpass_soften(idx, soften_strength);
-                    }
-                    else if (draw_mode == DRAW_ADD_TREBLE) apply_add_treble(idx, mouse_strength);
-                    else if (draw_mode == DRAW_ADD_MID) apply_add_mid(idx, mouse_strength);
-                    else if (draw_mode == DRAW_SUB_BASS) apply_sub_bass(idx, mouse_strength);
-                    else if (draw_mode != DRAW_LINE && draw_mode != DRAW_SINE) {
-                        float value = (float)(norm_y * AMPLITUDE * 0.8);
-                        int radius = buffer_samples / current_window_width * ((draw_mode == DRAW_SMOOTH || draw_mode == DRAW_ADD_SMOOTH || draw_mode == DRAW_BLEND) ? 25 : 15);
-                        float bstrength = (draw_mode == DRAW_SMOOTH || draw_mode == DRAW_ADD_SMOOTH || draw_mode == DRAW_BLEND) ? 0.6f : 1.0f;
-                        int mode = (draw_mode == DRAW_BLEND) ? 2 : ((draw_mode == DRAW_ADD_FREE || draw_mode == DRAW_ADD_SMOOTH) ? 1 : 0);
-                        apply_brush(idx, value, radius, bstrength, mode);
-                    }
+                    queue_stroke_point(idx, (float)norm_y);
                 }
             }
             else if (event.type == SDL_MOUSEBUTTONUP && event.button.button == SDL_BUTTON_LEFT) {
-                if (drawing && current_type == CUSTOM) save_undo_state();
+                if (drawing) flush_stroke();
+                if ((drawing || harmonic_drag) && current_type == CUSTOM) save_undo_state();
                 drawing = 0;
+                harmonic_drag = 0;
                 smear_start_idx = -1;
                 smear_max_distance = 0.0f;
             }
         }
 
-        if (export_time > 0 && SDL_GetTicks() - export_time > 2000) {
-            strncpy(export_button.label, "Export WAV", 31);
+        if (drawing) flush_stroke();
+
+        // Autosave goes to its own file so it never replaces an explicit save.
+        if (SDL_GetTicks() - autosave_time >= AUTOSAVE_INTERVAL_MS) {
+            if (!drawing && waveform_generation != autosave_generation) {
+                Uint32 saved = saved_generation;
+                if (save_session(autosave_path) == 0) autosave_generation = waveform_generation;
+                saved_generation = saved;
+            }
+            autosave_time = SDL_GetTicks();
+        }
+        if ((waveform_generation != saved_generation) != title_unsaved) {
+            title_unsaved = waveform_generation != saved_generation;
+            char title[1100];
+            snprintf(title, sizeof(title), "Waveform Editor - %s%s", session_path, title_unsaved ? " *" : "");
+            SDL_SetWindowTitle(window, title);
+        }
+
+        if (export_worker) {
+            int result = SDL_AtomicGet(&export_result);
+            if (result != 0) {
+                SDL_WaitThread(export_worker, NULL);
+                export_worker = NULL;
+                if (result > 0) snprintf(export_button.label, 32, "Saved %03d.wav", export_number);
+                else strncpy(export_button.label, "Export failed", 31);
+                export_time = SDL_GetTicks();
+            } else {
+                snprintf(export_button.label, 32, "Exporting %d%%", SDL_AtomicGet(&export_progress) / 10);
+            }
+        } else if (export_time > 0 && SDL_GetTicks() - export_time >= 2000) {
             export_time = 0;
+            needs_redraw = 1;
+        }
+        if (!export_worker && pack_running) {
+            int left = SDL_AtomicGet(&render_outstanding);
+            if (left > 0) {
+                snprintf(export_button.label, 32, "Rendering pack, %d left", left);
+            } else {
+                pack_running = 0;
+                snprintf(export_button.label, 32, "Saved pack_%03d", pack_number);
+                export_time = SDL_GetTicks();
+            }
+        }
+        if (!export_worker && !pack_running && export_time == 0)
+            snprintf(export_button.label, 32, "Export WAV (%s)", export_format_names[export_format]);
+
+        // Refreshed a few times a second so the cached text stays reusable.
+        if (SDL_GetTicks() - playback_info_time >= 250) {
+            snprintf(playback_info, sizeof(playback_info), "Playback: %s (I), %.1f us per %d-sample block, %d Hz (R), %.2f s ([ ]), %d ch (M)",
+                     interp_names[SDL_AtomicGet(&interp_setting)], SDL_AtomicGet(&block_cost_ns) / 1000.0, have.samples,
+                     sample_rate, buffer_duration(), channel_count);
+            if (get_fx_param(FX_ENABLED) != 0.0f)
+                snprintf(fx_info, sizeof(fx_info), "Effects (X): %s (V) %.0f Hz (, .) res %.1f (; ') drive %.0f dB (- =) envelope %s (N)",
+                         filter_mode_names[(int)get_fx_param(FX_FILTER_MODE)], get_fx_param(FX_CUTOFF), get_fx_param(FX_RESONANCE),
+                         get_fx_param(FX_DRIVE_DB), envelope_names[envelope_preset]);
+            else
+                snprintf(fx_info, sizeof(fx_info), "Effects (X): off");
+            if (show_audio_stats) {
+                format_audio_stats(audio_stats);
+                needs_redraw = 1;
+            }
+            playback_info_time = SDL_GetTicks();
         }
 
+        if (!needs_redraw && !playing) continue;
+        needs_redraw = 0;
+
         if (current_type == CUSTOM)
-            snprintf(control_buttons[1].label, 32, "Undo (%d)  Redo (%d)", undo_count, UNDO_LEVELS - undo_count);
+            snprintf(control_buttons[1].label, 32, "Undo (%d)  Redo (%d)", history_pos, history_count - history_pos);
         else
             snprintf(control_buttons[1].label, 32, "Freq: %.1f Hz", current_freq);
 
@@ -715,25 +5836,47 @@ int main(int argc, char **argv) {
 
         int waveform_top = (int)(current_window_height * WAVEFORM_TOP_MARGIN_RATIO);
         int waveform_height = (int)(current_window_height * WAVEFORM_HEIGHT_RATIO);
-        int wave_y_center = waveform_top + waveform_height / 2;
-        double scale_x = (double)current_window_width / buffer_samples;
-        double scale_y = waveform_height * 0.9;
 
-        SDL_SetRenderDrawColor(renderer, 0, 255, 200, 255);
-        for (int i = 1; i < buffer_samples; i += 2) {
-            int x1 = (int)((i-1) * scale_x);
-            int x2 = (int)(i * scale_x);
-            int y1 = wave_y_center - (int)(waveform_buffer[i-1] / AMPLITUDE * scale_y);
-            int y2 = wave_y_center - (int)(waveform_buffer[i] / AMPLITUDE * scale_y);
-            SDL_RenderDrawLine(renderer, x1, y1, x2, y2);
+        if (update_waveform_layer(renderer, current_window_width, current_window_height)) {
+            SDL_RenderCopy(renderer, waveform_layer, NULL, NULL);
+        } else {
+            draw_channels(renderer, current_window_width, 0, current_window_width - 1);
+        }
+
+        for (int c = 0; c < channel_count; c++) {
+            int lane_top, lane_height;
+            channel_lane(c, &lane_top, &lane_height);
+            int lane_center = lane_top + lane_height / 2;
+            SDL_SetRenderDrawColor(renderer, 80, 80, 80, 255);
+            SDL_RenderDrawLine(renderer, 0, lane_center, current_window_width, lane_center);
+            if (channel_count > 1) {
+                char label[48];
+                int editing = c >= edit_first_channel() && c <= edit_last_channel();
+                snprintf(label, sizeof(label), "Ch %d%s", c + 1, editing ? (linked_edit ? " (linked, L)" : " (editing, Tab)") : "");
+                draw_text(renderer, label, (SDL_Color){150,220,200,255}, 8, lane_top + 4);
+            }
         }
 
-        SDL_SetRenderDrawColor(renderer, 80, 80, 80, 255);
-        SDL_RenderDrawLine(renderer, 0, wave_y_center, current_window_width, wave_y_center);
+        // The readout changes while zooming; the help next to it does not,
+        // so it stays cached on its own.
+        char view_info[80];
+        snprintf(view_info, sizeof(view_info), "Samples %d-%d of %d, %.3g per pixel",
+                 view_sample(0), view_sample(current_window_width - 1), buffer_samples, view_spp);
+        CachedText *view_text = get_text(renderer, view_info, (SDL_Color){150,220,200,255});
+        if (view_text) {
+            SDL_RenderCopy(renderer, view_text->texture, NULL, &(SDL_Rect){20, waveform_top + waveform_height - 24, view_text->w, view_text->h});
+            draw_text(renderer, "(wheel: zoom, Shift+wheel: pan, Home: all)", (SDL_Color){150,220,200,255},
+                      20 + view_text->w + 10, waveform_top + waveform_height - 24);
+        }
+        if (frame_count > 1) {
+            char frame_info[96];
+            snprintf(frame_info, sizeof(frame_info), "Frame %d/%d (PgUp/PgDn), morph %.0f%%",
+                     active_frame + 1, frame_count, get_morph() * 100);
+            draw_text(renderer, frame_info, (SDL_Color){150,220,200,255}, 20, waveform_top + waveform_height - 48);
+        }
 
         if (playing) {
-            double pos = phase_accumulator / buffer_samples;
-            int cursor_x = (int)(pos * current_window_width);
+            int cursor_x = (int)floor(view_x(SDL_AtomicGet(&playhead_position)));
             SDL_SetRenderDrawColor(renderer, 255, 80, 80, 255);
             for (int o = -3; o <= 3; o++) {
                 int x = cursor_x + o;
@@ -741,6 +5884,12 @@ int main(int argc, char **argv) {
             }
         }
 
+        if (harmonic_mode) draw_harmonics(renderer);
+        else {
+            request_spectrum();
+            draw_spectrum(renderer);
+        }
+
         render_buttons(renderer, wave_buttons, 4, current_type);
         render_buttons(renderer, tool_buttons, 18, draw_mode);
         render_buttons(renderer, control_buttons, 2, playing ? 0 : -1);
@@ -749,46 +5898,21 @@ int main(int argc, char **argv) {
         SDL_RenderFillRect(renderer, &export_button.rect);
         SDL_SetRenderDrawColor(renderer, 220, 220, 255, 255);
         SDL_RenderDrawRect(renderer, &export_button.rect);
-        if (font) {
-            SDL_Surface *surf = TTF_RenderText_Shaded(font, export_button.label, (SDL_Color){255,255,255,255}, (SDL_Color){0,0,0,0});
-            if (surf) {
-                SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
-                SDL_Rect dst = {export_button.rect.x + (export_button.rect.w - surf->w)/2, export_button.rect.y + (export_button.rect.h - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(renderer, tex, NULL, &dst);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
-            }
-        }
+        draw_text_centered(renderer, export_button.label, (SDL_Color){255,255,255,255}, &export_button.rect);
 
         // Render Undo and Redo buttons
-        SDL_SetRenderDrawColor(renderer, undo_count > 0 ? 70 : 40, 180, undo_count > 0 ? 255 : 120, 255);
+        SDL_SetRenderDrawColor(renderer, history_pos > 0 ? 70 : 40, 180, history_pos > 0 ? 255 : 120, 255);
         SDL_RenderFillRect(renderer, &undo_button.rect);
         SDL_SetRenderDrawColor(renderer, 220, 220, 255, 255);
         SDL_RenderDrawRect(renderer, &undo_button.rect);
 
-        SDL_SetRenderDrawColor(renderer, undo_count < UNDO_LEVELS ? 70 : 40, undo_count < UNDO_LEVELS ? 220 : 120, 180, 255);
+        SDL_SetRenderDrawColor(renderer, history_pos < history_count ? 70 : 40, history_pos < history_count ? 220 : 120, 180, 255);
         SDL_RenderFillRect(renderer, &redo_button.rect);
         SDL_SetRenderDrawColor(renderer, 220, 220, 255, 255);
         SDL_RenderDrawRect(renderer, &redo_button.rect);
 
-        if (font) {
-            SDL_Surface *surf = TTF_RenderText_Shaded(font, undo_button.label, (SDL_Color){255,255,255,255}, (SDL_Color){0,0,0,0});
-            if (surf) {
-                SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
-                SDL_Rect dst = {undo_button.rect.x + (undo_button.rect.w - surf->w)/2, undo_button.rect.y + (undo_button.rect.h - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(renderer, tex, NULL, &dst);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
-            }
-            surf = TTF_RenderText_Shaded(font, redo_button.label, (SDL_Color){255,255,255,255}, (SDL_Color){0,0,0,0});
-            if (surf) {
-                SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
-                SDL_Rect dst = {redo_button.rect.x + (redo_button.rect.w - surf->w)/2, redo_button.rect.y + (redo_button.rect.h - surf->h)/2, surf->w, surf->h};
-                SDL_RenderCopy(renderer, tex, NULL, &dst);
-                SDL_DestroyTexture(tex);
-                SDL_FreeSurface(surf);
-            }
-        }
+        draw_text_centered(renderer, undo_button.label, (SDL_Color){255,255,255,255}, &undo_button.rect);
+        draw_text_centered(renderer, redo_button.label, (SDL_Color){255,255,255,255}, &redo_button.rect);
 
         SDL_SetRenderDrawColor(renderer, 70, 70, 100, 255);
         SDL_RenderFillRect(renderer, &intensity_bar.rect);
@@ -802,30 +5926,57 @@ int main(int argc, char **argv) {
         fill = smear_width_bar.rect; fill.w = (int)(fill.w * smear_width); SDL_RenderFillRect(renderer, &fill);
         SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); SDL_RenderDrawRect(renderer, &smear_width_bar.rect);
 
-        if (font) {
-            char txt[64];
-            snprintf(txt, 64, "Brush Intensity: %.0f%%", brush_intensity * 100);
-            SDL_Surface *surf = TTF_RenderText_Shaded(font, txt, (SDL_Color){200,255,200,255}, (SDL_Color){0,0,0,0});
-            if (surf) { SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf); SDL_Rect r = {intensity_bar.rect.x, intensity_bar.rect.y - 30, surf->w, surf->h}; SDL_RenderCopy(renderer, tex, NULL, &r); SDL_DestroyTexture(tex); SDL_FreeSurface(surf); }
-
-            const char *hint1 = "EQ Tools: brush higher = stronger effect";
-            surf = TTF_RenderText_Shaded(font, hint1, (SDL_Color){255,255,150,255}, (SDL_Color){0,0,0,0});
-            if (surf) { SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf); SDL_Rect r = {20, 50, surf->w, surf->h}; SDL_RenderCopy(renderer, tex, NULL, &r); SDL_DestroyTexture(tex); SDL_FreeSurface(surf); }
+        if (frame_count > 1) {
+            SDL_SetRenderDrawColor(renderer, 70, 70, 100, 255);
+            SDL_RenderFillRect(renderer, &morph_bar.rect);
+            SDL_SetRenderDrawColor(renderer, 180, 120, 255, 255);
+            fill = morph_bar.rect; fill.w = (int)(fill.w * get_morph()); SDL_RenderFillRect(renderer, &fill);
+            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); SDL_RenderDrawRect(renderer, &morph_bar.rect);
+        }
 
-            const char *hint2 = "Click Undo / Redo buttons  (or Ctrl+Z / Ctrl+Y)";
-            surf = TTF_RenderText_Shaded(font, hint2, (SDL_Color){150,255,255,255}, (SDL_Color){0,0,0,0});
-            if (surf) { SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf); SDL_Rect r = {20, 80, surf->w, surf->h}; SDL_RenderCopy(renderer, tex, NULL, &r); SDL_DestroyTexture(tex); SDL_FreeSurface(surf); }
+        char txt[64];
+        snprintf(txt, 64, "Brush Intensity: %.0f%%", brush_intensity * 100);
+        draw_text(renderer, txt, (SDL_Color){200,255,200,255}, intensity_bar.rect.x, intensity_bar.rect.y - 30);
+        draw_text(renderer, playback_info, (SDL_Color){200,200,255,255}, 20, 20);
+        draw_text(renderer, "EQ Tools: brush higher = stronger effect", (SDL_Color){255,255,150,255}, 20, 50);
+        draw_text(renderer, fx_info, (SDL_Color){255,200,160,255}, 420, 50);
+        // One short string per hint, so each stays in the text cache.
+        static const char *key_hints[] = {
+            "Click Undo / Redo buttons  (or Ctrl+Z / Ctrl+Y)", "Keys 1-8: play notes", "A: spectrum", "H: harmonics",
+            "O: audio stats", "P: render pack", "W: wavetable", "Ctrl+S / Ctrl+O: session",
+        };
+        int hint_x = 20;
+        for (int i = 0; i < (int)(sizeof(key_hints) / sizeof(key_hints[0])); i++) {
+            CachedText *t = get_text(renderer, key_hints[i], (SDL_Color){150,255,255,255});
+            if (!t) break;
+            SDL_RenderCopy(renderer, t->texture, NULL, &(SDL_Rect){hint_x, 80, t->w, t->h});
+            hint_x += t->w + 30;
         }
 
+        if (show_audio_stats) draw_audio_stats(renderer, audio_stats);
+
+        text_cache_end_frame();
         SDL_RenderPresent(renderer);
-        SDL_Delay(16);
+
+        // Without vsync, cap continuous redraws at about 60 frames a second.
+        if (!vsync) {
+            Uint32 spent = SDL_GetTicks() - frame_time;
+            if (spent < 16) SDL_Delay(16 - spent);
+            frame_time = SDL_GetTicks();
+        }
     }
 
-    for (int i = 0; i < UNDO_LEVELS; i++) if (undo_stack[i]) free(undo_stack[i]);
-    free(waveform_buffer);
+    if (export_worker) SDL_WaitThread(export_worker, NULL);
+    stop_render_pool();
+    stop_analyzer();
+    wake_event = (Uint32)-1;
+    if (audio_device) SDL_CloseAudioDevice(audio_device);
+    if (timeline_path) write_audio_timeline(timeline_path);
+    free_session();
+    text_cache_clear();
+    free_waveform_layer();
     if (font) TTF_CloseFont(font);
     TTF_Quit();
-    if (audio_device) SDL_CloseAudioDevice(audio_device);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();